@@ -0,0 +1,285 @@
+/*
+  Attribute cache
+
+  Like the directory cache, this is split into shards that each have
+  their own lock, picked by the high bits of a hash of (dev, ino).
+  Each shard has a chained hash table and an LRU list through the
+  same entries, and a fixed share of the capacity; when full, the
+  least recently used entry is reused for the new one.
+
+  Every shard also counts invalidations.  put() only stores when the
+  count is still what it was when the caller took its generation,
+  which costs a few spurious misses but never keeps a stat taken
+  before a change that was invalidated meanwhile.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "attrcache.h"
+
+#define ATTRCACHE_SHARDS 64
+
+struct attrcache_entry {
+    struct attrcache_entry *next;	// hash chain
+    struct attrcache_entry *lru_prev;	// most recently used first
+    struct attrcache_entry *lru_next;
+    struct timespec when;
+    struct stat st;
+};
+
+struct attrcache_shard {
+    pthread_mutex_t lock;
+    struct attrcache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t capacity;
+    uint64_t gen;
+    struct attrcache_entry *lru_head;
+    struct attrcache_entry *lru_tail;
+};
+
+struct ypfs_attrcache {
+    struct attrcache_shard shards[ATTRCACHE_SHARDS];
+};
+
+static uint64_t attrcache_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t) dev;
+
+    return h ^ (h >> 31);
+}
+
+static struct attrcache_shard *attrcache_shard(struct ypfs_attrcache *cache, uint64_t hash)
+{
+    // low bits pick the bucket, so pick the shard from the high ones
+    return &cache->shards[hash >> 58];
+}
+
+struct ypfs_attrcache *ypfs_attrcache_new(size_t capacity)
+{
+    struct ypfs_attrcache *cache;
+    struct attrcache_shard *shard;
+    size_t nbuckets;
+    int i;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+	return NULL;
+
+    capacity = (capacity + ATTRCACHE_SHARDS - 1) / ATTRCACHE_SHARDS;
+    if (capacity == 0)
+	capacity = 1;
+    for (nbuckets = 1; nbuckets < capacity; nbuckets *= 2)
+	;
+
+    for (i = 0; i < ATTRCACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+	pthread_mutex_init(&shard->lock, NULL);
+	shard->capacity = capacity;
+	shard->nbuckets = nbuckets;
+	shard->buckets = calloc(nbuckets, sizeof(struct attrcache_entry *));
+	if (shard->buckets == NULL) {
+	    ypfs_attrcache_free(cache);
+	    return NULL;
+	}
+    }
+
+    return cache;
+}
+
+void ypfs_attrcache_free(struct ypfs_attrcache *cache)
+{
+    struct attrcache_shard *shard;
+    struct attrcache_entry *e, *next;
+    int i;
+
+    if (cache == NULL)
+	return;
+
+    for (i = 0; i < ATTRCACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+	for (e = shard->lru_head; e != NULL; e = next) {
+	    next = e->lru_next;
+	    free(e);
+	}
+	free(shard->buckets);
+	pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+// call with shard->lock held
+static struct attrcache_entry **attrcache_find(struct attrcache_shard *shard, uint64_t hash,
+					       dev_t dev, ino_t ino)
+{
+    struct attrcache_entry **ep;
+
+    for (ep = &shard->buckets[hash & (shard->nbuckets - 1)]; *ep != NULL; ep = &(*ep)->next)
+	if ((*ep)->st.st_ino == ino && (*ep)->st.st_dev == dev)
+	    break;
+    return ep;
+}
+
+// call with shard->lock held
+static void attrcache_lru_unlink(struct attrcache_shard *shard, struct attrcache_entry *e)
+{
+    if (e->lru_prev != NULL)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	shard->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	shard->lru_tail = e->lru_prev;
+}
+
+// call with shard->lock held
+static void attrcache_lru_push(struct attrcache_shard *shard, struct attrcache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+	shard->lru_head->lru_prev = e;
+    else
+	shard->lru_tail = e;
+    shard->lru_head = e;
+}
+
+static double attrcache_age(const struct timespec *when)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (now.tv_sec - when->tv_sec) + (now.tv_nsec - when->tv_nsec) / 1e9;
+}
+
+int ypfs_attrcache_get(struct ypfs_attrcache *cache, dev_t dev, ino_t ino, double maxage,
+		       struct stat *st)
+{
+    uint64_t hash = attrcache_hash(dev, ino);
+    struct attrcache_shard *shard;
+    struct attrcache_entry *e;
+    int hit = 0;
+
+    if (cache == NULL)
+	return 0;
+    shard = attrcache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    e = *attrcache_find(shard, hash, dev, ino);
+    if (e != NULL && attrcache_age(&e->when) <= maxage) {
+	*st = e->st;
+	attrcache_lru_unlink(shard, e);
+	attrcache_lru_push(shard, e);
+	hit = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return hit;
+}
+
+uint64_t ypfs_attrcache_gen(struct ypfs_attrcache *cache, dev_t dev, ino_t ino)
+{
+    struct attrcache_shard *shard;
+    uint64_t gen;
+
+    if (cache == NULL)
+	return 0;
+    shard = attrcache_shard(cache, attrcache_hash(dev, ino));
+
+    pthread_mutex_lock(&shard->lock);
+    gen = shard->gen;
+    pthread_mutex_unlock(&shard->lock);
+
+    return gen;
+}
+
+void ypfs_attrcache_put(struct ypfs_attrcache *cache, const struct stat *st, uint64_t gen)
+{
+    uint64_t hash = attrcache_hash(st->st_dev, st->st_ino);
+    struct attrcache_shard *shard;
+    struct attrcache_entry **ep;
+    struct attrcache_entry *e;
+
+    if (cache == NULL)
+	return;
+    shard = attrcache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->gen != gen)
+	goto out;
+
+    ep = attrcache_find(shard, hash, st->st_dev, st->st_ino);
+    e = *ep;
+    if (e != NULL)
+	attrcache_lru_unlink(shard, e);
+    else {
+	if (shard->count < shard->capacity) {
+	    e = malloc(sizeof(*e));
+	    if (e == NULL)
+		goto out;
+	    shard->count++;
+	} else {
+	    // reuse the least recently used entry
+	    e = shard->lru_tail;
+	    attrcache_lru_unlink(shard, e);
+	    ep = attrcache_find(shard, attrcache_hash(e->st.st_dev, e->st.st_ino),
+				e->st.st_dev, e->st.st_ino);
+	    *ep = e->next;
+	}
+	ep = &shard->buckets[hash & (shard->nbuckets - 1)];
+	e->next = *ep;
+	*ep = e;
+    }
+    e->st = *st;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &e->when);
+    attrcache_lru_push(shard, e);
+
+ out:
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ypfs_attrcache_invalidate(struct ypfs_attrcache *cache, dev_t dev, ino_t ino)
+{
+    uint64_t hash = attrcache_hash(dev, ino);
+    struct attrcache_shard *shard;
+    struct attrcache_entry **ep;
+    struct attrcache_entry *e;
+
+    if (cache == NULL)
+	return;
+    shard = attrcache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->gen++;
+    ep = attrcache_find(shard, hash, dev, ino);
+    e = *ep;
+    if (e != NULL) {
+	*ep = e->next;
+	attrcache_lru_unlink(shard, e);
+	shard->count--;
+	free(e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ypfs_attrcache_invalidate_at(struct ypfs_attrcache *cache, int dirfd, const char *name)
+{
+    struct stat statbuf;
+
+    if (cache == NULL)
+	return;
+    if (fstatat(dirfd, name, &statbuf,
+		AT_SYMLINK_NOFOLLOW | (*name == '\0' ? AT_EMPTY_PATH : 0)) == 0)
+	ypfs_attrcache_invalidate(cache, statbuf.st_dev, statbuf.st_ino);
+}
@@ -0,0 +1,46 @@
+// Cache of file attributes, in front of getattr
+//
+// Once a file is sorted into /Dates it practically never changes, yet
+// gallery apps stat it over and over.  This keeps the struct stat of
+// recently seen files, keyed on the backing (st_dev, st_ino), in a
+// fixed number of entries split into shards with their own lock and
+// LRU list.
+//
+// ypfs's own mutating operations invalidate what they touch.  A miss
+// that races with an invalidation must not put the stale stat back,
+// so callers take a generation before they stat and hand it to put:
+//
+//	gen = ypfs_attrcache_gen(cache, dev, ino);
+//	fstatat(...);
+//	ypfs_attrcache_put(cache, &statbuf, gen);
+//
+// A NULL cache is allowed everywhere and caches nothing.
+
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct ypfs_attrcache;
+
+struct ypfs_attrcache *ypfs_attrcache_new(size_t capacity);
+void ypfs_attrcache_free(struct ypfs_attrcache *cache);
+
+// Fill in 'st' if the attributes are cached and no more than 'maxage'
+// seconds old.  Returns 1 on a hit, 0 otherwise.
+int ypfs_attrcache_get(struct ypfs_attrcache *cache, dev_t dev, ino_t ino, double maxage,
+		       struct stat *st);
+
+uint64_t ypfs_attrcache_gen(struct ypfs_attrcache *cache, dev_t dev, ino_t ino);
+void ypfs_attrcache_put(struct ypfs_attrcache *cache, const struct stat *st, uint64_t gen);
+
+void ypfs_attrcache_invalidate(struct ypfs_attrcache *cache, dev_t dev, ino_t ino);
+
+// Invalidate whatever 'name' in directory 'dirfd' is; "" means dirfd
+// itself
+void ypfs_attrcache_invalidate_at(struct ypfs_attrcache *cache, int dirfd, const char *name);
+
+#endif
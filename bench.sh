@@ -0,0 +1,167 @@
+#!/bin/bash
+#
+# bench.sh: end-to-end benchmarks of ypfs on a real mount
+#
+# Makes synthetic photos with ypfsgen, mounts ypfs over a scratch
+# rootdir, and measures
+#
+#   - bulk copy into the inbox, until ingest has sorted everything:
+#     files/s and MB/s, for EXIF JPEGs plus some TIFFs and files
+#     without EXIF
+#   - release and ingest latency, from /.ypfs/stats (see stats.h)
+#   - copying in and reading back one large video file: MB/s
+#   - ls -lR and find over a big /Dates tree, on a fresh mount (the
+#     backing files' metadata still in the page cache) and again
+#
+# and appends the results as one line of JSON to $BENCH_OUT.  Needs
+# only the fuse module, fusermount3 (or fusermount) and coreutils;
+# run as any user allowed to mount FUSE.
+#
+# Settings, from the environment:
+#
+#   BENCH_FILES   JPEGs to copy in (2000); a tenth as many TIFFs and
+#                 files without EXIF go along
+#   BENCH_SIZE    size of each (4M)
+#   BENCH_VIDEO   size of the video file (1G)
+#   BENCH_TREE    files in the tree to browse (100000)
+#   BENCH_OPTS    extra -o options for ypfs, comma separated
+#   BENCH_OUT     results file (bench-results.jsonl)
+#   BENCH_TMP     scratch directory, which must have room for
+#                 everything twice (a new one under $TMPDIR)
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+ypfs=${YPFS:-$here/ypfs}
+gen=${YPFSGEN:-$here/ypfsgen}
+files=${BENCH_FILES:-2000}
+size=${BENCH_SIZE:-4M}
+video=${BENCH_VIDEO:-1G}
+tree=${BENCH_TREE:-100000}
+opts=stats${BENCH_OPTS:+,$BENCH_OPTS}
+out=${BENCH_OUT:-$here/bench-results.jsonl}
+
+if [ -n "$BENCH_TMP" ]; then
+    tmp=$BENCH_TMP
+    mkdir -p "$tmp"
+else
+    tmp=$(mktemp -d)
+fi
+src=$tmp/src
+root=$tmp/root
+mnt=$tmp/mnt
+
+unmount() {
+    if mountpoint -q "$mnt"; then
+	fusermount3 -u "$mnt" 2>/dev/null || fusermount -u "$mnt"
+    fi
+}
+trap 'unmount; [ -n "$BENCH_TMP" ] || rm -rf "$tmp"' EXIT
+
+mount_ypfs() {
+    "$ypfs" -o "$opts" "$root" "$mnt" 2>>"$tmp/ypfs.log"
+    for i in $(seq 100); do
+	mountpoint -q "$mnt" && return 0
+	sleep 0.1
+    done
+    echo "bench.sh: ypfs didn't mount, see $tmp/ypfs.log" >&2
+    exit 1
+}
+
+now() {
+    date +%s%N
+}
+
+# seconds from $1 to $2, nanoseconds each
+seconds() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b - a) / 1e9 }'
+}
+
+# $1 per second of $2 seconds
+rate() {
+    awk -v n="$1" -v s="$2" 'BEGIN { printf "%.1f", s > 0 ? n / s : 0 }'
+}
+
+# wait for ingest to take everything out of the inbox
+drain() {
+    while [ -n "$(find "$root" -maxdepth 1 -type f -print -quit)" ]; do
+	sleep 0.05
+    done
+}
+
+# column $2 (5 = p50, 6 = p99, 7 = p999) of op $1 in /.ypfs/stats
+stat_us() {
+    awk -v op="$1" -v col="$2" '$1 == op { v = $col } END { print v == "" ? "null" : v }' \
+	"$mnt/.ypfs/stats"
+}
+
+rm -rf "$src" "$root"
+mkdir -p "$src" "$root" "$mnt"
+
+echo "bench.sh: making files in $tmp" >&2
+"$gen" -n "$files" -s "$size" -t jpeg "$src/photos"
+"$gen" -n $((files / 10)) -s "$size" -t tiff "$src/photos"
+"$gen" -n $((files / 10)) -s "$size" -t plain "$src/photos"
+"$gen" -n 1 -s "$video" -t video "$src/video"
+copy_files=$(find "$src/photos" -type f | wc -l)
+copy_bytes=$(du -sb "$src/photos" | cut -f1)
+video_bytes=$(du -sb "$src/video" | cut -f1)
+
+# Copy-in, counted until the last file is sorted
+mount_ypfs
+echo "bench.sh: copying in $copy_files files" >&2
+t0=$(now)
+cp "$src"/photos/* "$mnt"/
+drain
+t1=$(now)
+copy_secs=$(seconds "$t0" "$t1")
+release_p50=$(stat_us release 5)
+release_p99=$(stat_us release 6)
+release_p999=$(stat_us release 7)
+ingest_p50=$(stat_us ingest 5)
+ingest_p99=$(stat_us ingest 6)
+
+# One big file in and back out
+echo "bench.sh: copying in and reading $video_bytes bytes of video" >&2
+t0=$(now)
+cp "$src"/video/* "$mnt"/
+drain
+t1=$(now)
+video_secs=$(seconds "$t0" "$t1")
+unmount
+mount_ypfs
+t0=$(now)
+find "$mnt/Dates" -name '*.MP4' -exec cat {} + >/dev/null
+t1=$(now)
+read_secs=$(seconds "$t0" "$t1")
+unmount
+
+# Browsing a big archive
+echo "bench.sh: browsing $tree more files" >&2
+"$gen" -T -n "$tree" -D 365 -d 2011-01-01 "$root"
+mount_ypfs
+t0=$(now)
+ls -lR "$mnt/Dates" >/dev/null
+t1=$(now)
+ls_cold=$(seconds "$t0" "$t1")
+t0=$(now)
+ls -lR "$mnt/Dates" >/dev/null
+t1=$(now)
+ls_warm=$(seconds "$t0" "$t1")
+unmount
+mount_ypfs
+t0=$(now)
+find "$mnt/Dates" >/dev/null
+t1=$(now)
+find_cold=$(seconds "$t0" "$t1")
+t0=$(now)
+find "$mnt/Dates" >/dev/null
+t1=$(now)
+find_warm=$(seconds "$t0" "$t1")
+unmount
+
+rev=$(git -C "$here" describe --always --dirty 2>/dev/null || echo unknown)
+cat >>"$out" <<EOF
+{"time": "$(date -u +%Y-%m-%dT%H:%M:%SZ)", "rev": "$rev", "host": "$(uname -n)", "kernel": "$(uname -r)", "opts": "$opts", "copy_files": $copy_files, "copy_bytes": $copy_bytes, "copy_seconds": $copy_secs, "copy_files_per_sec": $(rate "$copy_files" "$copy_secs"), "copy_mb_per_sec": $(rate $((copy_bytes / 1000000)) "$copy_secs"), "release_p50_us": $release_p50, "release_p99_us": $release_p99, "release_p999_us": $release_p999, "ingest_p50_us": $ingest_p50, "ingest_p99_us": $ingest_p99, "video_bytes": $video_bytes, "video_write_mb_per_sec": $(rate $((video_bytes / 1000000)) "$video_secs"), "video_read_mb_per_sec": $(rate $((video_bytes / 1000000)) "$read_secs"), "tree_files": $tree, "ls_lR_cold_seconds": $ls_cold, "ls_lR_warm_seconds": $ls_warm, "find_cold_seconds": $find_cold, "find_warm_seconds": $find_warm}
+EOF
+tail -n 1 "$out"
@@ -0,0 +1,621 @@
+/*
+  Photo catalog
+
+  The record file is a 4k header followed by records, and is grown in
+  doubling steps with ftruncate() and remapped.  A record is written
+  in full before the header's count is raised past it, so a crash can
+  lose the last records but never leave a half-written one counted.
+
+  The index file is a short header and an array of uint32_t record
+  numbers in (capture, record number) order.  Merging the tail into
+  it writes a complete new file and renames it into place, so the
+  index on disk is always either the old one or the new one.
+
+  One rwlock covers the mappings: appends and merges take it for
+  writing, since either may remap; readers share it.
+
+  A catalog opened read-only, as ypfscat does while the daemon has it
+  open, never writes to either file.  The daemon may have grown the
+  record file past what we mapped, so every reader stops at the
+  smaller of the header's count and our capacity.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "catalog.h"
+
+#define CATALOG_MAGIC "YPFSCAT1"
+#define CATALOG_INDEX_MAGIC "YPFSIDX1"
+#define CATALOG_VERSION 1
+#define CATALOG_HEADER_SIZE 4096
+#define CATALOG_MIN_RECORDS 1024
+
+// records past the index before it is rebuilt
+#define CATALOG_MERGE 4096
+
+struct catalog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;		// records written
+};
+
+struct catalog_index_header {
+    char magic[8];
+    uint64_t covered;		// records the index covers
+};
+
+struct ypfs_catalog {
+    pthread_rwlock_t lock;
+    int dirfd;
+    char *path;
+    char *index_path;
+
+    int fd;
+    int readonly;
+    struct catalog_header *header;	// the mapping starts with it
+    size_t capacity;			// records the mapping has room for
+
+    struct catalog_index_header *index;	// NULL if there is none yet
+    size_t index_size;
+    const uint32_t *sorted;		// index->covered entries
+};
+
+static struct ypfs_catalog_record *catalog_record(struct ypfs_catalog *cat, size_t n)
+{
+    return (struct ypfs_catalog_record *)
+	((char *) cat->header + CATALOG_HEADER_SIZE) + n;
+}
+
+static size_t catalog_file_size(size_t capacity)
+{
+    return CATALOG_HEADER_SIZE + capacity * sizeof(struct ypfs_catalog_record);
+}
+
+// Records written that we have mapped.  Call with the lock held.
+static size_t catalog_count(struct ypfs_catalog *cat)
+{
+    size_t count = __atomic_load_n(&cat->header->count, __ATOMIC_ACQUIRE);
+
+    return count < cat->capacity ? count : cat->capacity;
+}
+
+// (Re)map the record file at 'capacity' records.  Call with the lock
+// held for writing, or before anyone else can see 'cat'.
+static int catalog_map(struct ypfs_catalog *cat, size_t capacity)
+{
+    void *map;
+
+    if (cat->header != NULL)
+	munmap(cat->header, catalog_file_size(cat->capacity));
+    cat->header = NULL;
+
+    map = mmap(NULL, catalog_file_size(capacity),
+	       cat->readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, cat->fd, 0);
+    if (map == MAP_FAILED)
+	return -errno;
+    cat->header = map;
+    cat->capacity = capacity;
+
+    return 0;
+}
+
+static void catalog_unmap_index(struct ypfs_catalog *cat)
+{
+    if (cat->index != NULL)
+	munmap(cat->index, cat->index_size);
+    cat->index = NULL;
+    cat->index_size = 0;
+    cat->sorted = NULL;
+}
+
+// Map the index file if there is a usable one.  One that doesn't fit
+// the records is ignored; the next merge replaces it.
+static void catalog_map_index(struct ypfs_catalog *cat)
+{
+    struct catalog_index_header *index;
+    struct stat statbuf;
+    void *map;
+    int fd;
+
+    catalog_unmap_index(cat);
+
+    fd = openat(cat->dirfd, cat->index_path, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (fstat(fd, &statbuf) < 0 || (size_t) statbuf.st_size < sizeof(*index)) {
+	close(fd);
+	return;
+    }
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return;
+
+    index = map;
+    if (memcmp(index->magic, CATALOG_INDEX_MAGIC, 8) != 0
+	|| index->covered > catalog_count(cat)
+	|| sizeof(*index) + index->covered * sizeof(uint32_t) > (size_t) statbuf.st_size) {
+	munmap(map, statbuf.st_size);
+	return;
+    }
+    cat->index = index;
+    cat->index_size = statbuf.st_size;
+    cat->sorted = (const uint32_t *) (index + 1);
+}
+
+static struct ypfs_catalog *catalog_open(int dirfd, const char *path, int readonly)
+{
+    struct ypfs_catalog *cat;
+    struct catalog_header header;
+    struct stat statbuf;
+    size_t capacity;
+    int err;
+
+    cat = calloc(1, sizeof(*cat));
+    if (cat == NULL)
+	return NULL;
+    cat->dirfd = dirfd;
+    cat->path = strdup(path);
+    if (cat->path == NULL || asprintf(&cat->index_path, "%s.idx", path) < 0) {
+	free(cat->path);
+	free(cat);
+	errno = ENOMEM;
+	return NULL;
+    }
+    pthread_rwlock_init(&cat->lock, NULL);
+    cat->readonly = readonly;
+
+    cat->fd = openat(dirfd, path, readonly ? O_RDONLY : O_RDWR | O_CREAT, 0600);
+    if (cat->fd < 0)
+	goto fail;
+    if (fstat(cat->fd, &statbuf) < 0)
+	goto fail;
+
+    if (statbuf.st_size == 0 && !readonly) {
+	// new catalog
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CATALOG_MAGIC, 8);
+	header.version = CATALOG_VERSION;
+	header.record_size = sizeof(struct ypfs_catalog_record);
+	capacity = CATALOG_MIN_RECORDS;
+	if (ftruncate(cat->fd, catalog_file_size(capacity)) < 0
+	    || pwrite(cat->fd, &header, sizeof(header), 0) != sizeof(header))
+	    goto fail;
+    } else {
+	if (pread(cat->fd, &header, sizeof(header), 0) != sizeof(header)
+	    || memcmp(header.magic, CATALOG_MAGIC, 8) != 0
+	    || header.version != CATALOG_VERSION
+	    || header.record_size != sizeof(struct ypfs_catalog_record)
+	    || (size_t) statbuf.st_size < CATALOG_HEADER_SIZE) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+	capacity = (statbuf.st_size - CATALOG_HEADER_SIZE) / sizeof(struct ypfs_catalog_record);
+    }
+
+    err = catalog_map(cat, capacity);
+    if (err < 0) {
+	errno = -err;
+	goto fail;
+    }
+    // a file cut short (by hand, or a full disk) loses its last
+    // records; read-only, they are just left out
+    if (!readonly && cat->header->count > capacity)
+	cat->header->count = capacity;
+
+    catalog_map_index(cat);
+
+    return cat;
+
+ fail:
+    err = errno;
+    if (cat->fd >= 0)
+	close(cat->fd);
+    pthread_rwlock_destroy(&cat->lock);
+    free(cat->index_path);
+    free(cat->path);
+    free(cat);
+    errno = err;
+    return NULL;
+}
+
+struct ypfs_catalog *ypfs_catalog_open(int dirfd, const char *path)
+{
+    return catalog_open(dirfd, path, 0);
+}
+
+struct ypfs_catalog *ypfs_catalog_open_readonly(int dirfd, const char *path)
+{
+    return catalog_open(dirfd, path, 1);
+}
+
+// Order of the index: capture time, then record number
+static int catalog_compare(const void *a, const void *b, void *arg)
+{
+    struct ypfs_catalog *cat = arg;
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    int64_t cx = catalog_record(cat, x)->capture;
+    int64_t cy = catalog_record(cat, y)->capture;
+
+    if (cx != cy)
+	return cx < cy ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static int catalog_before(struct ypfs_catalog *cat, uint32_t x, uint32_t y)
+{
+    int64_t cx = catalog_record(cat, x)->capture;
+    int64_t cy = catalog_record(cat, y)->capture;
+
+    return cx < cy || (cx == cy && x < y);
+}
+
+// Record numbers of the tail, sorted; the caller frees it.  Call with
+// the lock held.
+static uint32_t *catalog_sorted_tail(struct ypfs_catalog *cat, size_t *ntail)
+{
+    size_t covered = cat->index != NULL ? cat->index->covered : 0;
+    size_t n = catalog_count(cat) - covered;
+    uint32_t *tail;
+    size_t i;
+
+    tail = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (tail == NULL)
+	return NULL;
+    for (i = 0; i < n; i++)
+	tail[i] = covered + i;
+    qsort_r(tail, n, sizeof(uint32_t), catalog_compare, cat);
+
+    *ntail = n;
+    return tail;
+}
+
+// Merge the tail into a new index file.  Call with the lock held for
+// writing.
+static int catalog_merge(struct ypfs_catalog *cat)
+{
+    struct catalog_index_header header;
+    size_t covered = cat->index != NULL ? cat->index->covered : 0;
+    size_t count = catalog_count(cat);
+    uint32_t *tail;
+    uint32_t *merged;
+    size_t ntail;
+    size_t i, j, k;
+    char *tmp;
+    int fd;
+    int err = 0;
+
+    if (count == covered)
+	return 0;
+
+    tail = catalog_sorted_tail(cat, &ntail);
+    merged = malloc(count * sizeof(uint32_t));
+    if (tail == NULL || merged == NULL) {
+	free(tail);
+	free(merged);
+	return -ENOMEM;
+    }
+    for (i = j = k = 0; k < count; k++)
+	if (j >= ntail || (i < covered && catalog_before(cat, cat->sorted[i], tail[j])))
+	    merged[k] = cat->sorted[i++];
+	else
+	    merged[k] = tail[j++];
+    free(tail);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_INDEX_MAGIC, 8);
+    header.covered = count;
+
+    if (asprintf(&tmp, "%s.tmp", cat->index_path) < 0) {
+	free(merged);
+	return -ENOMEM;
+    }
+    errno = 0;
+    fd = openat(cat->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0
+	|| write(fd, &header, sizeof(header)) != sizeof(header)
+	|| write(fd, merged, count * sizeof(uint32_t)) != (ssize_t) (count * sizeof(uint32_t))
+	|| fdatasync(fd) < 0)
+	err = errno ? -errno : -EIO;
+    if (fd >= 0)
+	close(fd);
+    if (err == 0 && renameat(cat->dirfd, tmp, cat->dirfd, cat->index_path) < 0)
+	err = -errno;
+    if (err < 0)
+	unlinkat(cat->dirfd, tmp, 0);
+    free(tmp);
+    free(merged);
+
+    if (err == 0)
+	catalog_map_index(cat);
+    return err;
+}
+
+void ypfs_catalog_close(struct ypfs_catalog *cat)
+{
+    if (cat == NULL)
+	return;
+
+    if (!cat->readonly)
+	catalog_merge(cat);
+    catalog_unmap_index(cat);
+    if (!cat->readonly)
+	msync(cat->header, catalog_file_size(cat->capacity), MS_SYNC);
+    munmap(cat->header, catalog_file_size(cat->capacity));
+    close(cat->fd);
+    pthread_rwlock_destroy(&cat->lock);
+    free(cat->index_path);
+    free(cat->path);
+    free(cat);
+}
+
+int ypfs_catalog_add(struct ypfs_catalog *cat, const struct ypfs_catalog_record *rec)
+{
+    size_t count;
+    size_t covered;
+    int err = 0;
+
+    if (cat->readonly)
+	return -EROFS;
+
+    pthread_rwlock_wrlock(&cat->lock);
+    count = cat->header->count;
+    if (count >= UINT32_MAX) {
+	err = -EFBIG;
+	goto out;
+    }
+    if (count == cat->capacity) {
+	if (ftruncate(cat->fd, catalog_file_size(cat->capacity * 2)) < 0) {
+	    err = -errno;
+	    goto out;
+	}
+	err = catalog_map(cat, cat->capacity * 2);
+	if (err < 0) {
+	    // put the old mapping back; the file is only bigger
+	    if (catalog_map(cat, cat->capacity) < 0)
+		abort();
+	    goto out;
+	}
+    }
+
+    *catalog_record(cat, count) = *rec;
+    catalog_record(cat, count)->path[YPFS_CATALOG_PATH_MAX - 1] = '\0';
+    __atomic_store_n(&cat->header->count, count + 1, __ATOMIC_RELEASE);
+
+    covered = cat->index != NULL ? cat->index->covered : 0;
+    if (count + 1 - covered >= CATALOG_MERGE)
+	catalog_merge(cat);
+
+ out:
+    pthread_rwlock_unlock(&cat->lock);
+    return err;
+}
+
+size_t ypfs_catalog_count(struct ypfs_catalog *cat)
+{
+    size_t count;
+
+    pthread_rwlock_rdlock(&cat->lock);
+    count = catalog_count(cat);
+    pthread_rwlock_unlock(&cat->lock);
+
+    return count;
+}
+
+// First position in sorted[0..n) captured at or after 'from'
+static size_t catalog_lower_bound(struct ypfs_catalog *cat, const uint32_t *sorted, size_t n,
+				  int64_t from)
+{
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (catalog_record(cat, sorted[mid])->capture < from)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+int ypfs_catalog_range(struct ypfs_catalog *cat, int64_t from, int64_t to,
+		       int (*fn)(const struct ypfs_catalog_record *rec, void *arg), void *arg)
+{
+    size_t covered;
+    uint32_t *tail;
+    size_t ntail;
+    size_t i, j;
+    uint32_t next;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&cat->lock);
+    covered = cat->index != NULL ? cat->index->covered : 0;
+    tail = catalog_sorted_tail(cat, &ntail);
+    if (tail == NULL) {
+	pthread_rwlock_unlock(&cat->lock);
+	return -ENOMEM;
+    }
+
+    // walk the index and the sorted tail side by side
+    i = catalog_lower_bound(cat, cat->sorted, covered, from);
+    j = catalog_lower_bound(cat, tail, ntail, from);
+    while (ret == 0 && (i < covered || j < ntail)) {
+	if (j >= ntail || (i < covered && catalog_before(cat, cat->sorted[i], tail[j])))
+	    next = cat->sorted[i++];
+	else
+	    next = tail[j++];
+	if (catalog_record(cat, next)->capture >= to)
+	    break;
+	ret = fn(catalog_record(cat, next), arg);
+    }
+
+    pthread_rwlock_unlock(&cat->lock);
+    free(tail);
+    return ret;
+}
+
+int ypfs_catalog_each(struct ypfs_catalog *cat,
+		      int (*fn)(const struct ypfs_catalog_record *rec, void *arg), void *arg)
+{
+    size_t n = 0;
+    size_t end;
+    int ret = 0;
+
+    // a batch at a time, so appends aren't held up for long
+    do {
+	pthread_rwlock_rdlock(&cat->lock);
+	end = catalog_count(cat);
+	if (end > n + CATALOG_MERGE)
+	    end = n + CATALOG_MERGE;
+	for (; ret == 0 && n < end; n++)
+	    ret = fn(catalog_record(cat, n), arg);
+	end = catalog_count(cat);
+	pthread_rwlock_unlock(&cat->lock);
+    } while (ret == 0 && n < end);
+
+    return ret;
+}
+
+// Paths of the newest record for each file, for the tree walk.
+// Open addressing over record number + 1, so 0 is empty.
+struct catalog_paths {
+    struct ypfs_catalog *cat;
+    uint32_t *slots;
+    size_t mask;
+};
+
+static uint32_t catalog_path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *path; path++) {
+	h ^= (unsigned char) *path;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t *catalog_path_slot(struct catalog_paths *paths, const char *path)
+{
+    size_t i = catalog_path_hash(path) & paths->mask;
+    uint32_t *slot;
+
+    for (;; i = (i + 1) & paths->mask) {
+	slot = &paths->slots[i];
+	if (*slot == 0 || strcmp(catalog_record(paths->cat, *slot - 1)->path, path) == 0)
+	    return slot;
+    }
+}
+
+// Report regular files under fs-relative 'path' that have no record
+static int catalog_walk(struct catalog_paths *paths, int rootfd, const char *path, FILE *out)
+{
+    char child[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *de;
+    uint32_t *slot;
+    DIR *dp;
+    int fd;
+    int diffs = 0;
+
+    fd = openat(rootfd, path + 1, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	return 0;
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+	close(fd);
+	return 0;
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= sizeof(child))
+	    continue;
+	if (fstatat(fd, de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+	    continue;
+	if (S_ISDIR(statbuf.st_mode))
+	    diffs += catalog_walk(paths, rootfd, child, out);
+	else if (S_ISREG(statbuf.st_mode)) {
+	    slot = catalog_path_slot(paths, child);
+	    if (*slot == 0) {
+		if (out != NULL)
+		    fprintf(out, "untracked %s\n", child);
+		diffs++;
+	    }
+	}
+    }
+    closedir(dp);
+
+    return diffs;
+}
+
+int ypfs_catalog_check(struct ypfs_catalog *cat, int rootfd, FILE *out)
+{
+    struct ypfs_catalog_record *rec;
+    struct catalog_paths paths;
+    struct stat statbuf;
+    uint32_t *slot;
+    size_t count;
+    size_t nslots;
+    size_t n;
+    int diffs = 0;
+
+    pthread_rwlock_rdlock(&cat->lock);
+    count = catalog_count(cat);
+
+    for (nslots = 16; nslots < count * 2; nslots *= 2)
+	;
+    paths.cat = cat;
+    paths.mask = nslots - 1;
+    paths.slots = calloc(nslots, sizeof(uint32_t));
+    if (paths.slots == NULL) {
+	pthread_rwlock_unlock(&cat->lock);
+	return -ENOMEM;
+    }
+
+    // a later record for the same path supersedes an earlier one
+    for (n = 0; n < count; n++) {
+	rec = catalog_record(cat, n);
+	*catalog_path_slot(&paths, rec->path) = n + 1;
+    }
+
+    for (n = 0; n < count; n++) {
+	rec = catalog_record(cat, n);
+	slot = catalog_path_slot(&paths, rec->path);
+	if (*slot != n + 1)
+	    continue;
+	if (fstatat(rootfd, rec->path + 1, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+	    if (out != NULL)
+		fprintf(out, "missing %s\n", rec->path);
+	    diffs++;
+	} else if ((uint64_t) statbuf.st_size != rec->size || statbuf.st_mtime != rec->mtime) {
+	    if (out != NULL)
+		fprintf(out, "changed %s\n", rec->path);
+	    diffs++;
+	}
+    }
+
+    diffs += catalog_walk(&paths, rootfd, "/Dates", out);
+
+    pthread_rwlock_unlock(&cat->lock);
+    free(paths.slots);
+
+    return diffs;
+}
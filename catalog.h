@@ -0,0 +1,90 @@
+// Photo catalog
+//
+// Ingest already works out where each photo goes and when it was
+// taken; the catalog keeps that, so that "everything from March 2010"
+// doesn't mean walking /Dates and parsing EXIF all over again.
+//
+// Two files, both mmap()ed:
+//
+//   catalog      a header and fixed-size records, appended to as files
+//		  are sorted and never rewritten
+//   catalog.idx  record numbers sorted by capture time, covering the
+//		  first 'covered' records; rewritten (to a temporary
+//		  file, then renamed over) whenever enough new records
+//		  have piled up past it
+//
+// Opening maps both files and reads the headers, so it costs the same
+// for ten photos as for a million.  Records newer than the index are
+// found by scanning that short tail.
+//
+// The catalog notes what ingest did; it does not follow later
+// renames or deletions through the mount.  ypfs_catalog_check()
+// compares it with the tree.
+
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// where it lives unless told otherwise, relative to rootdir
+#define YPFS_CATALOG_DIR ".ypfs"
+#define YPFS_CATALOG_DEFAULT YPFS_CATALOG_DIR "/catalog"
+
+#define YPFS_CATALOG_PATH_MAX 416
+
+// flags
+#define YPFS_CATALOG_EXIF_DATE	0x1	// capture time is from EXIF, not mtime
+#define YPFS_CATALOG_HASHED	0x2	// 'hash' is valid
+
+struct ypfs_catalog_record {
+    char path[YPFS_CATALOG_PATH_MAX];	// fs-relative, NUL-terminated
+    char model[40];			// camera model, or ""
+    uint64_t size;
+    int64_t mtime;			// seconds since the epoch
+    int64_t capture;			// capture time, as if it were UTC
+    uint8_t hash[16];			// XXH3-128 of the contents, see dedup.h
+    uint32_t flags;
+    uint32_t reserved[3];
+};
+
+struct ypfs_catalog;
+
+// Open (creating if need be) the catalog at 'path', relative to
+// 'dirfd' as for openat().  NULL with errno set on failure.
+struct ypfs_catalog *ypfs_catalog_open(int dirfd, const char *path);
+
+// Open an existing catalog only to read it, without writing to it,
+// so it is safe while the daemon has it open.  Records the daemon
+// adds after this are left out, and ypfs_catalog_add() fails with
+// -EROFS.
+struct ypfs_catalog *ypfs_catalog_open_readonly(int dirfd, const char *path);
+
+// Bring the index up to date (unless read-only) and unmap
+void ypfs_catalog_close(struct ypfs_catalog *cat);
+
+// Append a record.  Returns 0 or -errno.  Safe from any thread.
+int ypfs_catalog_add(struct ypfs_catalog *cat, const struct ypfs_catalog_record *rec);
+
+size_t ypfs_catalog_count(struct ypfs_catalog *cat);
+
+// Call 'fn' on each record captured in [from, to), in capture time
+// order.  Stops early, returning fn's value, if fn returns nonzero.
+int ypfs_catalog_range(struct ypfs_catalog *cat, int64_t from, int64_t to,
+		       int (*fn)(const struct ypfs_catalog_record *rec, void *arg), void *arg);
+
+// Call 'fn' on each record, in the order they were added.  Records
+// added meanwhile may or may not be included.  Stops early, returning
+// fn's value, if fn returns nonzero.
+int ypfs_catalog_each(struct ypfs_catalog *cat,
+		      int (*fn)(const struct ypfs_catalog_record *rec, void *arg), void *arg);
+
+// Compare the catalog with the files under 'rootfd'.  Records whose
+// file is gone or has a different size or mtime are reported to 'out'
+// (if not NULL); so are files under /Dates with no record.  Returns
+// the number of differences found, or -errno.
+int ypfs_catalog_check(struct ypfs_catalog *cat, int rootfd, FILE *out);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+  Duplicate collapse for ingest
+
+  The hasher wraps an XXH3 streaming state.  The index is a chained
+  hash table, keyed on the first eight bytes of the sum (which are as
+  good as random), under one mutex: ingest touches it once per file,
+  so there is nothing to gain from finer locking.  It doubles when it
+  holds more entries than it has buckets.
+
+  An entry names where a file with that content was sorted to.  The
+  file may have been deleted or replaced through the mount since, so
+  a lookup checks that it is still there with the same size and mtime
+  before answering; ingest can't afford to link a photo to the wrong
+  data.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <xxhash.h>
+
+#include "catalog.h"
+#include "dedup.h"
+
+const char *ypfs_relpath(const char *);
+
+#define DEDUP_MIN_BUCKETS 1024
+#define DEDUP_READ_BUF (1024 * 1024)
+
+struct dedup_entry {
+    struct dedup_entry *next;
+    struct ypfs_hash hash;
+    int64_t mtime;			// of the file at 'path', as added
+    char path[];
+};
+
+struct ypfs_dedup {
+    int rootfd;
+
+    pthread_mutex_t lock;
+    struct dedup_entry **buckets;
+    size_t nbuckets;			// a power of two
+    size_t count;
+
+    struct ypfs_catalog *catalog;	// while loading
+    pthread_t loader;
+    int loading;
+    int stopping;
+};
+
+int ypfs_hasher_start(struct ypfs_hasher *h, unsigned truncs, unsigned writes)
+{
+    memset(h, 0, sizeof(*h));
+    h->state = XXH3_createState();
+    if (h->state == NULL)
+	return -ENOMEM;
+    XXH3_128bits_reset(h->state);
+    h->truncs = truncs;
+    h->writes = writes;
+
+    return 0;
+}
+
+void ypfs_hasher_feed(struct ypfs_hasher *h, const void *buf, size_t size, off_t offset)
+{
+    if (!ypfs_hasher_live(h))
+	return;
+    h->writes++;
+    if (offset != h->hashed) {
+	h->broken = 1;
+	return;
+    }
+    XXH3_128bits_update(h->state, buf, size);
+    h->hashed += size;
+}
+
+void ypfs_hasher_break(struct ypfs_hasher *h)
+{
+    h->broken = 1;
+}
+
+int ypfs_hasher_live(const struct ypfs_hasher *h)
+{
+    return h->state != NULL && !h->broken;
+}
+
+void ypfs_hasher_digest(struct ypfs_hasher *h, unsigned truncs, unsigned writes,
+			struct ypfs_hash *hash)
+{
+    XXH128_canonical_t sum;
+
+    hash->len = -1;
+    if (!ypfs_hasher_live(h) || truncs != h->truncs || writes != h->writes)
+	return;
+    XXH128_canonicalFromHash(&sum, XXH3_128bits_digest(h->state));
+    memcpy(hash->sum, sum.digest, YPFS_HASH_SIZE);
+    hash->len = h->hashed;
+}
+
+void ypfs_hasher_free(struct ypfs_hasher *h)
+{
+    if (h->state != NULL)
+	XXH3_freeState(h->state);
+    h->state = NULL;
+}
+
+int ypfs_hash_fd(int fd, struct ypfs_hash *hash)
+{
+    struct ypfs_hasher h;
+    char *buf;
+    ssize_t n;
+    int retstat = 0;
+
+    buf = malloc(DEDUP_READ_BUF);
+    if (buf == NULL)
+	return -ENOMEM;
+    if (ypfs_hasher_start(&h, 0, 0) < 0) {
+	free(buf);
+	return -ENOMEM;
+    }
+
+    while ((n = pread(fd, buf, DEDUP_READ_BUF, h.hashed)) != 0) {
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    retstat = -errno;
+	    break;
+	}
+	ypfs_hasher_feed(&h, buf, n, h.hashed);
+    }
+    if (retstat == 0)
+	ypfs_hasher_digest(&h, 0, h.writes, hash);
+
+    ypfs_hasher_free(&h);
+    free(buf);
+    return retstat;
+}
+
+static size_t dedup_bucket(const struct ypfs_dedup *dedup, const struct ypfs_hash *hash)
+{
+    uint64_t key;
+
+    memcpy(&key, hash->sum, sizeof(key));
+    return key & (dedup->nbuckets - 1);
+}
+
+static int dedup_same(const struct ypfs_hash *a, const struct ypfs_hash *b)
+{
+    return a->len == b->len && memcmp(a->sum, b->sum, YPFS_HASH_SIZE) == 0;
+}
+
+struct ypfs_dedup *ypfs_dedup_new(int rootfd)
+{
+    struct ypfs_dedup *dedup;
+
+    dedup = calloc(1, sizeof(*dedup));
+    if (dedup == NULL)
+	return NULL;
+    dedup->buckets = calloc(DEDUP_MIN_BUCKETS, sizeof(struct dedup_entry *));
+    if (dedup->buckets == NULL) {
+	free(dedup);
+	return NULL;
+    }
+    dedup->nbuckets = DEDUP_MIN_BUCKETS;
+    dedup->rootfd = rootfd;
+    pthread_mutex_init(&dedup->lock, NULL);
+
+    return dedup;
+}
+
+void ypfs_dedup_free(struct ypfs_dedup *dedup)
+{
+    struct dedup_entry *e, *next;
+    size_t i;
+
+    if (dedup == NULL)
+	return;
+
+    if (dedup->loading) {
+	dedup->stopping = 1;
+	pthread_join(dedup->loader, NULL);
+    }
+    for (i = 0; i < dedup->nbuckets; i++)
+	for (e = dedup->buckets[i]; e != NULL; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+    pthread_mutex_destroy(&dedup->lock);
+    free(dedup->buckets);
+    free(dedup);
+}
+
+// Call with the lock held
+static void dedup_grow(struct ypfs_dedup *dedup)
+{
+    struct dedup_entry **old = dedup->buckets;
+    size_t oldn = dedup->nbuckets;
+    struct dedup_entry *e, *next;
+    size_t i, b;
+
+    dedup->buckets = calloc(oldn * 2, sizeof(struct dedup_entry *));
+    if (dedup->buckets == NULL) {
+	// chains just get longer
+	dedup->buckets = old;
+	return;
+    }
+    dedup->nbuckets = oldn * 2;
+    for (i = 0; i < oldn; i++)
+	for (e = old[i]; e != NULL; e = next) {
+	    next = e->next;
+	    b = dedup_bucket(dedup, &e->hash);
+	    e->next = dedup->buckets[b];
+	    dedup->buckets[b] = e;
+	}
+    free(old);
+}
+
+static void dedup_insert(struct ypfs_dedup *dedup, const struct ypfs_hash *hash, int64_t mtime,
+			 const char *path)
+{
+    struct dedup_entry *e;
+    size_t len = strlen(path);
+    size_t b;
+
+    if (hash->len < YPFS_DEDUP_MIN)
+	return;
+
+    pthread_mutex_lock(&dedup->lock);
+    b = dedup_bucket(dedup, hash);
+    for (e = dedup->buckets[b]; e != NULL; e = e->next)
+	if (dedup_same(&e->hash, hash))
+	    break;
+    if (e == NULL) {
+	// the first copy stays the one duplicates are matched to
+	e = malloc(sizeof(*e) + len + 1);
+	if (e != NULL) {
+	    e->hash = *hash;
+	    e->mtime = mtime;
+	    memcpy(e->path, path, len + 1);
+	    e->next = dedup->buckets[b];
+	    dedup->buckets[b] = e;
+	    if (++dedup->count > dedup->nbuckets)
+		dedup_grow(dedup);
+	}
+    }
+    pthread_mutex_unlock(&dedup->lock);
+}
+
+void ypfs_dedup_add(struct ypfs_dedup *dedup, const struct ypfs_hash *hash, const char *path)
+{
+    struct stat statbuf;
+
+    if (hash->len < YPFS_DEDUP_MIN)
+	return;
+    if (fstatat(dedup->rootfd, ypfs_relpath(path), &statbuf, AT_SYMLINK_NOFOLLOW) < 0
+	|| statbuf.st_size != hash->len)
+	return;
+    dedup_insert(dedup, hash, statbuf.st_mtime, path);
+}
+
+int ypfs_dedup_find(struct ypfs_dedup *dedup, const struct ypfs_hash *hash, char *path,
+		    size_t size)
+{
+    struct dedup_entry **link, *e;
+    struct stat statbuf;
+    int found = 0;
+
+    if (hash->len < YPFS_DEDUP_MIN)
+	return 0;
+
+    pthread_mutex_lock(&dedup->lock);
+    link = &dedup->buckets[dedup_bucket(dedup, hash)];
+    while ((e = *link) != NULL && !dedup_same(&e->hash, hash))
+	link = &e->next;
+    if (e != NULL) {
+	if (fstatat(dedup->rootfd, ypfs_relpath(e->path), &statbuf, AT_SYMLINK_NOFOLLOW) == 0
+	    && S_ISREG(statbuf.st_mode) && statbuf.st_size == hash->len
+	    && statbuf.st_mtime == e->mtime) {
+	    found = snprintf(path, size, "%s", e->path) < size;
+	} else {
+	    *link = e->next;
+	    dedup->count--;
+	    free(e);
+	}
+    }
+    pthread_mutex_unlock(&dedup->lock);
+
+    return found;
+}
+
+static int dedup_load_record(const struct ypfs_catalog_record *rec, void *arg)
+{
+    struct ypfs_dedup *dedup = arg;
+    struct ypfs_hash hash;
+
+    if (rec->flags & YPFS_CATALOG_HASHED) {
+	hash.len = rec->size;
+	memcpy(hash.sum, rec->hash, YPFS_HASH_SIZE);
+	dedup_insert(dedup, &hash, rec->mtime, rec->path);
+    }
+
+    return dedup->stopping;
+}
+
+static void *dedup_loader(void *arg)
+{
+    struct ypfs_dedup *dedup = arg;
+
+    ypfs_catalog_each(dedup->catalog, dedup_load_record, dedup);
+
+    return NULL;
+}
+
+void ypfs_dedup_load(struct ypfs_dedup *dedup, struct ypfs_catalog *cat)
+{
+    if (dedup->loading || cat == NULL)
+	return;
+    dedup->catalog = cat;
+    if (pthread_create(&dedup->loader, NULL, dedup_loader, dedup) == 0)
+	dedup->loading = 1;
+}
@@ -0,0 +1,95 @@
+// Duplicate collapse for ingest
+//
+// Overlapping cards get copied in again and again, and each time
+// ingest either renamed the new copy over a same-named photo or
+// stored a second one.  Now every file written into the inbox is
+// hashed (XXH3, 128 bits) as its data goes by in ypfs_write, and
+// ingest looks the hash up in an index of what is already under
+// /Dates.  A file whose content is there already shares the existing
+// copy's blocks through a reflink, or becomes a hard link to it where
+// the filesystem can't reflink, rather than being stored twice.
+//
+// Files that weren't written front to back are hashed by reading them
+// back at ingest.  The index is kept in memory, loaded in the
+// background at mount from the hashes in the catalog.
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define YPFS_HASH_SIZE 16
+
+// Files smaller than this are stored as they are.  Every empty file
+// hashes the same, and tiny ones (sidecars, placeholders) are about as
+// likely to match by accident as not; linked together, a write to one
+// would show up in all of them, for next to no space saved.
+#define YPFS_DEDUP_MIN 4096
+
+struct ypfs_catalog;
+struct ypfs_dedup;
+struct XXH3_state_s;
+
+struct ypfs_hash {
+    off_t len;				// bytes the sum covers, or -1
+    uint8_t sum[YPFS_HASH_SIZE];
+};
+
+// Streaming hash of a file as it is written.  All zeroes is a hasher
+// that isn't running.
+struct ypfs_hasher {
+    struct XXH3_state_s *state;
+    off_t hashed;			// bytes hashed, from offset 0
+    int broken;				// a write out of order
+    unsigned truncs;			// ypfs_inode.truncs when started
+    unsigned writes;			// ypfs_inode.writes, if ours only
+};
+
+// Start hashing from offset 0.  Returns 0 or -ENOMEM.
+int ypfs_hasher_start(struct ypfs_hasher *h, unsigned truncs, unsigned writes);
+
+// Take in the data of a write, one that ypfs_inode.writes counts.
+// Anything but the next bytes in order breaks the hash.
+void ypfs_hasher_feed(struct ypfs_hasher *h, const void *buf, size_t size, off_t offset);
+
+// Note data that went into the file without being fed, as by
+// copy_file_range(); that breaks the hash too
+void ypfs_hasher_break(struct ypfs_hasher *h);
+
+// Whether writes still need feeding
+int ypfs_hasher_live(const struct ypfs_hasher *h);
+
+// The hash of what was fed, if nothing broke it and the file wasn't
+// truncated or written through another handle since (going by
+// 'truncs' and 'writes'); else hash->len is -1
+void ypfs_hasher_digest(struct ypfs_hasher *h, unsigned truncs, unsigned writes,
+			struct ypfs_hash *hash);
+
+void ypfs_hasher_free(struct ypfs_hasher *h);
+
+// Hash the whole file open on 'fd'.  Returns 0 or -errno.
+int ypfs_hash_fd(int fd, struct ypfs_hash *hash);
+
+// The index, of fs-relative paths under 'rootfd' by content hash.
+// All calls are safe from any thread.
+struct ypfs_dedup *ypfs_dedup_new(int rootfd);
+void ypfs_dedup_free(struct ypfs_dedup *dedup);
+
+// Fill the index from the hashed records of 'cat' on a thread of its
+// own.  Lookups miss until it gets to the file.
+void ypfs_dedup_load(struct ypfs_dedup *dedup, struct ypfs_catalog *cat);
+
+// Note that fs-relative 'path' has contents 'hash'.  An entry for the
+// same contents elsewhere is kept, and files under YPFS_DEDUP_MIN
+// bytes aren't indexed.
+void ypfs_dedup_add(struct ypfs_dedup *dedup, const struct ypfs_hash *hash, const char *path);
+
+// Path of a file with contents 'hash', into 'path'.  Entries whose
+// file has gone or changed size or mtime are dropped.  Returns 1 if
+// one is found, else 0, as it always is under YPFS_DEDUP_MIN bytes.
+int ypfs_dedup_find(struct ypfs_dedup *dedup, const struct ypfs_hash *hash, char *path,
+		    size_t size);
+
+#endif
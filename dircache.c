@@ -0,0 +1,259 @@
+/*
+  Directory existence cache
+
+  A hash set of fs-relative directory paths, split into shards that
+  each have their own lock, so ingest threads sorting into different
+  days don't contend.  Each shard is a chained table that doubles when
+  it gets as many entries as buckets.
+
+  The set only ever holds directories whose parents are also in it:
+  _mkdir adds every component it walks, and fill works top down.
+  That lets rename skip the full sweep for anything that isn't a
+  cached directory.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dircache.h"
+
+#define DIRCACHE_SHARDS 64
+#define DIRCACHE_INITIAL_BUCKETS 64
+
+struct dircache_entry {
+    struct dircache_entry *next;
+    uint32_t hash;
+    size_t len;
+    char path[];
+};
+
+struct dircache_shard {
+    pthread_mutex_t lock;
+    struct dircache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+struct ypfs_dircache {
+    struct dircache_shard shards[DIRCACHE_SHARDS];
+};
+
+// FNV-1a
+static uint32_t dircache_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= (unsigned char) path[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static struct dircache_shard *dircache_shard(struct ypfs_dircache *cache, uint32_t hash)
+{
+    // low bits pick the bucket, so pick the shard from the high ones
+    return &cache->shards[hash >> 26];
+}
+
+struct ypfs_dircache *ypfs_dircache_new(void)
+{
+    struct ypfs_dircache *cache;
+    struct dircache_shard *shard;
+    int i;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+	return NULL;
+
+    for (i = 0; i < DIRCACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+	pthread_mutex_init(&shard->lock, NULL);
+	shard->nbuckets = DIRCACHE_INITIAL_BUCKETS;
+	shard->buckets = calloc(shard->nbuckets, sizeof(struct dircache_entry *));
+	if (shard->buckets == NULL) {
+	    ypfs_dircache_free(cache);
+	    return NULL;
+	}
+    }
+
+    return cache;
+}
+
+void ypfs_dircache_free(struct ypfs_dircache *cache)
+{
+    struct dircache_shard *shard;
+    struct dircache_entry *e, *next;
+    size_t b;
+    int i;
+
+    if (cache == NULL)
+	return;
+
+    for (i = 0; i < DIRCACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+	if (shard->buckets != NULL)
+	    for (b = 0; b < shard->nbuckets; b++)
+		for (e = shard->buckets[b]; e != NULL; e = next) {
+		    next = e->next;
+		    free(e);
+		}
+	free(shard->buckets);
+	pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+// call with shard->lock held
+static struct dircache_entry **dircache_find(struct dircache_shard *shard, uint32_t hash,
+					     const char *path, size_t len)
+{
+    struct dircache_entry **ep;
+
+    for (ep = &shard->buckets[hash & (shard->nbuckets - 1)]; *ep != NULL; ep = &(*ep)->next)
+	if ((*ep)->hash == hash && (*ep)->len == len && memcmp((*ep)->path, path, len) == 0)
+	    break;
+    return ep;
+}
+
+// call with shard->lock held; on allocation failure just stay crowded
+static void dircache_grow(struct dircache_shard *shard)
+{
+    struct dircache_entry **buckets;
+    struct dircache_entry *e, *next;
+    size_t nbuckets = shard->nbuckets * 2;
+    size_t b;
+
+    buckets = calloc(nbuckets, sizeof(struct dircache_entry *));
+    if (buckets == NULL)
+	return;
+
+    for (b = 0; b < shard->nbuckets; b++)
+	for (e = shard->buckets[b]; e != NULL; e = next) {
+	    next = e->next;
+	    e->next = buckets[e->hash & (nbuckets - 1)];
+	    buckets[e->hash & (nbuckets - 1)] = e;
+	}
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+int ypfs_dircache_has(struct ypfs_dircache *cache, const char *path, size_t len)
+{
+    uint32_t hash = dircache_hash(path, len);
+    struct dircache_shard *shard = dircache_shard(cache, hash);
+    int found;
+
+    pthread_mutex_lock(&shard->lock);
+    found = *dircache_find(shard, hash, path, len) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+void ypfs_dircache_add(struct ypfs_dircache *cache, const char *path, size_t len)
+{
+    uint32_t hash = dircache_hash(path, len);
+    struct dircache_shard *shard = dircache_shard(cache, hash);
+    struct dircache_entry **ep;
+    struct dircache_entry *e;
+
+    pthread_mutex_lock(&shard->lock);
+    ep = dircache_find(shard, hash, path, len);
+    if (*ep == NULL) {
+	e = malloc(sizeof(*e) + len + 1);
+	if (e != NULL) {
+	    e->next = NULL;
+	    e->hash = hash;
+	    e->len = len;
+	    memcpy(e->path, path, len);
+	    e->path[len] = '\0';
+	    *ep = e;
+	    if (++shard->count > shard->nbuckets)
+		dircache_grow(shard);
+	}
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ypfs_dircache_remove(struct ypfs_dircache *cache, const char *path, size_t len)
+{
+    struct dircache_shard *shard;
+    struct dircache_entry **ep;
+    struct dircache_entry *e;
+    size_t b;
+    int i;
+
+    // Nothing below a directory that isn't cached can be cached
+    if (!ypfs_dircache_has(cache, path, len))
+	return;
+
+    for (i = 0; i < DIRCACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+	pthread_mutex_lock(&shard->lock);
+	for (b = 0; b < shard->nbuckets; b++) {
+	    ep = &shard->buckets[b];
+	    while ((e = *ep) != NULL) {
+		if (e->len >= len && memcmp(e->path, path, len) == 0
+		    && (e->len == len || e->path[len] == '/')) {
+		    *ep = e->next;
+		    shard->count--;
+		    free(e);
+		} else
+		    ep = &e->next;
+	    }
+	}
+	pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void ypfs_dircache_fill(struct ypfs_dircache *cache, int rootfd, const char *path, int depth)
+{
+    char child[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *de;
+    DIR *dp;
+    int fd;
+
+    // path is fs-relative; skip the leading '/' for openat()
+    fd = openat(rootfd, path + 1, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	return;
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+	close(fd);
+	return;
+    }
+    ypfs_dircache_add(cache, path, strlen(path));
+
+    if (depth > 0)
+	while ((de = readdir(dp)) != NULL) {
+	    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		continue;
+	    if (de->d_type != DT_DIR) {
+		if (de->d_type != DT_UNKNOWN)
+		    continue;
+		if (fstatat(fd, de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0
+		    || !S_ISDIR(statbuf.st_mode))
+		    continue;
+	    }
+	    if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= sizeof(child))
+		continue;
+	    ypfs_dircache_fill(cache, rootfd, child, depth - 1);
+	}
+    closedir(dp);
+}
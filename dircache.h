@@ -0,0 +1,32 @@
+// Set of directories known to exist under rootdir
+//
+// Sorting a file into /Dates/Y/M/D/ used to cost an access() and
+// maybe a mkdir() for every component of the path, on every file,
+// though the directories nearly always exist already.  This remembers
+// which ones do, so the usual case makes no directory syscalls at all.
+//
+// Paths are fs-relative ("/Dates/2010/03/14"), without a trailing
+// slash, and passed with a length so prefixes of a longer path can be
+// looked up in place.  All calls are safe from any thread.
+
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <stddef.h>
+
+struct ypfs_dircache;
+
+struct ypfs_dircache *ypfs_dircache_new(void);
+void ypfs_dircache_free(struct ypfs_dircache *cache);
+
+int ypfs_dircache_has(struct ypfs_dircache *cache, const char *path, size_t len);
+void ypfs_dircache_add(struct ypfs_dircache *cache, const char *path, size_t len);
+
+// Forget 'path' and every directory below it
+void ypfs_dircache_remove(struct ypfs_dircache *cache, const char *path, size_t len);
+
+// Add 'path' and the directories under it, 'depth' levels down,
+// reading them relative to the directory fd 'rootfd'
+void ypfs_dircache_fill(struct ypfs_dircache *cache, int rootfd, const char *path, int depth);
+
+#endif
@@ -0,0 +1,940 @@
+/*
+  Bounded capture date reader
+
+  The first 16 bytes say what the file is, and so where to look:
+
+  - JPEG: SOI, then marker segments.  EXIF lives in an APP1 segment
+    starting "Exif\0\0", whose payload is a little TIFF file.  We stop
+    at the first SOS, since nothing after it is metadata.
+
+  - TIFF, and the RAW formats built on it (CR2, NEF, ARW, DNG, PEF,
+    and ORF and RW2 with their own magic numbers): the file itself is
+    the TIFF.
+
+  - Fujifilm RAF: a header giving the offset of a full size JPEG
+    preview, which carries the EXIF.
+
+  - ISO base media (MP4, MOV, HEIC, CR3): a sequence of boxes, each
+    a size and a four character type, some holding more boxes.  We
+    hop from header to header without reading the contents, so the
+    media data in between costs nothing however big it is:
+
+      moov/mvhd      creation time, seconds since 1904 in UTC
+      moov/uuid      Canon CR3: CMT1 and CMT2 are TIFFs with IFD0
+                     and the Exif IFD, preferred over mvhd
+      meta           HEIC: iinf names the item of type "Exif", iloc
+                     says where it is; it holds a TIFF, after a
+                     4-byte offset to it
+
+  Anything else has no date we know how to find, and we say so after
+  that first read.
+
+  Inside the TIFF, IFD0 may carry DateTime (0x0132) and points to the
+  Exif IFD (0x8769), which may carry DateTimeOriginal (0x9003).  The
+  latter is when the shutter fired, so it wins.  IFD0 also has the
+  camera Model (0x0110), which the catalog records.  IFD0 links on to
+  IFD1, which describes the embedded thumbnail: a small JPEG at
+  offset 0x0201, 0x0202 bytes long, inside the same APP1 segment.
+
+  All reads go through a small window that is refilled by pread() at
+  the offset we need next, and the total read is capped at
+  YPFS_EXIF_READ_MAX.  The first fill, and those for box headers, are
+  only EXIF_PEEK bytes; for an ordinary JPEG that covers SOI through
+  the dates, so that is one small pread, and a 4 GB video with its
+  moov at the end takes two.
+
+  The same parser also runs over bytes already in memory: the sniffer
+  keeps the first part of a file as it is written through ypfs_write
+  and reparses it after each write until the answer can no longer
+  change.  Running off the end of the data there means "not written
+  yet" rather than "no date".
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "exifdate.h"
+
+#define EXIF_WINDOW (64 * 1024)
+
+// first read, and reads of box headers
+#define EXIF_PEEK 4096
+
+#define TIFF_TAG_MODEL              0x0110
+#define TIFF_TAG_DATE_TIME          0x0132
+#define TIFF_TAG_EXIF_IFD           0x8769
+#define TIFF_TAG_DATE_TIME_ORIGINAL 0x9003
+#define TIFF_TAG_THUMB_OFFSET       0x0201
+#define TIFF_TAG_THUMB_LENGTH       0x0202
+#define TIFF_TYPE_ASCII             2
+#define TIFF_TYPE_LONG              4
+
+// don't believe IFDs claiming more entries than this
+#define TIFF_MAX_ENTRIES 1024
+
+// nor look at more boxes than this at one level
+#define BMFF_MAX_BOXES 256
+
+// a box that runs to the end of the file
+#define BMFF_EOF ((off_t) INT64_MAX)
+
+// from 1904-01-01, where mvhd counts from, to 1970-01-01
+#define BMFF_EPOCH 2082844800ULL
+
+// Canon's uuid box in a CR3's moov
+static const unsigned char cr3_uuid[16] = {
+    0x85, 0xc0, 0xb6, 0x87, 0x82, 0x0f, 0x11, 0xe0,
+    0x81, 0x11, 0xf4, 0xce, 0x46, 0x2b, 0x6a, 0x48
+};
+
+struct exif_reader {
+    int fd;			// -1 when parsing a buffer
+    const unsigned char *buf;	// window, or the whole buffer
+    off_t base;			// file offset of buf[0]
+    size_t len;			// valid bytes in buf
+    size_t budget;		// bytes we may still pread
+    int err;			// -errno of a failed pread, if any
+    int truncated;		// a buffer parse wanted bytes past its end
+    off_t wanted;		// and the furthest out it wanted
+    unsigned char *window;	// EXIF_WINDOW bytes, if fd >= 0
+};
+
+// Return a pointer to 'n' bytes at file offset 'off', reading 'fill'
+// bytes from there if the window doesn't already hold them.  NULL if
+// they're past EOF, past the read budget, or unreadable.
+static const unsigned char *reader_read(struct exif_reader *r, off_t off, size_t n, size_t fill)
+{
+    ssize_t got;
+    size_t want;
+
+    if (off < 0 || n > EXIF_WINDOW || off > BMFF_EOF - (off_t) n)
+	return NULL;
+    if (off >= r->base && off + n <= r->base + r->len)
+	return r->buf + (off - r->base);
+    if (r->fd < 0) {
+	r->truncated = 1;
+	if (off + (off_t) n > r->wanted)
+	    r->wanted = off + n;
+	return NULL;
+    }
+
+    want = r->budget < fill ? r->budget : fill;
+    if (want < n)
+	return NULL;
+    got = pread(r->fd, r->window, want, off);
+    if (got < 0) {
+	r->err = -errno;
+	r->len = 0;
+	return NULL;
+    }
+    r->budget -= got;
+    r->buf = r->window;
+    r->base = off;
+    r->len = got;
+    if ((size_t) got < n)
+	return NULL;
+
+    return r->buf;
+}
+
+// ... a window full, for metadata that's likely to go on a while
+static const unsigned char *reader_get(struct exif_reader *r, off_t off, size_t n)
+{
+    return reader_read(r, off, n, EXIF_WINDOW);
+}
+
+// ... only a little, for hopping from box to box
+static const unsigned char *reader_peek(struct exif_reader *r, off_t off, size_t n)
+{
+    return reader_read(r, off, n, n > EXIF_PEEK ? n : EXIF_PEEK);
+}
+
+static unsigned int get16(const unsigned char *p, int big_endian)
+{
+    if (big_endian)
+	return (p[0] << 8) | p[1];
+    return (p[1] << 8) | p[0];
+}
+
+static uint32_t get32(const unsigned char *p, int big_endian)
+{
+    if (big_endian)
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    return ((uint32_t) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return ((uint64_t) get32(p, 1) << 32) | get32(p + 4, 1);
+}
+
+// Byte order of a TIFF header, with ORF's and RW2's own magic numbers
+// in place of 42: 0 little endian, 1 big endian, -1 not a TIFF
+static int tiff_magic(const unsigned char *p)
+{
+    if (memcmp(p, "II*\0", 4) == 0 || memcmp(p, "IIRO", 4) == 0 || memcmp(p, "IIRS", 4) == 0
+	|| memcmp(p, "IIU\0", 4) == 0)
+	return 0;
+    if (memcmp(p, "MM\0*", 4) == 0 || memcmp(p, "MMOR", 4) == 0)
+	return 1;
+    return -1;
+}
+
+// Byte order and IFD0 offset of the TIFF header at file offset 'tiff'
+static int tiff_header(struct exif_reader *r, off_t tiff, int *big_endian, uint32_t *ifd0)
+{
+    const unsigned char *p;
+
+    p = reader_get(r, tiff, 8);
+    if (p == NULL)
+	return -ENOENT;
+    *big_endian = tiff_magic(p);
+    if (*big_endian < 0)
+	return -EINVAL;
+    *ifd0 = get32(p + 4, *big_endian);
+    return 0;
+}
+
+// "YYYY:MM:DD HH:MM:SS".  Cameras with an unset clock write zeroes or
+// blanks, which mean there's no date rather than year 0.
+static int parse_date(const unsigned char *s, size_t len, struct tm *tm)
+{
+    char str[20];
+    int year, month, day, hour = 0, min = 0, sec = 0;
+
+    if (len < 10)
+	return -ENOENT;
+    if (len > sizeof(str) - 1)
+	len = sizeof(str) - 1;
+    memcpy(str, s, len);
+    str[len] = '\0';
+
+    if (sscanf(str, "%4d:%2d:%2d %2d:%2d:%2d", &year, &month, &day, &hour, &min, &sec) < 3)
+	return -ENOENT;
+    if (year < 1900 || month < 1 || month > 12 || day < 1 || day > 31)
+	return -ENOENT;
+
+    memset(tm, 0, sizeof(*tm));
+    tm->tm_year = year - 1900;
+    tm->tm_mon = month - 1;
+    tm->tm_mday = day;
+    tm->tm_hour = hour;
+    tm->tm_min = min;
+    tm->tm_sec = sec;
+    tm->tm_isdst = -1;
+
+    return 0;
+}
+
+// Copy an ASCII tag of 'n' bytes at 'value' (or in the entry, if it
+// fits there) into 'model', which holds YPFS_EXIF_MODEL_MAX
+static void tiff_model(struct exif_reader *r, off_t tiff, const unsigned char *e, uint32_t n,
+		       uint32_t value, char *model)
+{
+    const unsigned char *p;
+    size_t len = n < YPFS_EXIF_MODEL_MAX ? n : YPFS_EXIF_MODEL_MAX - 1;
+
+    p = n <= 4 ? e + 8 : reader_get(r, tiff + value, len);
+    if (p == NULL)
+	return;
+    memcpy(model, p, len);
+    model[len] = '\0';
+    // padded with NULs or blanks
+    len = strlen(model);
+    while (len > 0 && model[len - 1] == ' ')
+	model[--len] = '\0';
+}
+
+// Look through one IFD of the TIFF starting at file offset 'tiff' for
+// a date tag 'want', and optionally the Exif IFD pointer and Model.
+static int tiff_ifd_date(struct exif_reader *r, off_t tiff, uint32_t ifd, int big_endian,
+			 unsigned int want, struct tm *tm, uint32_t *exif_ifd, char *model)
+{
+    const unsigned char *p;
+    const unsigned char *e;
+    unsigned int count;
+    unsigned int i;
+    unsigned int tag, type;
+    uint32_t n, value;
+    uint32_t date_off = 0, date_len = 0;
+    uint32_t model_off = 0, model_len = 0;
+    unsigned char model_entry[12];
+
+    p = reader_get(r, tiff + ifd, 2);
+    if (p == NULL)
+	return -ENOENT;
+    count = get16(p, big_endian);
+    if (count == 0 || count > TIFF_MAX_ENTRIES)
+	return -EINVAL;
+    p = reader_get(r, tiff + ifd + 2, count * 12);
+    if (p == NULL)
+	return -ENOENT;
+
+    // copy out what we need before the next reader_get() can move the
+    // window under us
+    for (i = 0; i < count; i++) {
+	e = p + i * 12;
+	tag = get16(e, big_endian);
+	type = get16(e + 2, big_endian);
+	n = get32(e + 4, big_endian);
+	value = get32(e + 8, big_endian);
+
+	if (tag == want && type == TIFF_TYPE_ASCII && n > 4) {
+	    date_off = value;
+	    date_len = n;
+	} else if (tag == TIFF_TAG_EXIF_IFD && exif_ifd != NULL && type == TIFF_TYPE_LONG)
+	    *exif_ifd = value;
+	else if (tag == TIFF_TAG_MODEL && model != NULL && type == TIFF_TYPE_ASCII && n > 0) {
+	    model_off = value;
+	    model_len = n;
+	    memcpy(model_entry, e, sizeof(model_entry));
+	}
+    }
+
+    if (model_len > 0)
+	tiff_model(r, tiff, model_entry, model_len, model_off, model);
+
+    if (date_off == 0)
+	return -ENOENT;
+    if (date_len > 20)
+	date_len = 20;
+    p = reader_get(r, tiff + date_off, date_len);
+    if (p == NULL)
+	return -ENOENT;
+
+    return parse_date(p, date_len, tm);
+}
+
+// Date (and Model) from a TIFF header at file offset 'tiff'
+static int tiff_date(struct exif_reader *r, off_t tiff, struct tm *tm, char *model)
+{
+    int big_endian;
+    uint32_t ifd0;
+    uint32_t exif_ifd = 0;
+    int ret;
+
+    ret = tiff_header(r, tiff, &big_endian, &ifd0);
+    if (ret < 0)
+	return ret;
+    ret = tiff_ifd_date(r, tiff, ifd0, big_endian, TIFF_TAG_DATE_TIME, tm, &exif_ifd, model);
+    if (exif_ifd != 0) {
+	struct tm original;
+
+	if (tiff_ifd_date(r, tiff, exif_ifd, big_endian, TIFF_TAG_DATE_TIME_ORIGINAL,
+			  &original, NULL, NULL) == 0) {
+	    *tm = original;
+	    return 0;
+	}
+    }
+
+    return ret;
+}
+
+// Walk JPEG marker segments from just past the SOI at 'start' to the
+// EXIF APP1, and give the file offset of the TIFF header in it
+static int jpeg_tiff(struct exif_reader *r, off_t start, off_t *tiff)
+{
+    const unsigned char *p;
+    off_t off = start + 2;
+    unsigned int marker;
+    unsigned int seglen;
+
+    for (;;) {
+	p = reader_get(r, off, 4);
+	if (p == NULL || p[0] != 0xFF)
+	    return -ENOENT;
+	marker = p[1];
+
+	if (marker == 0xFF) {		// fill byte
+	    off++;
+	    continue;
+	}
+	if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+	    off += 2;			// no length field
+	    continue;
+	}
+	if (marker == 0xDA || marker == 0xD9)
+	    return -ENOENT;		// image data, no EXIF before it
+
+	seglen = get16(p + 2, 1);
+	if (seglen < 2)
+	    return -ENOENT;
+	if (marker == 0xE1 && seglen >= 8) {
+	    p = reader_get(r, off + 4, 6);
+	    if (p != NULL && memcmp(p, "Exif\0\0", 6) == 0) {
+		*tiff = off + 10;
+		return 0;
+	    }
+	}
+	off += 2 + seglen;
+    }
+}
+
+enum exif_format {
+    EXIF_UNKNOWN,
+    EXIF_JPEG,
+    EXIF_TIFF,
+    EXIF_RAF,
+    EXIF_BMFF
+};
+
+// What the 16 bytes at the start of a file say it is
+static enum exif_format exif_format(const unsigned char *p)
+{
+    if (p[0] == 0xFF && p[1] == 0xD8)
+	return EXIF_JPEG;
+    if (tiff_magic(p) >= 0)
+	return EXIF_TIFF;
+    if (memcmp(p, "FUJIFILMCCD-RAW ", 16) == 0)
+	return EXIF_RAF;
+    // MP4 and HEIC start with ftyp; old QuickTime files with any of
+    // the others
+    if (memcmp(p + 4, "ftyp", 4) == 0 || memcmp(p + 4, "moov", 4) == 0
+	|| memcmp(p + 4, "mdat", 4) == 0 || memcmp(p + 4, "wide", 4) == 0
+	|| memcmp(p + 4, "free", 4) == 0 || memcmp(p + 4, "skip", 4) == 0)
+	return EXIF_BMFF;
+    return EXIF_UNKNOWN;
+}
+
+// Where the TIFF header is: in the APP1 segment of a JPEG, at the
+// start of a TIFF, or in the APP1 of a RAF's JPEG preview
+static int exif_tiff(struct exif_reader *r, const unsigned char *magic, off_t *tiff)
+{
+    const unsigned char *p;
+
+    switch (exif_format(magic)) {
+    case EXIF_JPEG:
+	return jpeg_tiff(r, 0, tiff);
+    case EXIF_TIFF:
+	*tiff = 0;
+	return 0;
+    case EXIF_RAF:
+	p = reader_peek(r, 84, 4);
+	if (p == NULL)
+	    return -ENOENT;
+	return jpeg_tiff(r, get32(p, 1), tiff);
+    default:
+	return -ENOENT;
+    }
+}
+
+struct bmff_box {
+    char type[4];
+    off_t body;			// file offset of the contents
+    off_t end;			// and of the next box
+};
+
+// The header of the box at 'off', which has to end by 'end'
+static int bmff_box(struct exif_reader *r, off_t off, off_t end, struct bmff_box *box)
+{
+    const unsigned char *p;
+    uint64_t size;
+
+    p = reader_peek(r, off, 8);
+    if (p == NULL)
+	return -ENOENT;
+    size = get32(p, 1);
+    memcpy(box->type, p + 4, 4);
+    box->body = off + 8;
+    if (size == 1) {
+	p = reader_peek(r, off + 8, 8);
+	if (p == NULL)
+	    return -ENOENT;
+	size = get64(p);
+	box->body += 8;
+    } else if (size == 0)
+	size = end - off;		// the rest of the parent
+    if (size < (uint64_t) (box->body - off) || size > (uint64_t) (end - off))
+	return -EINVAL;
+    box->end = off + size;
+    if (memcmp(box->type, "uuid", 4) == 0)
+	box->body += 16;		// the uuid itself
+    if (box->body > box->end)
+	return -EINVAL;
+    return 0;
+}
+
+// The first box of type 'type' among those from 'off' to 'end'
+static int bmff_find(struct exif_reader *r, off_t off, off_t end, const char *type,
+		     struct bmff_box *box)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < BMFF_MAX_BOXES && off < end; i++) {
+	ret = bmff_box(r, off, end, box);
+	if (ret < 0)
+	    return ret;
+	if (memcmp(box->type, type, 4) == 0)
+	    return 0;
+	off = box->end;
+    }
+    return -ENOENT;
+}
+
+// A 'size' byte big endian number at '*pos', which moves past it.
+// iloc's fields can be 0, 4 or 8 bytes; its counts 2.
+static int bmff_uint(struct exif_reader *r, off_t *pos, off_t end, unsigned int size,
+		     uint64_t *value)
+{
+    const unsigned char *p;
+
+    if (size == 0) {
+	*value = 0;
+	return 0;
+    }
+    if (size != 2 && size != 4 && size != 8)
+	return -EINVAL;
+    if (*pos + (off_t) size > end)
+	return -EINVAL;
+    p = reader_peek(r, *pos, size);
+    if (p == NULL)
+	return -ENOENT;
+    *value = size == 2 ? get16(p, 1) : size == 4 ? get32(p, 1) : get64(p);
+    *pos += size;
+    return 0;
+}
+
+// Creation time in the mvhd box 'mvhd'.  The spec says UTC; cameras
+// that don't know their time zone write local time, and then we're
+// out by the offset, which is still closer than the copy time.
+static int mvhd_date(struct exif_reader *r, const struct bmff_box *mvhd, struct tm *tm)
+{
+    const unsigned char *p;
+    uint64_t created;
+    time_t t;
+
+    if (mvhd->end - mvhd->body < 12)
+	return -EINVAL;
+    p = reader_peek(r, mvhd->body, 12);
+    if (p == NULL)
+	return -ENOENT;
+    created = p[0] == 1 ? get64(p + 4) : get32(p + 4, 1);
+    // an unset clock gives 0, or something just after it
+    if (created <= BMFF_EPOCH)
+	return -ENOENT;
+    t = created - BMFF_EPOCH;
+    if (localtime_r(&t, tm) == NULL)
+	return -ENOENT;
+    return 0;
+}
+
+// DateTimeOriginal, or DateTime, and Model from the CMT boxes in a
+// CR3's uuid box
+static int cr3_date(struct exif_reader *r, const struct bmff_box *uuid, struct tm *tm,
+		    char *model)
+{
+    struct bmff_box cmt;
+    struct tm original;
+    int big_endian;
+    uint32_t ifd0;
+    int ret = -ENOENT;
+
+    if (bmff_find(r, uuid->body, uuid->end, "CMT1", &cmt) == 0)
+	ret = tiff_date(r, cmt.body, tm, model);
+    // CMT2 holds the Exif IFD, as its IFD0
+    if (bmff_find(r, uuid->body, uuid->end, "CMT2", &cmt) == 0
+	&& tiff_header(r, cmt.body, &big_endian, &ifd0) == 0
+	&& tiff_ifd_date(r, cmt.body, ifd0, big_endian, TIFF_TAG_DATE_TIME_ORIGINAL, &original,
+			 NULL, NULL) == 0) {
+	*tm = original;
+	return 0;
+    }
+    return ret;
+}
+
+// Date from the moov box 'moov': a CR3's EXIF, else mvhd
+static int moov_date(struct exif_reader *r, const struct bmff_box *moov, struct tm *tm,
+		     char *model)
+{
+    struct bmff_box box;
+    struct bmff_box mvhd;
+    const unsigned char *p;
+    off_t off = moov->body;
+    int have_mvhd = 0;
+    int i;
+
+    for (i = 0; i < BMFF_MAX_BOXES && off < moov->end; i++) {
+	if (bmff_box(r, off, moov->end, &box) < 0)
+	    break;
+	if (memcmp(box.type, "mvhd", 4) == 0) {
+	    mvhd = box;
+	    have_mvhd = 1;
+	} else if (memcmp(box.type, "uuid", 4) == 0) {
+	    p = reader_peek(r, box.body - 16, 16);
+	    if (p != NULL && memcmp(p, cr3_uuid, 16) == 0 && cr3_date(r, &box, tm, model) == 0)
+		return 0;
+	}
+	off = box.end;
+    }
+
+    if (!have_mvhd)
+	return -ENOENT;
+    return mvhd_date(r, &mvhd, tm);
+}
+
+// ID of the first item of type 'type' in the iinf box 'iinf'
+static int heif_item(struct exif_reader *r, const struct bmff_box *iinf, const char *type,
+		     uint32_t *id)
+{
+    const unsigned char *p;
+    struct bmff_box infe;
+    off_t off;
+    int i;
+
+    p = reader_peek(r, iinf->body, 4);
+    if (p == NULL)
+	return -ENOENT;
+    // version and flags, then a count we don't need
+    off = iinf->body + 4 + (p[0] == 0 ? 2 : 4);
+
+    for (i = 0; i < BMFF_MAX_BOXES && off < iinf->end; i++) {
+	if (bmff_box(r, off, iinf->end, &infe) < 0)
+	    return -ENOENT;
+	off = infe.end;
+	if (memcmp(infe.type, "infe", 4) != 0 || infe.end - infe.body < 12)
+	    continue;
+	p = reader_peek(r, infe.body, 12);
+	if (p == NULL)
+	    return -ENOENT;
+	// versions 0 and 1 predate item types
+	if (p[0] == 2 && memcmp(p + 8, type, 4) == 0) {
+	    *id = get16(p + 4, 1);
+	    return 0;
+	}
+	if (p[0] == 3 && infe.end - infe.body >= 14) {
+	    p = reader_peek(r, infe.body, 14);
+	    if (p != NULL && memcmp(p + 10, type, 4) == 0) {
+		*id = get32(p + 4, 1);
+		return 0;
+	    }
+	}
+    }
+    return -ENOENT;
+}
+
+// File offset and length of item 'id', from the iloc box 'iloc'.
+// Only items stored in the file itself, in one piece, will do.
+static int heif_locate(struct exif_reader *r, const struct bmff_box *iloc, uint32_t id,
+		       off_t *offset, uint64_t *len)
+{
+    const unsigned char *p;
+    unsigned int version;
+    unsigned int offset_size, length_size, base_size, index_size;
+    uint64_t count, item, method, dref, base, extents, index, extent_off, extent_len;
+    off_t pos = iloc->body + 6;
+    uint64_t i, j;
+    int ret;
+
+    if (iloc->end - iloc->body < 8)
+	return -EINVAL;
+    p = reader_peek(r, iloc->body, 6);
+    if (p == NULL)
+	return -ENOENT;
+    version = p[0];
+    if (version > 2)
+	return -EINVAL;
+    offset_size = p[4] >> 4;
+    length_size = p[4] & 15;
+    base_size = p[5] >> 4;
+    index_size = version > 0 ? p[5] & 15 : 0;
+
+    if ((ret = bmff_uint(r, &pos, iloc->end, version < 2 ? 2 : 4, &count)) < 0)
+	return ret;
+    for (i = 0; i < count; i++) {
+	if ((ret = bmff_uint(r, &pos, iloc->end, version < 2 ? 2 : 4, &item)) < 0)
+	    return ret;
+	method = 0;
+	if (version > 0 && (ret = bmff_uint(r, &pos, iloc->end, 2, &method)) < 0)
+	    return ret;
+	// data_reference_index, 0 for this file
+	if ((ret = bmff_uint(r, &pos, iloc->end, 2, &dref)) < 0)
+	    return ret;
+	if ((ret = bmff_uint(r, &pos, iloc->end, base_size, &base)) < 0)
+	    return ret;
+	if ((ret = bmff_uint(r, &pos, iloc->end, 2, &extents)) < 0)
+	    return ret;
+	for (j = 0; j < extents; j++) {
+	    if ((ret = bmff_uint(r, &pos, iloc->end, index_size, &index)) < 0
+		|| (ret = bmff_uint(r, &pos, iloc->end, offset_size, &extent_off)) < 0
+		|| (ret = bmff_uint(r, &pos, iloc->end, length_size, &extent_len)) < 0)
+		return ret;
+	    if (item != id || j > 0)
+		continue;
+	    if ((method & 15) != 0 || dref != 0 || extents != 1 || extent_len == 0
+		|| base + extent_off > (uint64_t) BMFF_EOF)
+		return -ENOENT;
+	    *offset = base + extent_off;
+	    *len = extent_len;
+	    return 0;
+	}
+    }
+    return -ENOENT;
+}
+
+// Date and Model from the Exif item described in the meta box 'meta'
+static int heif_date(struct exif_reader *r, const struct bmff_box *meta, struct tm *tm,
+		     char *model)
+{
+    const unsigned char *p;
+    struct bmff_box box;
+    off_t start = meta->body + 4;	// past version and flags
+    off_t item;
+    uint64_t len;
+    uint32_t id;
+    uint32_t tiff;
+    int ret;
+
+    if ((ret = bmff_find(r, start, meta->end, "iinf", &box)) < 0
+	|| (ret = heif_item(r, &box, "Exif", &id)) < 0
+	|| (ret = bmff_find(r, start, meta->end, "iloc", &box)) < 0
+	|| (ret = heif_locate(r, &box, id, &item, &len)) < 0)
+	return ret;
+
+    // the TIFF header is this far past the offset, usually just
+    // after "Exif\0\0"
+    p = reader_peek(r, item, 4);
+    if (p == NULL)
+	return -ENOENT;
+    tiff = get32(p, 1);
+    if (len < 12 || tiff > len - 12)
+	return -EINVAL;
+    return tiff_date(r, item + 4 + tiff, tm, model);
+}
+
+// Date from the top level boxes of an ISO base media file
+static int bmff_date(struct exif_reader *r, struct tm *tm, char *model)
+{
+    struct bmff_box box;
+    off_t off = 0;
+    int ret = -ENOENT;
+    int i;
+
+    for (i = 0; i < BMFF_MAX_BOXES; i++) {
+	if (bmff_box(r, off, BMFF_EOF, &box) < 0)
+	    break;
+	if (memcmp(box.type, "moov", 4) == 0)
+	    return moov_date(r, &box, tm, model);
+	if (memcmp(box.type, "meta", 4) == 0) {
+	    ret = heif_date(r, &box, tm, model);
+	    if (ret == 0)
+		return 0;
+	}
+	off = box.end;
+    }
+    return ret;
+}
+
+static int exif_date(struct exif_reader *r, struct tm *tm, char *model)
+{
+    const unsigned char *p;
+    off_t tiff;
+    int ret;
+
+    p = reader_peek(r, 0, 16);
+    if (p == NULL)
+	return -ENOENT;
+    if (exif_format(p) == EXIF_BMFF)
+	return bmff_date(r, tm, model);
+
+    ret = exif_tiff(r, p, &tiff);
+    if (ret < 0)
+	return ret;
+    return tiff_date(r, tiff, tm, model);
+}
+
+// Thumbnail pointed to by IFD1 of the TIFF at file offset 'tiff'
+static int tiff_thumb(struct exif_reader *r, off_t tiff, off_t *offset, size_t *len)
+{
+    const unsigned char *p;
+    const unsigned char *e;
+    unsigned int count;
+    unsigned int i;
+    int big_endian;
+    uint32_t ifd;
+    uint32_t thumb_off = 0, thumb_len = 0;
+    int ret;
+
+    ret = tiff_header(r, tiff, &big_endian, &ifd);
+    if (ret < 0)
+	return ret;
+
+    // IFD1 is wherever IFD0 says the next one is
+    p = reader_get(r, tiff + ifd, 2);
+    if (p == NULL)
+	return -ENOENT;
+    count = get16(p, big_endian);
+    if (count == 0 || count > TIFF_MAX_ENTRIES)
+	return -EINVAL;
+    p = reader_get(r, tiff + ifd + 2 + count * 12, 4);
+    if (p == NULL)
+	return -ENOENT;
+    ifd = get32(p, big_endian);
+    if (ifd == 0)
+	return -ENOENT;
+
+    p = reader_get(r, tiff + ifd, 2);
+    if (p == NULL)
+	return -ENOENT;
+    count = get16(p, big_endian);
+    if (count == 0 || count > TIFF_MAX_ENTRIES)
+	return -EINVAL;
+    p = reader_get(r, tiff + ifd + 2, count * 12);
+    if (p == NULL)
+	return -ENOENT;
+    for (i = 0; i < count; i++) {
+	e = p + i * 12;
+	if (get16(e, big_endian) == TIFF_TAG_THUMB_OFFSET)
+	    thumb_off = get32(e + 8, big_endian);
+	else if (get16(e, big_endian) == TIFF_TAG_THUMB_LENGTH)
+	    thumb_len = get32(e + 8, big_endian);
+    }
+
+    if (thumb_off == 0 || thumb_len == 0 || thumb_len > YPFS_EXIF_THUMB_MAX)
+	return -ENOENT;
+    *offset = tiff + thumb_off;
+    *len = thumb_len;
+    return 0;
+}
+
+int ypfs_exif_date_fd(int fd, struct tm *tm, char *model)
+{
+    struct exif_reader r;
+    unsigned char window[EXIF_WINDOW];
+    int ret;
+
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.budget = YPFS_EXIF_READ_MAX;
+    r.window = window;
+
+    if (model != NULL)
+	model[0] = '\0';
+    ret = exif_date(&r, tm, model);
+    if (ret < 0 && r.err)
+	return r.err;
+    if (ret < 0)
+	return -ENOENT;
+    return ret;
+}
+
+int ypfs_exif_thumb_fd(int fd, off_t *offset, size_t *len)
+{
+    struct exif_reader r;
+    unsigned char window[EXIF_WINDOW];
+    const unsigned char *p;
+    off_t tiff;
+    int ret;
+
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.budget = YPFS_EXIF_READ_MAX;
+    r.window = window;
+
+    p = reader_peek(&r, 0, 16);
+    ret = p != NULL ? exif_tiff(&r, p, &tiff) : -ENOENT;
+    if (ret == 0)
+	ret = tiff_thumb(&r, tiff, offset, len);
+    if (ret < 0 && r.err)
+	return r.err;
+    if (ret < 0)
+	return -ENOENT;
+    return 0;
+}
+
+void ypfs_exif_sniff_init(struct ypfs_exif_sniff *sniff)
+{
+    memset(sniff, 0, sizeof(*sniff));
+    sniff->result = YPFS_SNIFF_PENDING;
+}
+
+void ypfs_exif_sniff_free(struct ypfs_exif_sniff *sniff)
+{
+    free(sniff->buf);
+    sniff->buf = NULL;
+    sniff->len = 0;
+}
+
+static void sniff_give_up(struct ypfs_exif_sniff *sniff)
+{
+    ypfs_exif_sniff_free(sniff);
+    sniff->result = YPFS_SNIFF_GAVE_UP;
+}
+
+void ypfs_exif_sniff_unseen(struct ypfs_exif_sniff *sniff, off_t offset)
+{
+    if (sniff->result == YPFS_SNIFF_PENDING
+	|| (sniff->result != YPFS_SNIFF_GAVE_UP && offset < sniff->extent))
+	sniff_give_up(sniff);
+}
+
+void ypfs_exif_sniff_feed(struct ypfs_exif_sniff *sniff, const void *buf, size_t size, off_t offset)
+{
+    struct exif_reader r;
+    unsigned char *grown;
+    size_t want;
+    int ret;
+
+    if (sniff->result == YPFS_SNIFF_GAVE_UP)
+	return;
+    if (sniff->result != YPFS_SNIFF_PENDING) {
+	// overwriting the header we took the answer from invalidates it
+	if (offset < sniff->extent)
+	    sniff_give_up(sniff);
+	return;
+    }
+
+    // only a write continuing exactly where the last one stopped
+    // extends the prefix
+    if (offset != (off_t) sniff->len) {
+	sniff_give_up(sniff);
+	return;
+    }
+
+    want = sniff->len + size;
+    if (want > YPFS_EXIF_READ_MAX)
+	want = YPFS_EXIF_READ_MAX;
+    if (want > sniff->cap) {
+	grown = realloc(sniff->buf, want);
+	if (grown == NULL) {
+	    sniff_give_up(sniff);
+	    return;
+	}
+	sniff->buf = grown;
+	sniff->cap = want;
+    }
+    memcpy(sniff->buf + sniff->len, buf, want - sniff->len);
+    sniff->len = want;
+
+    memset(&r, 0, sizeof(r));
+    r.fd = -1;
+    r.buf = sniff->buf;
+    r.len = sniff->len;
+
+    sniff->model[0] = '\0';
+    ret = exif_date(&r, &sniff->date, sniff->model);
+    // even with DateTime in hand, DateTimeOriginal may still be on
+    // its way.  What's wanted from past the prefix we keep, as for a
+    // moov after gigabytes of mdat, is left to pread.
+    if (r.truncated && sniff->len < YPFS_EXIF_READ_MAX && r.wanted <= YPFS_EXIF_READ_MAX)
+	return;
+    if (ret == 0)
+	sniff->result = YPFS_SNIFF_FOUND;
+    else if (!r.truncated)
+	sniff->result = YPFS_SNIFF_NONE;
+    else
+	sniff->result = YPFS_SNIFF_GAVE_UP;
+
+    // done; keep only how far the answer depended on
+    sniff->extent = sniff->len;
+    free(sniff->buf);
+    sniff->buf = NULL;
+    sniff->cap = 0;
+}
@@ -0,0 +1,71 @@
+// Capture date extraction for ingest
+//
+// libexif's exif_data_new_from_file() reopens the file by name and
+// reads until it finds EXIF or EOF, which for a large file without
+// EXIF is a second read of the whole thing.  All we need is the date,
+// so this picks a reader by the first bytes of the file and reads
+// just the JPEG markers up to APP1, a TIFF or RAW file's IFD chain,
+// or the box headers of an MP4, MOV or HEIC down to the date, never
+// more than YPFS_EXIF_READ_MAX bytes per file.
+
+#ifndef _EXIFDATE_H_
+#define _EXIFDATE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+// hard cap on bytes pread() from one file while looking for a date
+#define YPFS_EXIF_READ_MAX (128 * 1024)
+
+// camera model strings are cut to this, NUL included
+#define YPFS_EXIF_MODEL_MAX 40
+
+// Fill in year/month/day/hour/min/sec of 'tm' from DateTimeOriginal,
+// or failing that DateTime, of the JPEG, TIFF, RAW or HEIC open on
+// 'fd', or from the creation time of the MP4 or MOV, in local time.
+// The fd's file offset is not used or changed.  Returns 0, -ENOENT if
+// the file has no usable date, or -errno if a read fails.  If 'model'
+// is not NULL, it gets the camera model, or "" if there is none.
+int ypfs_exif_date_fd(int fd, struct tm *tm, char *model);
+
+// Embedded thumbnails can't be bigger than the APP1 segment they are in
+#define YPFS_EXIF_THUMB_MAX (64 * 1024)
+
+// Where the JPEG thumbnail embedded in the EXIF of the JPEG, TIFF or
+// RAW open on 'fd' is: 'len' bytes from file offset 'offset'.  Reads
+// only the metadata, within the same cap as the date.  Returns 0,
+// -ENOENT if there is no thumbnail, or -errno if a read fails.
+int ypfs_exif_thumb_fd(int fd, off_t *offset, size_t *len);
+
+// Streaming variant, fed with the data of each ypfs_write on a handle.
+// Files written front to back (which is how everything lands in the
+// inbox) have their date worked out by the time they're released, so
+// ingest needn't read them back at all.
+enum ypfs_sniff_result {
+    YPFS_SNIFF_PENDING,		// header not complete yet
+    YPFS_SNIFF_FOUND,		// 'date' is valid
+    YPFS_SNIFF_NONE,		// whole header seen, it has no date
+    YPFS_SNIFF_GAVE_UP		// out of order writes etc; read the file
+};
+
+struct ypfs_exif_sniff {
+    enum ypfs_sniff_result result;
+    struct tm date;
+    char model[YPFS_EXIF_MODEL_MAX];	// with 'date', or ""
+    unsigned char *buf;		// file prefix while PENDING
+    size_t len;
+    size_t cap;
+    off_t extent;		// bytes the result was decided from
+};
+
+void ypfs_exif_sniff_init(struct ypfs_exif_sniff *sniff);
+void ypfs_exif_sniff_feed(struct ypfs_exif_sniff *sniff, const void *buf, size_t size, off_t offset);
+void ypfs_exif_sniff_free(struct ypfs_exif_sniff *sniff);
+
+// Note data that went into the file at 'offset' without being fed,
+// as by copy_file_range().  Unless it lands past what the answer was
+// taken from, the file will have to be read after all.
+void ypfs_exif_sniff_unseen(struct ypfs_exif_sniff *sniff, off_t offset);
+
+#endif
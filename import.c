@@ -0,0 +1,712 @@
+/*
+  Bulk import
+
+  One walker thread reads the source tree with getdents64, relative
+  to each directory's fd, and puts the path of every regular file on
+  a bounded ring; 'nthreads' import threads take them off and copy
+  them in.  Like the ingest queue, a full ring blocks the walker, so
+  it never runs far ahead of the copying.  The walk stays on the
+  source's filesystem, as find -xdev would, which also keeps it out
+  of the mount itself.
+
+  A file is dated by ypfs_ingest_date(), reading at most the EXIF
+  header from the source.  The copy goes into an O_TMPFILE in the day
+  directory, which is linked in under the file's name once it is
+  complete, so nobody sees half a photo under /Dates, and an existing
+  file of that name is never replaced.  Filesystems without O_TMPFILE
+  get the name created O_EXCL up front, and removed again if the copy
+  fails.
+
+  With duplicates being collapsed, each file is hashed before it is
+  copied.  A photo that is under /Dates already, from an earlier import
+  of an overlapping card or a copy through the mount, is reflinked from
+  the copy that is there, or hard linked to it where the filesystem
+  can't reflink, rather than copied again; a copy is indexed, like one
+  that came in through ingest, for later ones to collapse onto.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "attrcache.h"
+#include "dedup.h"
+#include "dircache.h"
+#include "exifdate.h"
+#include "import.h"
+#include "ingest.h"
+#include "stats.h"
+
+int __mkdir(struct ypfs_state *, const char *);
+void ypfs_notify(struct ypfs_state *, const char *, const struct stat *);
+const char *ypfs_relpath(const char *);
+
+#define IMPORT_QUEUE 1024
+#define IMPORT_DIRENT_BUF (32 * 1024)
+#define IMPORT_COPY_BUF (1024 * 1024)
+
+// card layouts are a few levels deep; don't follow anything silly
+#define IMPORT_MAX_DEPTH 32
+
+struct import_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct ypfs_import {
+    struct ypfs_state *state;
+    int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // ring of source paths
+    char **queue;
+    int head;
+    int count;
+
+    int running;
+    int walking;		// the walker may still add to the ring
+    int stopping;
+    int active;			// import threads not yet done
+
+    pthread_t walker;
+    int walker_started;
+    pthread_t *threads;
+    int started;
+
+    char *source;
+    dev_t dev;			// the walk doesn't leave this filesystem
+    int logfd;
+
+    // counters for the current or last import
+    size_t found;
+    uint64_t found_bytes;
+    size_t done;
+    size_t imported;
+    uint64_t bytes;
+    size_t cloned;
+    size_t linked;		// hard links to a copy already there
+    size_t skipped;
+    size_t errors;
+    struct timespec begun;
+    struct timespec finished;
+};
+
+static double import_seconds(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Note a file that couldn't be imported in the log
+static void import_failed(struct ypfs_import *imp, const char *src, int err)
+{
+    char msg[128];
+
+    __atomic_add_fetch(&imp->errors, 1, __ATOMIC_RELAXED);
+    if (imp->logfd >= 0)
+	dprintf(imp->logfd, "%s: %s\n", src, strerror_r(-err, msg, sizeof(msg)));
+}
+
+static void import_push(struct ypfs_import *imp, char *path)
+{
+    pthread_mutex_lock(&imp->lock);
+    while (imp->count == IMPORT_QUEUE && !imp->stopping)
+	pthread_cond_wait(&imp->not_full, &imp->lock);
+    if (imp->stopping) {
+	pthread_mutex_unlock(&imp->lock);
+	free(path);
+	return;
+    }
+    imp->queue[(imp->head + imp->count) % IMPORT_QUEUE] = path;
+    imp->count++;
+    pthread_cond_signal(&imp->not_empty);
+    pthread_mutex_unlock(&imp->lock);
+}
+
+// Queue every regular file under directory 'dirfd', whose path is the
+// first 'len' bytes of 'path'
+static void import_walk(struct ypfs_import *imp, int dirfd, char *path, size_t len, int depth)
+{
+    struct import_dirent64 *de;
+    struct stat st;
+    char *buf;
+    char *copy;
+    size_t namelen;
+    long n, pos;
+    int fd;
+
+    buf = malloc(IMPORT_DIRENT_BUF);
+    if (buf == NULL) {
+	import_failed(imp, path, -ENOMEM);
+	return;
+    }
+
+    while (!imp->stopping && (n = syscall(SYS_getdents64, dirfd, buf, IMPORT_DIRENT_BUF)) > 0)
+	for (pos = 0; pos < n && !imp->stopping; pos += de->d_reclen) {
+	    de = (struct import_dirent64 *) (buf + pos);
+	    // also skips . and .., and the .Trashes and such on cards
+	    if (de->d_name[0] == '.')
+		continue;
+
+	    namelen = strlen(de->d_name);
+	    if (len + 1 + namelen >= PATH_MAX)
+		continue;
+	    path[len] = '/';
+	    memcpy(path + len + 1, de->d_name, namelen + 1);
+
+	    if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		import_failed(imp, path, -errno);
+		continue;
+	    }
+
+	    if (S_ISDIR(st.st_mode)) {
+		if (st.st_dev != imp->dev || depth >= IMPORT_MAX_DEPTH)
+		    continue;
+		fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+		    import_failed(imp, path, -errno);
+		    continue;
+		}
+		import_walk(imp, fd, path, len + 1 + namelen, depth + 1);
+		close(fd);
+		continue;
+	    }
+	    if (!S_ISREG(st.st_mode))
+		continue;
+
+	    copy = strdup(path);
+	    if (copy == NULL) {
+		import_failed(imp, path, -ENOMEM);
+		continue;
+	    }
+	    __atomic_add_fetch(&imp->found, 1, __ATOMIC_RELAXED);
+	    __atomic_add_fetch(&imp->found_bytes, st.st_size, __ATOMIC_RELAXED);
+	    import_push(imp, copy);
+	}
+    path[len] = '\0';
+
+    free(buf);
+}
+
+static void *import_walker(void *arg)
+{
+    struct ypfs_import *imp = arg;
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s", imp->source);
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	import_failed(imp, path, -errno);
+    else {
+	import_walk(imp, fd, path, strlen(path), 0);
+	close(fd);
+    }
+
+    pthread_mutex_lock(&imp->lock);
+    imp->walking = 0;
+    pthread_cond_broadcast(&imp->not_empty);
+    pthread_mutex_unlock(&imp->lock);
+
+    return NULL;
+}
+
+// Copy 'size' bytes of 'in' to 'out'.  A reflink if the filesystem
+// can, copy_file_range() if not, and pread/pwrite through 'buf' when
+// the kernel won't copy between the two filesystems.  Returns 1 for a
+// reflink, 0 for a copy, or -errno.
+static int import_copy(int in, int out, off_t size, char *buf)
+{
+    loff_t off = 0;
+    loff_t outoff = 0;
+    ssize_t n, w;
+    size_t put;
+
+    if (ioctl(out, FICLONE, in) == 0)
+	return 1;
+
+    while (off < size) {
+	n = copy_file_range(in, &off, out, &outoff, size - off, 0);
+	if (n > 0)
+	    continue;
+	if (n == 0)
+	    return 0;		// the source got shorter
+	if (errno == EINTR)
+	    continue;
+	if (off > 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+			&& errno != EOPNOTSUPP))
+	    return -errno;
+	break;
+    }
+
+    while (off < size) {
+	n = pread(in, buf, IMPORT_COPY_BUF, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -errno;
+	if (n == 0)
+	    break;
+	for (put = 0; put < n; put += w) {
+	    w = pwrite(out, buf + put, n - put, off + put);
+	    if (w < 0 && errno == EINTR)
+		w = 0;
+	    else if (w < 0)
+		return -errno;
+	}
+	off += n;
+    }
+
+    return 0;
+}
+
+// A name that is already taken: the same photo imported before, if
+// the size matches
+static int import_exists(int dirfd, const char *name, const struct stat *src)
+{
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)
+	&& st.st_size == src->st_size)
+	return 1;
+    return -EEXIST;
+}
+
+// Import one file.  Returns 0, 1 if it was skipped, or -errno.
+static int import_file(struct ypfs_import *imp, const char *src, char *buf)
+{
+    struct ypfs_state *state = imp->state;
+    const char *name = strrchr(src, '/') + 1;
+    char datepath[PATH_MAX];
+    char newpath[PATH_MAX];
+    char procpath[64];
+    char model[YPFS_EXIF_MODEL_MAX] = "";
+    char dup[PATH_MAX];
+    struct ypfs_hash sum;
+    struct timespec times[2];
+    struct stat st;
+    struct tm ts;
+    int from_exif;
+    int retstat;
+    int cloned;
+    int tmpfile = 1;
+    int dirfd = -1;
+    int dupfd = -1;
+    int out = -1;
+    int in;
+
+    in = open(src, O_RDONLY | O_NOFOLLOW);
+    if (in < 0)
+	return -errno;
+    if (fstat(in, &st) < 0) {
+	retstat = -errno;
+	goto out;
+    }
+
+    // dated just as ingest would date it
+    from_exif = ypfs_ingest_date(in, &ts, model);
+    if (from_exif < 0) {
+	retstat = from_exif;
+	goto out;
+    }
+    strftime(datepath, sizeof(datepath), "/Dates/%Y/%m/%d", &ts);
+    if (snprintf(newpath, sizeof(newpath), "%s/%s", datepath, name) >= sizeof(newpath)) {
+	retstat = -ENAMETOOLONG;
+	goto out;
+    }
+
+    // the same photo already sorted, from an earlier import or the inbox
+    sum.len = -1;
+    if (state->dedup != NULL && st.st_size >= YPFS_DEDUP_MIN && ypfs_hash_fd(in, &sum) < 0)
+	sum.len = -1;
+    if (sum.len >= YPFS_DEDUP_MIN && ypfs_dedup_find(state->dedup, &sum, dup, sizeof(dup))) {
+	if (strcmp(dup, newpath) == 0) {
+	    retstat = 1;
+	    goto out;
+	}
+	dupfd = openat(state->rootfd, ypfs_relpath(dup), O_RDONLY);
+    }
+
+    retstat = __mkdir(state, datepath);
+    if (retstat < 0)
+	goto out;
+    dirfd = openat(state->rootfd, ypfs_relpath(datepath), O_PATH | O_DIRECTORY);
+    if (dirfd < 0 && errno == ENOENT) {
+	// removed behind our back, as in ypfs_ingest_file
+	ypfs_dircache_remove(state->dirs, datepath, strlen(datepath));
+	retstat = __mkdir(state, datepath);
+	if (retstat < 0)
+	    goto out;
+	dirfd = openat(state->rootfd, ypfs_relpath(datepath), O_PATH | O_DIRECTORY);
+    }
+    if (dirfd < 0) {
+	retstat = -errno;
+	goto out;
+    }
+
+    out = openat(dirfd, ".", O_TMPFILE | O_WRONLY, st.st_mode & 0777);
+    if (out < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+	tmpfile = 0;
+	out = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY, st.st_mode & 0777);
+    }
+    if (out < 0) {
+	retstat = errno == EEXIST ? import_exists(dirfd, name, &st) : -errno;
+	goto out;
+    }
+
+    if (dupfd >= 0 && ioctl(out, FICLONE, dupfd) == 0)
+	retstat = 1;
+    else if (dupfd >= 0) {
+	// no reflinks here; share the copy that is there instead
+	close(out);
+	out = -1;
+	if (!tmpfile)
+	    unlinkat(dirfd, name, 0);
+	if (linkat(state->rootfd, ypfs_relpath(dup), dirfd, name, 0) < 0) {
+	    retstat = errno == EEXIST ? import_exists(dirfd, name, &st) : -errno;
+	    goto out;
+	}
+	__atomic_add_fetch(&imp->linked, 1, __ATOMIC_RELAXED);
+	goto placed;
+    } else
+	retstat = import_copy(in, out, st.st_size, buf);
+    if (retstat < 0) {
+	if (!tmpfile)
+	    unlinkat(dirfd, name, 0);
+	goto out;
+    }
+    cloned = retstat;
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    futimens(out, times);
+    if (tmpfile) {
+	// linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, as in
+	// ypfs_link
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", out);
+	if (linkat(AT_FDCWD, procpath, dirfd, name, AT_SYMLINK_FOLLOW) < 0) {
+	    retstat = errno == EEXIST ? import_exists(dirfd, name, &st) : -errno;
+	    goto out;
+	}
+    }
+
+    if (cloned)
+	__atomic_add_fetch(&imp->cloned, 1, __ATOMIC_RELAXED);
+    if (dupfd < 0 && sum.len >= YPFS_DEDUP_MIN)
+	ypfs_dedup_add(state->dedup, &sum, newpath);
+
+ placed:
+    __atomic_add_fetch(&imp->imported, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&imp->bytes, st.st_size, __ATOMIC_RELAXED);
+
+    ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, ypfs_relpath(datepath));
+    ypfs_notify(state, newpath, NULL);
+    if (state->catalog != NULL)
+	ypfs_ingest_catalog(state, newpath, &ts, model, from_exif, &sum);
+    retstat = 0;
+
+ out:
+    if (dupfd >= 0)
+	close(dupfd);
+    if (out >= 0)
+	close(out);
+    if (dirfd >= 0)
+	close(dirfd);
+    close(in);
+    return retstat;
+}
+
+static void *import_worker(void *arg)
+{
+    struct ypfs_import *imp = arg;
+    struct timespec now;
+    char *path;
+    char *buf;
+    double secs;
+    uint64_t start;
+    int retstat;
+
+    buf = malloc(IMPORT_COPY_BUF);
+
+    pthread_mutex_lock(&imp->lock);
+    for (;;) {
+	while (imp->count == 0 && imp->walking && !imp->stopping)
+	    pthread_cond_wait(&imp->not_empty, &imp->lock);
+	if (imp->count == 0)
+	    break;
+
+	path = imp->queue[imp->head];
+	imp->head = (imp->head + 1) % IMPORT_QUEUE;
+	imp->count--;
+	pthread_cond_signal(&imp->not_full);
+	pthread_mutex_unlock(&imp->lock);
+
+	// on the way out, just empty the ring
+	if (!imp->stopping) {
+	    start = ypfs_stats_start(imp->state);
+	    retstat = buf == NULL ? -ENOMEM : import_file(imp, path, buf);
+	    ypfs_stats_stage(imp->state, YPFS_STAGE_IMPORT, start, retstat < 0 ? retstat : 0, 0,
+			     path);
+	    if (retstat < 0)
+		import_failed(imp, path, retstat);
+	    else if (retstat == 1)
+		__atomic_add_fetch(&imp->skipped, 1, __ATOMIC_RELAXED);
+	    __atomic_add_fetch(&imp->done, 1, __ATOMIC_RELAXED);
+	}
+	free(path);
+
+	pthread_mutex_lock(&imp->lock);
+    }
+
+    // last one out reports
+    if (--imp->active == 0) {
+	imp->running = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	imp->finished = now;
+	secs = import_seconds(&imp->begun, &now);
+	if (!imp->stopping)
+	    fprintf(stderr, "ypfs: imported %zu of %zu files from %s in %.1fs (%.1f MB/s), "
+		    "%zu reflinked, %zu linked, %zu skipped, %zu errors\n",
+		    imp->imported, imp->found, imp->source, secs,
+		    secs > 0 ? imp->bytes / secs / 1e6 : 0.0, imp->cloned, imp->linked,
+		    imp->skipped, imp->errors);
+	if (imp->logfd >= 0) {
+	    close(imp->logfd);
+	    imp->logfd = -1;
+	    // the kernel may still think it's as long as when it began
+	    ypfs_attrcache_invalidate_at(imp->state->attrs, imp->state->rootfd, YPFS_IMPORT_LOG);
+	    ypfs_notify(imp->state, "/" YPFS_IMPORT_LOG, NULL);
+	}
+    }
+    pthread_mutex_unlock(&imp->lock);
+
+    free(buf);
+
+    return NULL;
+}
+
+struct ypfs_import *ypfs_import_new(struct ypfs_state *state, int nthreads)
+{
+    struct ypfs_import *imp;
+
+    if (nthreads <= 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    imp = calloc(1, sizeof(*imp));
+    if (imp == NULL)
+	return NULL;
+    imp->queue = calloc(IMPORT_QUEUE, sizeof(char *));
+    imp->threads = calloc(nthreads, sizeof(pthread_t));
+    if (imp->queue == NULL || imp->threads == NULL) {
+	free(imp->queue);
+	free(imp->threads);
+	free(imp);
+	return NULL;
+    }
+    imp->state = state;
+    imp->nthreads = nthreads;
+    imp->logfd = -1;
+    pthread_mutex_init(&imp->lock, NULL);
+    pthread_cond_init(&imp->not_empty, NULL);
+    pthread_cond_init(&imp->not_full, NULL);
+
+    return imp;
+}
+
+// Wait for the threads of the last import.  Only whoever set
+// 'running' in ypfs_import_start() calls it, or ypfs_import_free().
+static void import_join(struct ypfs_import *imp)
+{
+    int i;
+
+    if (imp->walker_started) {
+	pthread_join(imp->walker, NULL);
+	imp->walker_started = 0;
+    }
+    for (i = 0; i < imp->started; i++)
+	pthread_join(imp->threads[i], NULL);
+    imp->started = 0;
+}
+
+int ypfs_import_start(struct ypfs_import *imp, const char *source)
+{
+    struct ypfs_state *state = imp->state;
+    size_t rootlen = strlen(state->rootdir);
+    struct stat st;
+    char *real;
+    int err = 0;
+    int i;
+
+    // the daemon's cwd is not the caller's
+    if (source[0] != '/')
+	return -EINVAL;
+    real = realpath(source, NULL);
+    if (real == NULL)
+	return -errno;
+    if (stat(real, &st) < 0) {
+	err = -errno;
+	free(real);
+	return err;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+	free(real);
+	return -ENOTDIR;
+    }
+    // importing the library into itself, or a tree that holds it,
+    // would never end
+    if (strncmp(real, state->rootdir, rootlen) == 0
+	&& (real[rootlen] == '/' || real[rootlen] == '\0')) {
+	free(real);
+	return -EINVAL;
+    }
+    if (strncmp(state->rootdir, real, strlen(real)) == 0
+	&& (state->rootdir[strlen(real)] == '/' || strcmp(real, "/") == 0)) {
+	free(real);
+	return -EINVAL;
+    }
+
+    // Claimed before the lock is dropped, so that a second start
+    // meanwhile gets EBUSY rather than joining the same threads
+    pthread_mutex_lock(&imp->lock);
+    if (imp->running) {
+	pthread_mutex_unlock(&imp->lock);
+	free(real);
+	return -EBUSY;
+    }
+    imp->running = 1;
+    // they have finished, or 'running' would still be set
+    pthread_mutex_unlock(&imp->lock);
+    import_join(imp);
+
+    mkdirat(state->rootfd, YPFS_CATALOG_DIR, S_IRWXU);
+    imp->logfd = openat(state->rootfd, YPFS_IMPORT_LOG,
+			O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (imp->logfd >= 0)
+	ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, YPFS_IMPORT_LOG);
+
+    pthread_mutex_lock(&imp->lock);
+    free(imp->source);
+    imp->source = real;
+    imp->dev = st.st_dev;
+    imp->walking = 1;
+    imp->stopping = 0;
+    imp->found = imp->done = imp->imported = imp->cloned = imp->linked = 0;
+    imp->skipped = imp->errors = 0;
+    imp->found_bytes = imp->bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &imp->begun);
+
+    err = pthread_create(&imp->walker, NULL, import_walker, imp);
+    if (err == 0) {
+	imp->walker_started = 1;
+	for (i = 0; i < imp->nthreads; i++) {
+	    err = pthread_create(&imp->threads[i], NULL, import_worker, imp);
+	    if (err != 0)
+		break;
+	    imp->started++;
+	}
+	imp->active = imp->started;
+    }
+
+    if (imp->started == 0) {
+	// nobody to drain the ring; let the walker give up.  Still
+	// 'running' until it has, so nobody else starts meanwhile.
+	imp->stopping = 1;
+	pthread_cond_broadcast(&imp->not_full);
+	pthread_mutex_unlock(&imp->lock);
+	import_join(imp);
+	while (imp->count > 0) {
+	    free(imp->queue[imp->head]);
+	    imp->head = (imp->head + 1) % IMPORT_QUEUE;
+	    imp->count--;
+	}
+	if (imp->logfd >= 0) {
+	    close(imp->logfd);
+	    imp->logfd = -1;
+	}
+	pthread_mutex_lock(&imp->lock);
+	imp->running = 0;
+	pthread_mutex_unlock(&imp->lock);
+	return -err;
+    }
+    pthread_mutex_unlock(&imp->lock);
+
+    return 0;
+}
+
+int ypfs_import_status(struct ypfs_import *imp, char *buf, size_t size)
+{
+    struct timespec now;
+    double secs;
+    int ret;
+
+    pthread_mutex_lock(&imp->lock);
+    if (imp->running)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+    else
+	now = imp->finished;
+    secs = import_seconds(&imp->begun, &now);
+    if (imp->source == NULL)
+	ret = snprintf(buf, size, "idle");
+    else
+	ret = snprintf(buf, size, "%s source=%s found=%zu done=%zu imported=%zu reflinked=%zu "
+		       "linked=%zu skipped=%zu errors=%zu bytes=%llu/%llu seconds=%.1f "
+		       "mb_per_sec=%.1f",
+		       imp->running ? "running" : "done", imp->source,
+		       __atomic_load_n(&imp->found, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->done, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->imported, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->cloned, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->linked, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->skipped, __ATOMIC_RELAXED),
+		       __atomic_load_n(&imp->errors, __ATOMIC_RELAXED),
+		       (unsigned long long) __atomic_load_n(&imp->bytes, __ATOMIC_RELAXED),
+		       (unsigned long long) __atomic_load_n(&imp->found_bytes, __ATOMIC_RELAXED),
+		       secs, secs > 0 ? imp->bytes / secs / 1e6 : 0.0);
+    pthread_mutex_unlock(&imp->lock);
+
+    return ret;
+}
+
+void ypfs_import_free(struct ypfs_import *imp)
+{
+    if (imp == NULL)
+	return;
+
+    pthread_mutex_lock(&imp->lock);
+    imp->stopping = 1;
+    pthread_cond_broadcast(&imp->not_empty);
+    pthread_cond_broadcast(&imp->not_full);
+    pthread_mutex_unlock(&imp->lock);
+    // import threads empty the ring without copying, then quit
+    import_join(imp);
+
+    if (imp->logfd >= 0)
+	close(imp->logfd);
+    pthread_cond_destroy(&imp->not_full);
+    pthread_cond_destroy(&imp->not_empty);
+    pthread_mutex_destroy(&imp->lock);
+    free(imp->source);
+    free(imp->threads);
+    free(imp->queue);
+    free(imp);
+}
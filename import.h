@@ -0,0 +1,49 @@
+// Bulk import
+//
+// Copying a card through the mount costs every byte a trip through
+// FUSE on the way in, and then ingest reads the start of each file
+// back.  An import is given a directory on the same host instead,
+// and a pool of threads inside ypfs copies each regular file under
+// it straight into its /Dates/Y/M/D/ directory, dated as ingest
+// would date it.  Where the backing filesystem can, the copy is a
+// reflink (FICLONE), which moves no data at all; otherwise it is a
+// copy_file_range() in the kernel.
+//
+// Setting the user.ypfs.import xattr on the mount's root to an
+// absolute directory path starts an import; getting it reports
+// progress.  Files that couldn't be imported are listed, one line
+// each with the reason, in YPFS_IMPORT_LOG under the mount.  Hidden
+// files are left out, and so is a file whose name is already taken
+// in its day directory: it counts as skipped if the sizes match, and
+// as an error otherwise.
+
+#ifndef _IMPORT_H_
+#define _IMPORT_H_
+
+#include <stddef.h>
+
+#include "catalog.h"
+
+struct ypfs_state;
+struct ypfs_import;
+
+#define YPFS_XATTR_IMPORT "user.ypfs.import"
+
+// rootdir-relative
+#define YPFS_IMPORT_LOG YPFS_CATALOG_DIR "/import.log"
+
+struct ypfs_import *ypfs_import_new(struct ypfs_state *state, int nthreads);
+
+// Stop a running import and free everything
+void ypfs_import_free(struct ypfs_import *imp);
+
+// Start importing directory 'source' in the background.  Returns 0,
+// -EBUSY if an import is already running, -EINVAL if 'source' isn't
+// an absolute path outside rootdir, or -errno.
+int ypfs_import_start(struct ypfs_import *imp, const char *source);
+
+// One line on how the current or last import went, NUL-terminated.
+// Returns its length, as snprintf() does.
+int ypfs_import_status(struct ypfs_import *imp, char *buf, size_t size);
+
+#endif
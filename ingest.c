@@ -0,0 +1,572 @@
+/*
+  Ingest queue and worker pool
+
+  Files copied into the root of the mount are moved into
+  /Dates/YYYY/MM/DD/ once they are released.  Finding the date means
+  parsing EXIF, and placing the file means creating directories and a
+  rename, none of which the process calling close() should have to
+  wait for.  ypfs_release queues the path here instead, and
+  'nthreads' ingest threads sort the files in the background.
+
+  The queue is a fixed-size ring.  When it is full, enqueue blocks
+  until a worker takes something off, which throttles a bulk copy to
+  the rate the ingest threads can keep up with.
+
+  ypfs_ingest_file() runs on ingest threads, FUSE threads and scan
+  threads at once.  Placing a file never replaces one: the rename is
+  RENAME_NOREPLACE, and a name that is taken, say by another camera's
+  IMG_0001.JPG from the same day, becomes IMG_0001-1.JPG and so on.
+  Looking for a duplicate, placing the file and indexing it are done
+  under a lock for the day directory, hashed onto one of
+  INGEST_STRIPES, so that two copies of one photo arriving together
+  still end up collapsed, while different days go on in parallel.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "attrcache.h"
+#include "catalog.h"
+#include "dedup.h"
+#include "dircache.h"
+#include "exifdate.h"
+#include "ingest.h"
+#include "inode.h"
+#include "stats.h"
+#include "thumbcache.h"
+#include "uring.h"
+
+#define INGEST_STRIPES 64
+#define INGEST_SUFFIXES 1000		// name-1.ext up to name-999.ext
+
+int __mkdir(struct ypfs_state *, const char *);
+const char *ypfs_relpath(const char *);
+void ypfs_notify(struct ypfs_state *, const char *, const struct stat *);
+
+static pthread_mutex_t ingest_stripes[INGEST_STRIPES] = {
+    [0 ... INGEST_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+struct ingest_job {
+    char *path;			// strdup()ed, fs-relative
+    int fd;			// owned by the job, or -1
+    struct ypfs_exif_sniff sniff;	// result and date only
+    struct ypfs_hash hash;		// from the writes, if any
+};
+
+struct ypfs_ingest {
+    struct ypfs_state *state;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // ring of released files
+    struct ingest_job *queue;
+    int depth;
+    int head;
+    int count;
+    int stopping;
+
+    int nthreads;
+    pthread_t *threads;
+};
+
+void ypfs_ingest_catalog(struct ypfs_state *state, const char *path, const struct tm *ts,
+			 const char *model, int from_exif, const struct ypfs_hash *hash)
+{
+    struct tm capture = *ts;
+    struct ypfs_catalog_record rec;
+    struct stat statbuf;
+
+    if (strlen(path) >= sizeof(rec.path))
+	return;
+    if (fstatat(state->rootfd, ypfs_relpath(path), &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+	return;
+
+    memset(&rec, 0, sizeof(rec));
+    strcpy(rec.path, path);
+    snprintf(rec.model, sizeof(rec.model), "%s", model);
+    rec.size = statbuf.st_size;
+    rec.mtime = statbuf.st_mtime;
+    // EXIF times have no zone; keep the wall clock reading
+    rec.capture = timegm(&capture);
+    if (from_exif)
+	rec.flags |= YPFS_CATALOG_EXIF_DATE;
+    if (hash != NULL && hash->len == statbuf.st_size) {
+	memcpy(rec.hash, hash->sum, sizeof(rec.hash));
+	rec.flags |= YPFS_CATALOG_HASHED;
+    }
+
+    ypfs_catalog_add(state->catalog, &rec);
+}
+
+int ypfs_ingest_date(int fd, struct tm *ts, char *model)
+{
+    struct stat filestat;
+
+    if (ypfs_exif_date_fd(fd, ts, model) == 0)
+	return 1;
+    if (fstat(fd, &filestat) < 0)
+	return -errno;
+    localtime_r(&filestat.st_mtime, ts);
+
+    return 0;
+}
+
+// Content hash of the inbox file 'rpath' into 'sum': the one taken
+// from the writes if it covers the whole file, else read it back.
+// '*fd' is as for ypfs_ingest_file, and may be swapped for a readable
+// one.  sum->len is left at -1 if the file can't be hashed.
+static void ingest_hash(struct ypfs_state *state, const char *rpath, int *fd,
+			const struct ypfs_hash *hash, struct ypfs_hash *sum)
+{
+    struct stat filestat;
+
+    sum->len = -1;
+    if ((*fd >= 0 ? fstat(*fd, &filestat) : fstatat(state->rootfd, rpath, &filestat, 0)) < 0)
+	return;
+    if (hash != NULL && hash->len == filestat.st_size) {
+	*sum = *hash;
+	return;
+    }
+
+    // written out of order, or not through the mount
+    if (*fd >= 0 && (fcntl(*fd, F_GETFL) & O_ACCMODE) == O_WRONLY) {
+	close(*fd);
+	*fd = -1;
+    }
+    if (*fd < 0)
+	*fd = openat(state->rootfd, rpath, O_RDONLY);
+    if (*fd >= 0 && ypfs_hash_fd(*fd, sum) < 0)
+	sum->len = -1;
+}
+
+// The lock for sorting into day directory 'datepath'
+static pthread_mutex_t *ingest_stripe(const char *datepath)
+{
+    unsigned h = 5381;
+
+    for (; *datepath != '\0'; datepath++)
+	h = h * 33 + (unsigned char) *datepath;
+    return &ingest_stripes[h % INGEST_STRIPES];
+}
+
+// The 'n'th name to try for 'path' into 'buf': 'path' itself, then
+// with -n before the extension
+static int ingest_name(char *buf, size_t size, const char *path, int n)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(slash, '.');
+
+    if (n == 0)
+	return snprintf(buf, size, "%s", path) >= size ? -ENAMETOOLONG : 0;
+    // .xmp has no extension to keep
+    if (dot == NULL || dot == slash + 1)
+	dot = path + strlen(path);
+    if (snprintf(buf, size, "%.*s-%d%s", (int) (dot - path), path, n, dot) >= size)
+	return -ENAMETOOLONG;
+    return 0;
+}
+
+// Whether 'other' is 'path' or one of the names ingest_name() would
+// try for it
+static int ingest_same_name(const char *other, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(slash, '.');
+    size_t stem, ext;
+    const char *p;
+
+    if (dot == NULL || dot == slash + 1)
+	dot = path + strlen(path);
+    stem = dot - path;
+    ext = strlen(dot);
+    if (strncmp(other, path, stem) != 0)
+	return 0;
+    p = other + stem;
+    if (*p == '-' && p[1] >= '1' && p[1] <= '9')
+	for (p++; *p >= '0' && *p <= '9'; p++)
+	    ;
+    return strlen(p) == ext && strcmp(p, dot) == 0;
+}
+
+// rename() that fails with EEXIST rather than replace 'to'
+static int ingest_rename(struct ypfs_state *state, const char *from, const char *to)
+{
+    int retstat;
+
+    retstat = ypfs_uring_renameat2(state->uring, state->rootfd, from, state->rootfd, to,
+				   RENAME_NOREPLACE);
+    if (retstat == 0)
+	return 0;
+    errno = -retstat;
+    if (errno != EINVAL)
+	return -1;
+
+    // not supported here; a link is just as particular
+    if (linkat(state->rootfd, from, state->rootfd, to, 0) < 0)
+	return -1;
+    unlinkat(state->rootfd, from, 0);
+    return 0;
+}
+
+// Move inbox file 'rpath' to 'newpath', or if 'dup' is given, put a
+// hard link to it there instead, without replacing anything: if the
+// name is taken, the first free one of name-1.ext, name-2.ext and so
+// on is used, and written back to 'newpath', which holds PATH_MAX.
+// Returns 0 or -errno.
+static int ingest_place(struct ypfs_state *state, const char *rpath, const char *dup,
+			char *newpath)
+{
+    char want[PATH_MAX];
+    int retstat;
+    int n;
+
+    for (n = 0; n < INGEST_SUFFIXES; n++) {
+	retstat = ingest_name(want, sizeof(want), newpath, n);
+	if (retstat < 0)
+	    return retstat;
+	if (dup != NULL)
+	    retstat = linkat(state->rootfd, ypfs_relpath(dup), state->rootfd,
+			     ypfs_relpath(want), 0);
+	else
+	    retstat = ingest_rename(state, rpath, ypfs_relpath(want));
+	if (retstat == 0) {
+	    strcpy(newpath, want);
+	    return 0;
+	}
+	if (errno != EEXIST)
+	    return -errno;
+    }
+    return -EEXIST;
+}
+
+// 'rpath' in the inbox holds the same data as 'dup' under /Dates.
+// Where the filesystem can, give it dup's blocks with a reflink and
+// let it be placed at 'newpath' as usual.  Otherwise put a hard link
+// to dup at 'newpath', or the name ingest_place() finds instead, and
+// drop the inbox copy.  Returns 1 if the inbox file is gone, or 0 if
+// it is still to be placed, which is also what happens if it can't
+// be collapsed.  Called with the stripe for newpath's directory held.
+static int ingest_collapse(struct ypfs_state *state, const char *rpath, char *newpath,
+			   const char *dup)
+{
+    struct timespec times[2];
+    struct stat filestat;
+    int cloned = 0;
+    int in, out;
+
+    // the same photo again, for where it already is
+    if (ingest_same_name(dup, newpath)) {
+	strcpy(newpath, dup);
+	return unlinkat(state->rootfd, rpath, 0) == 0;
+    }
+
+    out = openat(state->rootfd, rpath, O_WRONLY);
+    in = openat(state->rootfd, ypfs_relpath(dup), O_RDONLY);
+    if (out >= 0 && in >= 0 && fstat(out, &filestat) == 0 && ioctl(out, FICLONE, in) == 0) {
+	// the clone counts as a write; keep the photo's own times
+	times[0] = filestat.st_atim;
+	times[1] = filestat.st_mtim;
+	futimens(out, times);
+	cloned = 1;
+    }
+    if (out >= 0)
+	close(out);
+    if (in >= 0)
+	close(in);
+    if (cloned)
+	return 0;
+
+    if (ingest_place(state, rpath, dup, newpath) < 0)
+	return 0;
+    unlinkat(state->rootfd, rpath, 0);
+
+    return 1;
+}
+
+int ypfs_ingest_file(struct ypfs_state *state, const char *path, int fd,
+		     const struct ypfs_exif_sniff *sniff, const struct ypfs_hash *hash)
+{
+    // If the exif exists, use the exif date to place the file.
+    // Otherwise, use old file modified date (since create date does
+    // not exist in linux)
+    const char *rpath = ypfs_relpath(path);
+    char datepath[PATH_MAX];
+    char newpath[PATH_MAX];
+    char dup[PATH_MAX];
+    struct ypfs_hash sum;
+    struct stat filestat;
+    struct stat gone;
+    struct tm ts;
+    char model[YPFS_EXIF_MODEL_MAX] = "";
+    int retstat = -ENOENT;
+    pthread_mutex_t *stripe;
+    int collapsed = 0;
+    int from_exif;
+    uint64_t start = ypfs_stats_start(state);
+    uint64_t t;
+
+    // Whatever was sniffed from the writes saves reading the file
+    if (sniff != NULL && sniff->result == YPFS_SNIFF_FOUND) {
+	ts = sniff->date;
+	memcpy(model, sniff->model, sizeof(model));
+	retstat = 0;
+    } else if (sniff == NULL || sniff->result != YPFS_SNIFF_NONE) {
+	// The handle release gave us may have been opened write-only
+	if (fd >= 0 && (fcntl(fd, F_GETFL) & O_ACCMODE) == O_WRONLY) {
+	    close(fd);
+	    fd = -1;
+	}
+	if (fd < 0) {
+	    fd = ypfs_uring_openat(state->uring, state->rootfd, rpath, O_RDONLY, 0);
+	    if (fd < 0)
+		return fd;
+	}
+	t = ypfs_stats_start(state);
+	retstat = ypfs_exif_date_fd(fd, &ts, model);
+	ypfs_stats_stage(state, YPFS_STAGE_EXIF, t, retstat == -ENOENT ? 0 : retstat, 0, path);
+    }
+    from_exif = retstat == 0;
+
+    if (retstat < 0) {
+	// fallback to file modified time
+	if (fd >= 0)
+	    retstat = ypfs_uring_fstatat(state->uring, fd, "", &filestat, AT_EMPTY_PATH);
+	else
+	    retstat = ypfs_uring_fstatat(state->uring, state->rootfd, rpath, &filestat, 0);
+	if (retstat < 0) {
+	    if (fd >= 0)
+		close(fd);
+	    return retstat;
+	}
+	localtime_r(&filestat.st_mtime, &ts);
+    }
+
+    sum.len = -1;
+    if (state->dedup != NULL) {
+	t = ypfs_stats_start(state);
+	ingest_hash(state, rpath, &fd, hash, &sum);
+	ypfs_stats_stage(state, YPFS_STAGE_HASH, t, 0, sum.len > 0 ? sum.len : 0, path);
+    }
+    if (fd >= 0)
+	close(fd);
+
+    strftime(datepath, sizeof(datepath), "/Dates/%Y/%m/%d", &ts);
+    if (snprintf(newpath, sizeof(newpath), "%s%s", datepath, path) >= sizeof(newpath))
+	return -ENAMETOOLONG;
+
+    stripe = ingest_stripe(datepath);
+    pthread_mutex_lock(stripe);
+    t = ypfs_stats_start(state);
+    retstat = __mkdir(state, datepath);
+    ypfs_stats_stage(state, YPFS_STAGE_MKDIR, t, retstat, 0, path);
+    t = ypfs_stats_start(state);
+    if (retstat == 0 && sum.len >= YPFS_DEDUP_MIN
+	&& ypfs_dedup_find(state->dedup, &sum, dup, sizeof(dup))) {
+	// what the kernel has to be told is gone, if it goes
+	if (fstatat(state->rootfd, rpath, &gone, AT_SYMLINK_NOFOLLOW) < 0)
+	    memset(&gone, 0, sizeof(gone));
+	collapsed = ingest_collapse(state, rpath, newpath, dup);
+    }
+    if (retstat == 0 && !collapsed) {
+	retstat = ingest_place(state, rpath, NULL, newpath);
+	if (retstat == -ENOENT) {
+	    // someone removed the day directory behind our back; don't
+	    // trust the cache for it any longer
+	    ypfs_dircache_remove(state->dirs, datepath, strlen(datepath));
+	    retstat = __mkdir(state, datepath);
+	    if (retstat == 0)
+		retstat = ingest_place(state, rpath, NULL, newpath);
+	}
+    }
+    // indexed before anyone else looks for it
+    if (retstat == 0 && sum.len >= YPFS_DEDUP_MIN && !collapsed)
+	ypfs_dedup_add(state->dedup, &sum, newpath);
+    pthread_mutex_unlock(stripe);
+    ypfs_stats_stage(state, YPFS_STAGE_RENAME, t, retstat, 0, path);
+    if (retstat < 0) {
+	ypfs_stats_stage(state, YPFS_STAGE_INGEST, start, retstat, 0, path);
+	return retstat;
+    }
+
+    // Handles still open on the file name it where it is now, so that
+    // their release doesn't take whatever comes next by its old name
+    // for it
+    if (!collapsed)
+	ypfs_inode_moved_at(state->inodes, newpath);
+
+    // Both directories changed, and the file's ctime with them.  The
+    // kernel's caches, too: the inbox name is gone, and the day has
+    // one more, unless the photo was there already.
+    ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, ypfs_relpath(newpath));
+    ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, ypfs_relpath(datepath));
+    ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, ".");
+    ypfs_notify(state, path, collapsed ? &gone : NULL);
+    if (!(collapsed && strcmp(dup, newpath) == 0))
+	ypfs_notify(state, newpath, NULL);
+
+    // it was just read for the date, so its thumbnail comes cheap now
+    if (from_exif)
+	ypfs_thumbcache_prime(state->thumbs, state->rootfd, ypfs_relpath(newpath));
+    // a photo that was there already has its record
+    if (state->catalog != NULL && !(collapsed && strcmp(dup, newpath) == 0)) {
+	t = ypfs_stats_start(state);
+	ypfs_ingest_catalog(state, newpath, &ts, model, from_exif, &sum);
+	ypfs_stats_stage(state, YPFS_STAGE_CATALOG, t, 0, 0, path);
+    }
+
+    ypfs_stats_stage(state, YPFS_STAGE_INGEST, start, 0, 0, path);
+    return 0;
+}
+
+static void *ingest_worker(void *arg)
+{
+    struct ypfs_ingest *ingest = arg;
+    struct ingest_job job;
+
+    pthread_mutex_lock(&ingest->lock);
+    for (;;) {
+	while (ingest->count == 0 && !ingest->stopping)
+	    pthread_cond_wait(&ingest->not_empty, &ingest->lock);
+	// only quit once the queue is empty, so nothing released
+	// before unmount is left unsorted
+	if (ingest->count == 0)
+	    break;
+
+	job = ingest->queue[ingest->head];
+	ingest->head = (ingest->head + 1) % ingest->depth;
+	ingest->count--;
+	pthread_cond_signal(&ingest->not_full);
+	pthread_mutex_unlock(&ingest->lock);
+
+	ypfs_ingest_file(ingest->state, job.path, job.fd, &job.sniff, &job.hash);
+	free(job.path);
+
+	pthread_mutex_lock(&ingest->lock);
+    }
+    pthread_mutex_unlock(&ingest->lock);
+
+    return NULL;
+}
+
+struct ypfs_ingest *ypfs_ingest_start(struct ypfs_state *state, int nthreads, int depth)
+{
+    struct ypfs_ingest *ingest;
+    int i;
+    int err;
+
+    if (nthreads <= 0 || depth <= 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    ingest = calloc(1, sizeof(*ingest));
+    if (ingest == NULL)
+	return NULL;
+    ingest->queue = calloc(depth, sizeof(struct ingest_job));
+    ingest->threads = calloc(nthreads, sizeof(pthread_t));
+    if (ingest->queue == NULL || ingest->threads == NULL) {
+	free(ingest->queue);
+	free(ingest->threads);
+	free(ingest);
+	return NULL;
+    }
+
+    ingest->state = state;
+    ingest->depth = depth;
+    pthread_mutex_init(&ingest->lock, NULL);
+    pthread_cond_init(&ingest->not_empty, NULL);
+    pthread_cond_init(&ingest->not_full, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+	err = pthread_create(&ingest->threads[i], NULL, ingest_worker, ingest);
+	if (err != 0)
+	    break;
+	ingest->nthreads++;
+    }
+    if (ingest->nthreads == 0) {
+	ypfs_ingest_stop(ingest);
+	errno = err;
+	return NULL;
+    }
+
+    return ingest;
+}
+
+int ypfs_ingest_enqueue(struct ypfs_ingest *ingest, const char *path, int fd,
+			const struct ypfs_exif_sniff *sniff, const struct ypfs_hash *hash)
+{
+    struct ingest_job *job;
+    char *copy;
+
+    copy = strdup(path);
+    if (copy == NULL)
+	return -ENOMEM;
+
+    pthread_mutex_lock(&ingest->lock);
+    while (ingest->count == ingest->depth && !ingest->stopping)
+	pthread_cond_wait(&ingest->not_full, &ingest->lock);
+    if (ingest->stopping) {
+	pthread_mutex_unlock(&ingest->lock);
+	free(copy);
+	return -ESHUTDOWN;
+    }
+
+    job = &ingest->queue[(ingest->head + ingest->count) % ingest->depth];
+    job->path = copy;
+    job->fd = fd;
+    ypfs_exif_sniff_init(&job->sniff);
+    if (sniff != NULL) {
+	job->sniff.result = sniff->result;
+	job->sniff.date = sniff->date;
+	memcpy(job->sniff.model, sniff->model, sizeof(job->sniff.model));
+    }
+    if (hash != NULL)
+	job->hash = *hash;
+    else
+	job->hash.len = -1;
+    ingest->count++;
+    pthread_cond_signal(&ingest->not_empty);
+    pthread_mutex_unlock(&ingest->lock);
+
+    return 0;
+}
+
+void ypfs_ingest_stop(struct ypfs_ingest *ingest)
+{
+    int i;
+
+    if (ingest == NULL)
+	return;
+
+    pthread_mutex_lock(&ingest->lock);
+    ingest->stopping = 1;
+    pthread_cond_broadcast(&ingest->not_empty);
+    pthread_cond_broadcast(&ingest->not_full);
+    pthread_mutex_unlock(&ingest->lock);
+
+    for (i = 0; i < ingest->nthreads; i++)
+	pthread_join(ingest->threads[i], NULL);
+
+    pthread_cond_destroy(&ingest->not_full);
+    pthread_cond_destroy(&ingest->not_empty);
+    pthread_mutex_destroy(&ingest->lock);
+    free(ingest->threads);
+    free(ingest->queue);
+    free(ingest);
+}
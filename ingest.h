@@ -0,0 +1,55 @@
+// Background sorting of newly written files into /Dates/Y/M/D/
+//
+// ypfs_release used to do the whole EXIF parse, directory creation
+// and rename on the FUSE thread, so close() took as long as the sort.
+// Now release just hands the path to a bounded queue, and a pool of
+// ingest threads does the work.
+
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+#include <time.h>
+
+struct ypfs_state;
+struct ypfs_ingest;
+struct ypfs_exif_sniff;
+struct ypfs_hash;
+
+// Start 'nthreads' ingest threads draining a queue of at most 'depth'
+// paths.  Returns NULL (with errno set) if the pool can't be started.
+struct ypfs_ingest *ypfs_ingest_start(struct ypfs_state *state, int nthreads, int depth);
+
+// Queue a filesystem-relative path for sorting.  'fd' is an open
+// descriptor for the file (or -1), which the queue takes over and
+// closes once the file is sorted; on failure it is left to the
+// caller.  'sniff', if not NULL, is what was learned about the date
+// while the file was written; only its result and date are kept.
+// 'hash', if not NULL, is the content hash taken from the writes (see
+// dedup.h); it is only used if it covers the whole file.  Blocks
+// while the queue is full, so a fast writer can't run arbitrarily far
+// ahead of the ingest threads.  Returns 0 or -errno.
+int ypfs_ingest_enqueue(struct ypfs_ingest *ingest, const char *path, int fd,
+			const struct ypfs_exif_sniff *sniff, const struct ypfs_hash *hash);
+
+// Let the threads drain whatever is still queued, then stop them.
+void ypfs_ingest_stop(struct ypfs_ingest *ingest);
+
+// Sort one file right now, on the calling thread.  Closes 'fd'.  The
+// file is only read if 'sniff' doesn't settle the date; then, if 'fd'
+// is -1 or write-only, it is opened again by path; the same goes for
+// hashing it, if 'hash' doesn't do and duplicates are being collapsed.
+int ypfs_ingest_file(struct ypfs_state *state, const char *path, int fd,
+		     const struct ypfs_exif_sniff *sniff, const struct ypfs_hash *hash);
+
+// The date a file is sorted by: its EXIF capture date if it has one,
+// else its mtime as local time.  Returns 1 if the date is from EXIF,
+// 0 if from the mtime, or -errno.  'model' is as for
+// ypfs_exif_date_fd().
+int ypfs_ingest_date(int fd, struct tm *ts, char *model);
+
+// Note a file just sorted to fs-relative 'path' in state->catalog,
+// which must not be NULL.  'hash' may be NULL.
+void ypfs_ingest_catalog(struct ypfs_state *state, const char *path, const struct tm *ts,
+			 const char *model, int from_exif, const struct ypfs_hash *hash);
+
+#endif
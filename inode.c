@@ -0,0 +1,485 @@
+/*
+  Inode table
+
+  Maps backing (st_ino, st_dev) pairs to struct ypfs_inode, so that
+  every name the kernel looks up for the same file, hard links
+  included, gets the same fuse_ino_t.  One mutex covers the hash,
+  the reference counts and the parent/name fields; it is only held
+  for pointer work, never across a syscall other than close().
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "inode.h"
+
+#define INODES_INITIAL_BUCKETS 1024
+
+struct ypfs_inodes {
+    pthread_mutex_t lock;
+    struct ypfs_inode **buckets;
+    size_t nbuckets;
+    size_t count;
+    struct ypfs_inode root;
+};
+
+static size_t inode_hash(ino_t ino, dev_t dev, enum ypfs_inode_kind kind)
+{
+    uint64_t h = ((uint64_t) ino + kind) * 0x9E3779B97F4A7C15ULL ^ (uint64_t) dev;
+    return (size_t) (h ^ (h >> 29));
+}
+
+struct ypfs_inodes *ypfs_inodes_new(int rootfd)
+{
+    struct ypfs_inodes *inodes;
+    struct stat statbuf;
+
+    if (fstat(rootfd, &statbuf) < 0)
+	return NULL;
+
+    inodes = calloc(1, sizeof(*inodes));
+    if (inodes == NULL)
+	return NULL;
+    inodes->nbuckets = INODES_INITIAL_BUCKETS;
+    inodes->buckets = calloc(inodes->nbuckets, sizeof(struct ypfs_inode *));
+    if (inodes->buckets == NULL) {
+	free(inodes);
+	return NULL;
+    }
+    pthread_mutex_init(&inodes->lock, NULL);
+
+    // The root is never forgotten, and isn't in the hash: a lookup
+    // can't return it, since nothing inside the mount is its parent.
+    inodes->root.fd = rootfd;
+    inodes->root.ino = statbuf.st_ino;
+    inodes->root.dev = statbuf.st_dev;
+    inodes->root.nlookup = 1;
+    inodes->root.refs = 1;
+
+    return inodes;
+}
+
+void ypfs_inodes_free(struct ypfs_inodes *inodes)
+{
+    struct ypfs_inode *inode, *next;
+    size_t b;
+
+    if (inodes == NULL)
+	return;
+
+    for (b = 0; b < inodes->nbuckets; b++)
+	for (inode = inodes->buckets[b]; inode != NULL; inode = next) {
+	    next = inode->next;
+	    close(inode->fd);
+	    free(inode->name);
+	    free(inode);
+	}
+    free(inodes->buckets);
+    pthread_mutex_destroy(&inodes->lock);
+    free(inodes);
+}
+
+struct ypfs_inode *ypfs_inode_get(struct ypfs_inodes *inodes, fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID)
+	return &inodes->root;
+    return (struct ypfs_inode *) (uintptr_t) ino;
+}
+
+static fuse_ino_t inode_id(struct ypfs_inodes *inodes, struct ypfs_inode *inode)
+{
+    if (inode == &inodes->root)
+	return FUSE_ROOT_ID;
+    return (uintptr_t) inode;
+}
+
+// call with inodes->lock held
+static struct ypfs_inode **inode_find(struct ypfs_inodes *inodes, ino_t ino, dev_t dev,
+				      enum ypfs_inode_kind kind)
+{
+    struct ypfs_inode **ip;
+
+    for (ip = &inodes->buckets[inode_hash(ino, dev, kind) % inodes->nbuckets]; *ip != NULL;
+	 ip = &(*ip)->next)
+	if ((*ip)->ino == ino && (*ip)->dev == dev && (*ip)->kind == kind)
+	    break;
+    return ip;
+}
+
+// call with inodes->lock held
+static void inode_grow(struct ypfs_inodes *inodes)
+{
+    struct ypfs_inode **buckets;
+    struct ypfs_inode *inode, *next;
+    size_t nbuckets = inodes->nbuckets * 2;
+    size_t b, h;
+
+    buckets = calloc(nbuckets, sizeof(struct ypfs_inode *));
+    if (buckets == NULL)
+	return;
+    for (b = 0; b < inodes->nbuckets; b++)
+	for (inode = inodes->buckets[b]; inode != NULL; inode = next) {
+	    next = inode->next;
+	    h = inode_hash(inode->ino, inode->dev, inode->kind) % nbuckets;
+	    inode->next = buckets[h];
+	    buckets[h] = inode;
+	}
+    free(inodes->buckets);
+    inodes->buckets = buckets;
+    inodes->nbuckets = nbuckets;
+}
+
+// Drop 'n' references from 'inode', and the one each freed inode
+// held on its parent.  Call with inodes->lock held.  Returns a list
+// (through ->next) of freed inodes whose fds the caller must close
+// once the lock is dropped.
+static struct ypfs_inode *inode_unref(struct ypfs_inodes *inodes, struct ypfs_inode *inode,
+				      uint64_t n)
+{
+    struct ypfs_inode *dead = NULL;
+    struct ypfs_inode *parent;
+    struct ypfs_inode **ip;
+
+    while (inode != NULL && inode != &inodes->root) {
+	inode->refs -= n;
+	if (inode->refs > 0)
+	    break;
+
+	ip = inode_find(inodes, inode->ino, inode->dev, inode->kind);
+	if (*ip == inode)
+	    *ip = inode->next;
+	inodes->count--;
+
+	parent = inode->parent;
+	inode->next = dead;
+	dead = inode;
+	inode = parent;
+	n = 1;
+    }
+
+    return dead;
+}
+
+static void inode_free_list(struct ypfs_inode *dead)
+{
+    struct ypfs_inode *next;
+
+    for (; dead != NULL; dead = next) {
+	next = dead->next;
+	close(dead->fd);
+	free(dead->name);
+	free(dead);
+    }
+}
+
+// The sorted archive is /Dates and everything under it
+static int inode_archive(struct ypfs_inodes *inodes, struct ypfs_inode *parent, const char *name)
+{
+    return parent->archive || (parent == &inodes->root && strcmp(name, "Dates") == 0);
+}
+
+// Point 'inode' at 'parent'/'name'.  Call with inodes->lock held;
+// returns what inode_unref() did to the old parent.
+static struct ypfs_inode *inode_relink(struct ypfs_inodes *inodes, struct ypfs_inode *inode,
+				       struct ypfs_inode *parent, char *name)
+{
+    struct ypfs_inode *old = inode->parent;
+
+    free(inode->name);
+    inode->name = name;
+    inode->archive = inode_archive(inodes, parent, name);
+    if (old == parent)
+	return NULL;
+
+    parent->refs++;
+    inode->parent = parent;
+    return inode_unref(inodes, old, 1);
+}
+
+// Take a lookup reference on the inode of 'kind' for 'fd', which is
+// 'name' in 'dir' and has attributes e->attr, making one if there
+// isn't one.  The fd is kept by a new inode and closed otherwise.
+static int inode_insert(struct ypfs_inodes *inodes, struct ypfs_inode *dir, const char *name,
+			int fd, enum ypfs_inode_kind kind, struct fuse_entry_param *e)
+{
+    struct ypfs_inode *inode;
+    struct ypfs_inode **ip;
+    struct ypfs_inode *dead = NULL;
+    char *namecopy;
+
+    namecopy = strdup(name);
+    if (namecopy == NULL) {
+	close(fd);
+	return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&inodes->lock);
+    ip = inode_find(inodes, e->attr.st_ino, e->attr.st_dev, kind);
+    inode = *ip;
+    if (inode != NULL) {
+	// known already; keep the fd we have
+	inode->nlookup++;
+	inode->refs++;
+	dead = inode_relink(inodes, inode, dir, namecopy);
+	pthread_mutex_unlock(&inodes->lock);
+	close(fd);
+    } else {
+	inode = calloc(1, sizeof(*inode));
+	if (inode == NULL) {
+	    pthread_mutex_unlock(&inodes->lock);
+	    free(namecopy);
+	    close(fd);
+	    return -ENOMEM;
+	}
+	inode->fd = fd;
+	inode->ino = e->attr.st_ino;
+	inode->dev = e->attr.st_dev;
+	inode->kind = kind;
+	inode->nlookup = 1;
+	inode->refs = 1;
+	inode->parent = dir;
+	inode->name = namecopy;
+	inode->archive = inode_archive(inodes, dir, namecopy);
+	dir->refs++;
+	*ip = inode;
+	if (++inodes->count > inodes->nbuckets)
+	    inode_grow(inodes);
+	pthread_mutex_unlock(&inodes->lock);
+    }
+    inode_free_list(dead);
+
+    e->ino = inode_id(inodes, inode);
+    return 0;
+}
+
+int ypfs_inode_lookup(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+		      struct fuse_entry_param *e)
+{
+    struct ypfs_inode *dir = ypfs_inode_get(inodes, parent);
+    int fd;
+
+    memset(e, 0, sizeof(*e));
+
+    fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
+    if (fd < 0)
+	return -errno;
+    if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+	int err = -errno;
+
+	close(fd);
+	return err;
+    }
+
+    return inode_insert(inodes, dir, name, fd, YPFS_INODE_BACKING, e);
+}
+
+int ypfs_inode_lookup_stat(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+			   const struct stat *st, struct fuse_entry_param *e)
+{
+    struct ypfs_inode *dir = ypfs_inode_get(inodes, parent);
+    struct ypfs_inode *inode;
+    struct ypfs_inode *dead = NULL;
+    char *namecopy;
+
+    memset(e, 0, sizeof(*e));
+    e->attr = *st;
+
+    namecopy = strdup(name);
+    if (namecopy == NULL)
+	return -ENOMEM;
+
+    // Usually the inode is known, and there is nothing to open
+    pthread_mutex_lock(&inodes->lock);
+    inode = *inode_find(inodes, st->st_ino, st->st_dev, YPFS_INODE_BACKING);
+    if (inode != NULL) {
+	inode->nlookup++;
+	inode->refs++;
+	dead = inode_relink(inodes, inode, dir, namecopy);
+	pthread_mutex_unlock(&inodes->lock);
+	inode_free_list(dead);
+	e->ino = inode_id(inodes, inode);
+	return 0;
+    }
+    pthread_mutex_unlock(&inodes->lock);
+    free(namecopy);
+
+    // The name may have been replaced since 'st' was taken; the stat
+    // of what we open is the one that counts
+    return ypfs_inode_lookup(inodes, parent, name, e);
+}
+
+int ypfs_inode_lookup_virtual(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+			      enum ypfs_inode_kind kind, struct fuse_entry_param *e)
+{
+    struct ypfs_inode *dir = ypfs_inode_get(inodes, parent);
+    int fd;
+
+    memset(e, 0, sizeof(*e));
+
+    fd = openat(dir->fd, kind == YPFS_INODE_THUMB ? name : ".", O_PATH | O_NOFOLLOW);
+    if (fd < 0)
+	return -errno;
+    if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+	int err = -errno;
+
+	close(fd);
+	return err;
+    }
+
+    return inode_insert(inodes, dir, name, fd, kind, e);
+}
+
+void ypfs_inode_forget(struct ypfs_inodes *inodes, fuse_ino_t ino, uint64_t nlookup)
+{
+    struct ypfs_inode *inode = ypfs_inode_get(inodes, ino);
+    struct ypfs_inode *dead;
+
+    pthread_mutex_lock(&inodes->lock);
+    if (nlookup > inode->nlookup)
+	nlookup = inode->nlookup;
+    inode->nlookup -= nlookup;
+    dead = inode_unref(inodes, inode, nlookup);
+    pthread_mutex_unlock(&inodes->lock);
+
+    inode_free_list(dead);
+}
+
+int ypfs_inode_is_open(struct ypfs_inodes *inodes, dev_t dev, ino_t ino)
+{
+    struct ypfs_inode *inode;
+    int open;
+
+    pthread_mutex_lock(&inodes->lock);
+    inode = *inode_find(inodes, ino, dev, YPFS_INODE_BACKING);
+    open = inode != NULL && __atomic_load_n(&inode->opens, __ATOMIC_RELAXED) > 0;
+    pthread_mutex_unlock(&inodes->lock);
+
+    return open;
+}
+
+fuse_ino_t ypfs_inode_id(struct ypfs_inodes *inodes, dev_t dev, ino_t ino)
+{
+    struct ypfs_inode *inode;
+    fuse_ino_t id = 0;
+
+    if (ino == inodes->root.ino && dev == inodes->root.dev)
+	return FUSE_ROOT_ID;
+
+    pthread_mutex_lock(&inodes->lock);
+    inode = *inode_find(inodes, ino, dev, YPFS_INODE_BACKING);
+    if (inode != NULL && inode->nlookup > 0)
+	id = inode_id(inodes, inode);
+    pthread_mutex_unlock(&inodes->lock);
+
+    return id;
+}
+
+// Point whatever inode we have for the file 'st' at 'dir'/'newname',
+// 'dir' being found under the lock by 'find' unless given
+static void inode_moved(struct ypfs_inodes *inodes, struct ypfs_inode *dir, dev_t dirdev,
+			ino_t dirino, const struct stat *st, const char *newname)
+{
+    struct ypfs_inode *inode;
+    struct ypfs_inode *dead = NULL;
+    char *namecopy;
+
+    namecopy = strdup(newname);
+    if (namecopy == NULL)
+	return;
+
+    pthread_mutex_lock(&inodes->lock);
+    if (dir == NULL && dirino == inodes->root.ino && dirdev == inodes->root.dev)
+	dir = &inodes->root;
+    else if (dir == NULL)
+	dir = *inode_find(inodes, dirino, dirdev, YPFS_INODE_BACKING);
+    inode = *inode_find(inodes, st->st_ino, st->st_dev, YPFS_INODE_BACKING);
+    if (dir != NULL && inode != NULL) {
+	dead = inode_relink(inodes, inode, dir, namecopy);
+	namecopy = NULL;
+    }
+    pthread_mutex_unlock(&inodes->lock);
+
+    free(namecopy);
+    inode_free_list(dead);
+}
+
+void ypfs_inode_moved(struct ypfs_inodes *inodes, fuse_ino_t newparent, const char *newname)
+{
+    struct ypfs_inode *dir = ypfs_inode_get(inodes, newparent);
+    struct stat statbuf;
+
+    if (fstatat(dir->fd, newname, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+	return;
+    inode_moved(inodes, dir, 0, 0, &statbuf, newname);
+}
+
+void ypfs_inode_moved_at(struct ypfs_inodes *inodes, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    struct stat dirstat;
+    struct stat statbuf;
+    char dir[PATH_MAX];
+
+    // the same paths relative to the root's fd
+    if (path[0] != '/' || slash - path >= sizeof(dir))
+	return;
+    if (slash == path)
+	strcpy(dir, ".");
+    else {
+	memcpy(dir, path + 1, slash - path - 1);
+	dir[slash - path - 1] = '\0';
+    }
+    if (fstatat(inodes->root.fd, dir, &dirstat, 0) < 0
+	|| fstatat(inodes->root.fd, path + 1, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+	return;
+    inode_moved(inodes, NULL, dirstat.st_dev, dirstat.st_ino, &statbuf, slash + 1);
+}
+
+int ypfs_inode_path(struct ypfs_inodes *inodes, fuse_ino_t ino, const char *name,
+		    char *buf, size_t size)
+{
+    struct ypfs_inode *inode = ypfs_inode_get(inodes, ino);
+    size_t pos = size;
+    size_t len;
+
+    // built backwards from the end of buf
+    if (size == 0)
+	return -ENAMETOOLONG;
+    buf[--pos] = '\0';
+
+    if (name != NULL) {
+	len = strlen(name);
+	if (len + 1 > pos)
+	    return -ENAMETOOLONG;
+	pos -= len;
+	memcpy(buf + pos, name, len);
+	buf[--pos] = '/';
+    }
+
+    pthread_mutex_lock(&inodes->lock);
+    for (; inode != &inodes->root && inode->parent != NULL; inode = inode->parent) {
+	len = strlen(inode->name);
+	if (len + 1 > pos) {
+	    pthread_mutex_unlock(&inodes->lock);
+	    return -ENAMETOOLONG;
+	}
+	pos -= len;
+	memcpy(buf + pos, inode->name, len);
+	buf[--pos] = '/';
+    }
+    pthread_mutex_unlock(&inodes->lock);
+
+    if (pos == size - 1)
+	buf[--pos] = '/';	// the root itself
+    memmove(buf, buf + pos, size - pos);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Inode table for the low-level FUSE interface
+//
+// The kernel names files to us by the fuse_ino_t we handed back from
+// lookup, and that is simply the address of a struct ypfs_inode.
+// Each one holds an O_PATH fd for the backing file, so getattr, open
+// and the rest go straight to the file without resolving any path.
+//
+// An inode lives as long as the kernel holds lookup references to it
+// (dropped through forget) or it is the parent of an inode that does.
+// Parent and name are only where we last saw the file; they are
+// there to rebuild fs-relative paths for the directory cache and
+// ingest, which still think in paths.
+//
+// A few inodes stand for things ypfs makes up rather than backing
+// files: the .thumbs view of a directory and the thumbnails in it
+// (see thumbcache.h), and /.ypfs/stats (see stats.h).  Their fd is
+// that of the directory or photo they are made from, and they are
+// told apart from it by 'kind'.
+
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fuse_lowlevel.h>
+
+enum ypfs_inode_kind {
+    YPFS_INODE_BACKING,		// the backing file itself
+    YPFS_INODE_THUMBS,		// .thumbs of the directory
+    YPFS_INODE_THUMB,		// thumbnail of the photo
+    YPFS_INODE_STATS,		// statistics, in the directory
+};
+
+struct ypfs_inode {
+    struct ypfs_inode *next;	// hash chain, keyed on ino/dev/kind
+    int fd;			// O_PATH | O_NOFOLLOW
+    ino_t ino;
+    dev_t dev;
+    uint64_t nlookup;		// lookup count held by the kernel
+    uint64_t refs;		// nlookup + children naming us as parent
+    struct ypfs_inode *parent;
+    char *name;
+    int archive;		// at or under /Dates, as of parent and name
+    int opens;			// open file handles, updated atomically
+    unsigned truncs;		// size changes by setattr, likewise
+    unsigned writes;		// writes through any handle, likewise
+    enum ypfs_inode_kind kind;
+};
+
+struct ypfs_inodes;
+
+// The root inode uses 'rootfd', which stays the caller's to close
+struct ypfs_inodes *ypfs_inodes_new(int rootfd);
+void ypfs_inodes_free(struct ypfs_inodes *inodes);
+
+struct ypfs_inode *ypfs_inode_get(struct ypfs_inodes *inodes, fuse_ino_t ino);
+
+// Look 'name' up in directory 'parent' and take a lookup reference on
+// its inode.  Fills in e->ino, e->attr and e->generation; timeouts are
+// left to the caller.  Returns 0 or -errno.
+int ypfs_inode_lookup(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+		      struct fuse_entry_param *e);
+
+// Same, for a name whose attributes 'st' were just read with fstatat.
+// Opens nothing when the inode is already known.
+int ypfs_inode_lookup_stat(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+			   const struct stat *st, struct fuse_entry_param *e);
+
+// Same, for the made-up inode of 'kind' that 'name' in 'parent' stands
+// for.  Except for YPFS_INODE_THUMB that is 'parent' itself, whatever
+// the name.  e->attr is the backing file's, for the caller to make over.
+int ypfs_inode_lookup_virtual(struct ypfs_inodes *inodes, fuse_ino_t parent, const char *name,
+			      enum ypfs_inode_kind kind, struct fuse_entry_param *e);
+
+// Drop 'nlookup' lookup references, freeing what is no longer needed
+void ypfs_inode_forget(struct ypfs_inodes *inodes, fuse_ino_t ino, uint64_t nlookup);
+
+// Whether the file (st_dev, st_ino) is open through the mount
+int ypfs_inode_is_open(struct ypfs_inodes *inodes, dev_t dev, ino_t ino);
+
+// The kernel's inode number for the file (st_dev, st_ino), or 0 if it
+// hasn't been given one.  Only to tell the kernel about the file: the
+// inode may be forgotten at any moment, and the number be stale.
+fuse_ino_t ypfs_inode_id(struct ypfs_inodes *inodes, dev_t dev, ino_t ino);
+
+// After a rename, update the parent and name of whatever inode we have
+// for the file now at 'newparent'/'newname'
+void ypfs_inode_moved(struct ypfs_inodes *inodes, fuse_ino_t newparent, const char *newname);
+
+// Same, for a file moved behind the kernel's back to fs-relative
+// 'path', as ingest does.  Nothing changes unless we have an inode
+// for its directory too.
+void ypfs_inode_moved_at(struct ypfs_inodes *inodes, const char *path);
+
+// Fs-relative path of 'ino' ("/" for the root), or of 'name' inside it
+// if name is not NULL.  Returns 0 or -ENAMETOOLONG.
+int ypfs_inode_path(struct ypfs_inodes *inodes, fuse_ino_t ino, const char *name,
+		    char *buf, size_t size);
+
+#endif
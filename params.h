@@ -5,20 +5,116 @@
 #define _PARAMS_H_
 
 // The FUSE API has been changed a number of times.  So, our code
-// needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 26
-#define FUSE_USE_VERSION 26
+// needs to define the version of the API that we assume.  We use the
+// low-level API of libfuse 3, as of version 3.4
+#define FUSE_USE_VERSION 34
 
-// need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+// need this to get pwrite(), the *at() calls and O_PATH
+#define _GNU_SOURCE
 
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
+struct fuse_session;
+struct ypfs_dircache;
+struct ypfs_attrcache;
+struct ypfs_catalog;
+struct ypfs_dedup;
+struct ypfs_import;
+struct ypfs_ingest;
+struct ypfs_inodes;
+struct ypfs_notifier;
+struct ypfs_prefetch;
+struct ypfs_scan;
+struct ypfs_stats;
+struct ypfs_thumbcache;
+struct ypfs_trace;
+struct ypfs_uring;
 struct ypfs_state {
     char *rootdir;
+    int rootfd;			// O_PATH, opened in ypfs_init
+
+    // to tell the kernel what ingest and the like change, and the
+    // thread that does, see ypfs_notify()
+    struct fuse_session *se;
+    struct ypfs_notifier *notifier;
+
+    // what the kernel's inode numbers stand for, see inode.h
+    struct ypfs_inodes *inodes;
+
+    // directories known to exist, see dircache.h
+    struct ypfs_dircache *dirs;
+
+    // attributes of files seen lately, see attrcache.h.  Timeouts are
+    // in seconds, for the kernel's caches and ours alike: the sorted
+    // archive under /Dates hardly changes, the inbox root often does,
+    // and negative entries are for names like .DS_Store that are
+    // probed for everywhere and never there.
+    int attr_cache;
+    struct ypfs_attrcache *attrs;
+    double archive_timeout;
+    double inbox_timeout;
+    double negative_timeout;
+
+    // embedded thumbnails for the .thumbs view, see thumbcache.h;
+    // megabytes, 0 for no view
+    int thumb_cache;
+    struct ypfs_thumbcache *thumbs;
+
+    // latency histograms, see stats.h
+    int stats_enabled;
+    struct ypfs_stats *stats;
+
+    // binary event trace, see trace.h; relative to YPFS_CATALOG_DIR
+    // under rootdir, or absolute, NULL for none
+    char *trace_path;
+    struct ypfs_trace *trace;
+
+    // pread/pwrite through a buffer rather than splice, to compare
+    int copy_io;
+
+    // the largest write request to ask the kernel for, and how much
+    // of a handle's sequential writes to gather before writing them
+    // out (0 for none), both in KB
+    int max_write;
+    int write_buffer;
+
+    // files of a day to read ahead of one read in order, and MB of
+    // them at most, see prefetch.h
+    int prefetch_files;
+    int prefetch_mb;
+    struct ypfs_prefetch *prefetch;
+
+    // read, write, fsync and ingest's metadata calls through one
+    // io_uring of this many entries, 0 for plain syscalls, see uring.h
+    int uring_depth;
+    struct ypfs_uring *uring;
+
+    // record of sorted photos, see catalog.h; rootdir-relative or
+    // absolute path
+    char *catalog_path;
+    int no_catalog;
+    struct ypfs_catalog *catalog;
+
+    // content hashes of sorted files, see dedup.h
+    int no_dedup;
+    struct ypfs_dedup *dedup;
+
+    // tree scanner, see scan.h
+    int scan_at_mount;
+    int scan_threads;
+    struct ypfs_scan *scan;
+
+    // bulk import, see import.h
+    int import_threads;
+    struct ypfs_import *import;
+
+    // ingest pool, see ingest.h.  ingest_threads = 0 sorts files
+    // synchronously in release, like ypfs always used to.
+    int ingest_threads;
+    int ingest_queue;
+    struct ypfs_ingest *ingest;
 };
-#define YPFS_DATA ((struct ypfs_state *) fuse_get_context()->private_data)
+#define YPFS_DATA(req) ((struct ypfs_state *) fuse_req_userdata(req))
 
 #endif
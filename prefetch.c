@@ -0,0 +1,278 @@
+/*
+  Readahead and next-file prefetch
+
+  A handle's reads count as following on when each starts within
+  READAHEAD_SLACK of where the last one ended: the kernel has a few
+  reads of one file in flight at once, and they needn't reach us in
+  order.  After two such reads we keep at least half a window read
+  ahead of them.
+
+  The prefetch thread takes paths off a small ring, PREFETCH_QUEUE
+  deep, which ypfs_prefetch_next() overwrites the oldest entry of when
+  it is full.  For each it lists the directory, finds the file and
+  readahead()s the ones after it.  It remembers which entries of the
+  last directory it read, so that a slideshow moving on one photo at
+  a time only has one new photo read each time, not all of them
+  again.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "prefetch.h"
+
+#define READAHEAD_SLACK (1024 * 1024)
+#define PREFETCH_QUEUE 8
+
+const char *ypfs_relpath(const char *);
+
+struct ypfs_prefetch {
+    int rootfd;
+    int files;
+    size_t bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    char *queue[PREFETCH_QUEUE];
+    int head;
+    int count;
+    int stopping;
+    pthread_t thread;
+
+    // only the thread uses these: the directory it last read ahead
+    // in, and which of its entries, by position
+    char *last_dir;
+    int last_found;
+    int last_index;
+};
+
+void ypfs_readahead_init(struct ypfs_readahead *ra)
+{
+    memset(ra, 0, sizeof(*ra));
+    pthread_mutex_init(&ra->lock, NULL);
+    ra->window = YPFS_READAHEAD_MIN;
+}
+
+void ypfs_readahead_destroy(struct ypfs_readahead *ra)
+{
+    pthread_mutex_destroy(&ra->lock);
+}
+
+int ypfs_readahead_read(struct ypfs_readahead *ra, int fd, off_t offset, size_t size)
+{
+    off_t from;
+    int first = 0;
+
+    // it's only advice; a read that finds another at it skips it
+    if (fd < 0 || pthread_mutex_trylock(&ra->lock) != 0)
+	return 0;
+
+    if (ra->reads > 0 && offset + READAHEAD_SLACK >= ra->next
+	&& offset <= ra->next + READAHEAD_SLACK) {
+	ra->reads++;
+	if (offset + (off_t) size > ra->next)
+	    ra->next = offset + size;
+    } else {
+	ra->reads = 1;
+	ra->next = offset + size;
+	ra->end = ra->next;
+	ra->window = YPFS_READAHEAD_MIN;
+    }
+
+    // never less than the reads themselves, or it falls behind them
+    if (ra->window < 2 * size)
+	ra->window = 2 * size < YPFS_READAHEAD_MAX ? 2 * size : YPFS_READAHEAD_MAX;
+    if (ra->reads >= 2 && ra->end < ra->next + (off_t) ra->window / 2) {
+	from = ra->end > ra->next ? ra->end : ra->next;
+	posix_fadvise(fd, from, ra->window, POSIX_FADV_WILLNEED);
+	ra->end = from + ra->window;
+	if (ra->window < YPFS_READAHEAD_MAX)
+	    ra->window *= 2;
+    }
+    if (ra->reads >= 2 && !ra->sequential)
+	first = ra->sequential = 1;
+
+    pthread_mutex_unlock(&ra->lock);
+    return first;
+}
+
+// Read ahead the files after the one at 'path', which we may scribble on
+static void prefetch_dir(struct ypfs_prefetch *prefetch, char *path)
+{
+    char *slash = strrchr(path, '/');
+    const char *name;
+    const char *dir;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    int dirfd, fd;
+    int index = 0, found = -1, done;
+    size_t bytes = prefetch->bytes;
+    size_t n;
+
+    if (slash == NULL)
+	return;
+    *slash = '\0';
+    name = slash + 1;
+    dir = ypfs_relpath(path);
+
+    if (prefetch->last_dir == NULL || strcmp(prefetch->last_dir, dir) != 0) {
+	free(prefetch->last_dir);
+	prefetch->last_dir = strdup(dir);
+	prefetch->last_found = 0;
+	prefetch->last_index = 0;
+    }
+
+    dirfd = openat(prefetch->rootfd, dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+	return;
+    d = fdopendir(dirfd);
+    if (d == NULL) {
+	close(dirfd);
+	return;
+    }
+
+    // the same order the directory is listed through the mount in,
+    // less names starting with '.', which aren't photos
+    while ((de = readdir(d)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+	index++;
+	if (found < 0) {
+	    if (strcmp(de->d_name, name) == 0)
+		found = done = index;
+	    continue;
+	}
+	if (index - found > prefetch->files || bytes == 0)
+	    break;
+	done = index;
+	if (index > prefetch->last_found && index <= prefetch->last_index)
+	    continue;			// done last time
+
+	fd = openat(dirfd, de->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd < 0)
+	    continue;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	    n = (size_t) st.st_size < bytes ? (size_t) st.st_size : bytes;
+	    readahead(fd, 0, n);
+	    bytes -= n;
+	}
+	close(fd);
+    }
+    closedir(d);
+
+    if (found > 0 && prefetch->last_dir != NULL) {
+	prefetch->last_found = found;
+	prefetch->last_index = done;
+    }
+}
+
+static void *prefetch_thread(void *arg)
+{
+    struct ypfs_prefetch *prefetch = arg;
+    char *path;
+
+    pthread_mutex_lock(&prefetch->lock);
+    for (;;) {
+	while (prefetch->count == 0 && !prefetch->stopping)
+	    pthread_cond_wait(&prefetch->not_empty, &prefetch->lock);
+	if (prefetch->stopping)
+	    break;
+
+	path = prefetch->queue[prefetch->head];
+	prefetch->head = (prefetch->head + 1) % PREFETCH_QUEUE;
+	prefetch->count--;
+	pthread_mutex_unlock(&prefetch->lock);
+
+	prefetch_dir(prefetch, path);
+	free(path);
+
+	pthread_mutex_lock(&prefetch->lock);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return NULL;
+}
+
+struct ypfs_prefetch *ypfs_prefetch_start(int rootfd, int files, size_t bytes)
+{
+    struct ypfs_prefetch *prefetch;
+    int err;
+
+    if (files <= 0 || bytes == 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    prefetch = calloc(1, sizeof(*prefetch));
+    if (prefetch == NULL)
+	return NULL;
+    prefetch->rootfd = rootfd;
+    prefetch->files = files;
+    prefetch->bytes = bytes;
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->not_empty, NULL);
+
+    err = pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch);
+    if (err != 0) {
+	pthread_cond_destroy(&prefetch->not_empty);
+	pthread_mutex_destroy(&prefetch->lock);
+	free(prefetch);
+	errno = err;
+	return NULL;
+    }
+
+    return prefetch;
+}
+
+void ypfs_prefetch_stop(struct ypfs_prefetch *prefetch)
+{
+    if (prefetch == NULL)
+	return;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stopping = 1;
+    pthread_cond_signal(&prefetch->not_empty);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->thread, NULL);
+
+    while (prefetch->count > 0) {
+	free(prefetch->queue[prefetch->head]);
+	prefetch->head = (prefetch->head + 1) % PREFETCH_QUEUE;
+	prefetch->count--;
+    }
+    free(prefetch->last_dir);
+    pthread_cond_destroy(&prefetch->not_empty);
+    pthread_mutex_destroy(&prefetch->lock);
+    free(prefetch);
+}
+
+void ypfs_prefetch_next(struct ypfs_prefetch *prefetch, const char *path)
+{
+    char *copy;
+
+    copy = strdup(path);
+    if (copy == NULL)
+	return;
+
+    pthread_mutex_lock(&prefetch->lock);
+    if (prefetch->count == PREFETCH_QUEUE) {
+	free(prefetch->queue[prefetch->head]);
+	prefetch->head = (prefetch->head + 1) % PREFETCH_QUEUE;
+	prefetch->count--;
+    }
+    prefetch->queue[(prefetch->head + prefetch->count) % PREFETCH_QUEUE] = copy;
+    prefetch->count++;
+    pthread_cond_signal(&prefetch->not_empty);
+    pthread_mutex_unlock(&prefetch->lock);
+}
@@ -0,0 +1,66 @@
+// Readahead for photos read in order
+//
+// Slideshows and exports read the photos of a day one after another,
+// each front to back.  Left to itself the kernel reads ahead only a
+// little way into each backing file, and every new file starts cold:
+// on a disk, that's a seek per file.  So
+//
+//   - each handle watches where its reads fall, and once they follow
+//     on from one another asks for the file ahead of them with
+//     POSIX_FADV_WILLNEED, from YPFS_READAHEAD_MIN at a time and
+//     doubling up to YPFS_READAHEAD_MAX while they keep on
+//
+//   - the first time a handle on a file under /Dates reads in order,
+//     a background thread reads the next few files of its directory,
+//     in readdir order, into the page cache, so they are there by
+//     the time the slideshow gets to them
+//
+// Neither keeps any data of its own: what is read ahead is in the
+// page cache, and the budget is how many files, and how many bytes
+// of them, are read ahead of each one.
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define YPFS_READAHEAD_MIN (256 * 1024)
+#define YPFS_READAHEAD_MAX (8 * 1024 * 1024)
+
+// Where a handle's reads have been going, in each ypfs_file
+struct ypfs_readahead {
+    pthread_mutex_t lock;
+    off_t next;			// where a read following on would start
+    off_t end;			// read ahead up to here
+    size_t window;		// how far to read ahead next time
+    unsigned reads;		// one after another so far
+    int sequential;		// have been, at some point
+};
+
+void ypfs_readahead_init(struct ypfs_readahead *ra);
+void ypfs_readahead_destroy(struct ypfs_readahead *ra);
+
+// Note a read of 'size' bytes at 'offset' of the file open on 'fd',
+// and read ahead of it if it follows on.  Returns 1 the first time
+// the handle's reads are seen to follow on, else 0.
+int ypfs_readahead_read(struct ypfs_readahead *ra, int fd, off_t offset, size_t size);
+
+struct ypfs_prefetch;
+
+// Start a thread reading ahead up to 'files' files, and 'bytes' bytes
+// of them all, after each one it is told of.  Paths are relative to
+// 'rootfd', which stays the caller's.  Returns NULL with errno set if
+// the thread can't be started.
+struct ypfs_prefetch *ypfs_prefetch_start(int rootfd, int files, size_t bytes);
+
+// Drop whatever is still queued and stop the thread
+void ypfs_prefetch_stop(struct ypfs_prefetch *prefetch);
+
+// Read ahead the files after the one at fs-relative 'path' in its
+// directory.  Never waits: when the thread is behind, the oldest
+// request is dropped, since the reader has moved on from it anyway.
+void ypfs_prefetch_next(struct ypfs_prefetch *prefetch, const char *path);
+
+#endif
@@ -0,0 +1,481 @@
+/*
+  Tree scanner
+
+  Directories to read are fs-relative paths in per-thread deques.  A
+  thread pushes the subdirectories it finds onto the back of its own
+  deque and pops from there too, so it mostly goes depth first through
+  the part of the tree it is in; a thread that runs dry steals from
+  the front of another's deque, which is where the biggest untouched
+  subtrees are.  'pending' counts directories pushed and not yet
+  finished; when it reaches zero the scan is over.
+
+  Each directory is read with getdents64 into a per-thread buffer and
+  every entry statx()ed relative to the directory fd.  The inode number
+  getdents64 gives lets us take the attribute cache generation before
+  the statx, as attrcache.h wants.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "attrcache.h"
+#include "dircache.h"
+#include "ingest.h"
+#include "inode.h"
+#include "scan.h"
+
+const char *ypfs_relpath(const char *);
+
+#define SCAN_DIRENT_BUF (64 * 1024)
+
+struct scan_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct scan_deque {
+    pthread_mutex_t lock;
+    char **items;
+    size_t head;		// steal from here
+    size_t tail;		// push and pop here
+    size_t cap;
+};
+
+struct scan_worker {
+    struct ypfs_scan *scan;
+    struct scan_deque deque;
+    pthread_t thread;
+    int started;
+    char *buf;
+};
+
+struct ypfs_scan {
+    struct ypfs_state *state;
+    int nthreads;
+    struct scan_worker *workers;
+
+    pthread_mutex_t lock;	// for 'idle' waits and start/stop
+    pthread_cond_t work;
+    int running;
+    int starting;		// a start is joining the last scan's threads
+    int stopping;
+    size_t pending;		// directories queued or being read
+
+    // counters for the current or last scan
+    size_t dirs;
+    size_t files;
+    size_t requeued;
+    size_t errors;
+    struct timespec started;
+    struct timespec finished;
+};
+
+static double scan_seconds(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int scan_push(struct scan_worker *w, char *path)
+{
+    struct scan_deque *d = &w->deque;
+    char **grown;
+    size_t n;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+	// slide down to the front, or grow
+	n = d->tail - d->head;
+	if (d->head > 0 && n < d->cap / 2) {
+	    memmove(d->items, d->items + d->head, n * sizeof(char *));
+	} else {
+	    grown = realloc(d->items, (d->cap ? d->cap * 2 : 64) * sizeof(char *));
+	    if (grown == NULL) {
+		pthread_mutex_unlock(&d->lock);
+		return -ENOMEM;
+	    }
+	    d->items = grown;
+	    d->cap = d->cap ? d->cap * 2 : 64;
+	    memmove(d->items, d->items + d->head, n * sizeof(char *));
+	}
+	d->head = 0;
+	d->tail = n;
+    }
+    d->items[d->tail++] = path;
+    pthread_mutex_unlock(&d->lock);
+
+    __atomic_add_fetch(&w->scan->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&w->scan->work);
+
+    return 0;
+}
+
+static char *scan_pop(struct scan_worker *w)
+{
+    struct scan_deque *d = &w->deque;
+    char *path = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head)
+	path = d->items[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+
+    return path;
+}
+
+static char *scan_steal(struct scan_worker *w)
+{
+    struct ypfs_scan *scan = w->scan;
+    struct scan_deque *d;
+    char *path = NULL;
+    int self = w - scan->workers;
+    int i;
+
+    for (i = 1; i < scan->nthreads && path == NULL; i++) {
+	d = &scan->workers[(self + i) % scan->nthreads].deque;
+	pthread_mutex_lock(&d->lock);
+	if (d->tail > d->head)
+	    path = d->items[d->head++];
+	pthread_mutex_unlock(&d->lock);
+    }
+
+    return path;
+}
+
+static void scan_stat(struct stat *st, const struct statx *stx)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+// A file left in the inbox: sort it, unless it is open through the
+// mount, in which case its release will
+static void scan_requeue(struct ypfs_scan *scan, const char *path, const struct stat *st)
+{
+    struct ypfs_state *state = scan->state;
+
+    if (ypfs_inode_is_open(state->inodes, st->st_dev, st->st_ino))
+	return;
+    if (state->ingest == NULL || ypfs_ingest_enqueue(state->ingest, path, -1, NULL, NULL) < 0)
+	ypfs_ingest_file(state, path, -1, NULL, NULL);
+    __atomic_add_fetch(&scan->requeued, 1, __ATOMIC_RELAXED);
+}
+
+static void scan_dir(struct scan_worker *w, const char *path)
+{
+    struct ypfs_scan *scan = w->scan;
+    struct ypfs_state *state = scan->state;
+    struct scan_dirent64 *de;
+    struct statx stx;
+    struct stat st;
+    char child[PATH_MAX];
+    char *copy;
+    const char *prefix = strcmp(path, "/") == 0 ? "" : path;
+    int root = *prefix == '\0';
+    dev_t dev = 0;
+    uint64_t gen;
+    long n, pos;
+    int fd;
+
+    fd = openat(state->rootfd, ypfs_relpath(path), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+	__atomic_add_fetch(&scan->errors, 1, __ATOMIC_RELAXED);
+	return;
+    }
+    if (fstat(fd, &st) == 0)
+	dev = st.st_dev;
+    __atomic_add_fetch(&scan->dirs, 1, __ATOMIC_RELAXED);
+
+    while (!scan->stopping && (n = syscall(SYS_getdents64, fd, w->buf, SCAN_DIRENT_BUF)) > 0)
+	for (pos = 0; pos < n; pos += de->d_reclen) {
+	    de = (struct scan_dirent64 *) (w->buf + pos);
+	    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		continue;
+
+	    gen = ypfs_attrcache_gen(state->attrs, dev, de->d_ino);
+	    if (statx(fd, de->d_name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0) {
+		__atomic_add_fetch(&scan->errors, 1, __ATOMIC_RELAXED);
+		continue;
+	    }
+	    scan_stat(&st, &stx);
+	    if (st.st_dev == dev)
+		ypfs_attrcache_put(state->attrs, &st, gen);
+
+	    if (snprintf(child, sizeof(child), "%s/%s", prefix, de->d_name) >= sizeof(child))
+		continue;
+
+	    if (S_ISDIR(st.st_mode)) {
+		// the cache only takes directories whose parent it has
+		if (root || ypfs_dircache_has(state->dirs, path, strlen(path)))
+		    ypfs_dircache_add(state->dirs, child, strlen(child));
+		copy = strdup(child);
+		if (copy == NULL || scan_push(w, copy) < 0) {
+		    free(copy);
+		    __atomic_add_fetch(&scan->errors, 1, __ATOMIC_RELAXED);
+		}
+		continue;
+	    }
+
+	    __atomic_add_fetch(&scan->files, 1, __ATOMIC_RELAXED);
+	    if (root && S_ISREG(st.st_mode) && de->d_name[0] != '.')
+		scan_requeue(scan, child, &st);
+	}
+
+    close(fd);
+}
+
+static void *scan_worker(void *arg)
+{
+    struct scan_worker *w = arg;
+    struct ypfs_scan *scan = w->scan;
+    struct timespec until;
+    char *path;
+    double secs;
+
+    for (;;) {
+	path = scan_pop(w);
+	if (path == NULL)
+	    path = scan_steal(w);
+	if (path != NULL) {
+	    if (!scan->stopping)
+		scan_dir(w, path);
+	    free(path);
+	    if (__atomic_sub_fetch(&scan->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&scan->lock);
+		pthread_cond_broadcast(&scan->work);
+		pthread_mutex_unlock(&scan->lock);
+	    }
+	    continue;
+	}
+
+	pthread_mutex_lock(&scan->lock);
+	if (__atomic_load_n(&scan->pending, __ATOMIC_SEQ_CST) == 0) {
+	    // last one out reports, unless we are unmounting
+	    if (scan->running) {
+		scan->running = 0;
+		clock_gettime(CLOCK_MONOTONIC, &scan->finished);
+		secs = scan_seconds(&scan->started, &scan->finished);
+		if (!scan->stopping)
+		    fprintf(stderr, "ypfs: scanned %zu directories, %zu files in %.1fs "
+			    "(%.0f files/s), %zu requeued from the inbox\n",
+			    scan->dirs, scan->files, secs, secs > 0 ? scan->files / secs : 0.0,
+			    scan->requeued);
+	    }
+	    pthread_mutex_unlock(&scan->lock);
+	    break;
+	}
+	// others are still reading and may push more; don't spin
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += 10 * 1000 * 1000;
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&scan->work, &scan->lock, &until);
+	pthread_mutex_unlock(&scan->lock);
+    }
+
+    return NULL;
+}
+
+struct ypfs_scan *ypfs_scan_new(struct ypfs_state *state, int nthreads)
+{
+    struct ypfs_scan *scan;
+    int i;
+
+    if (nthreads <= 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    scan = calloc(1, sizeof(*scan));
+    if (scan == NULL)
+	return NULL;
+    scan->workers = calloc(nthreads, sizeof(struct scan_worker));
+    if (scan->workers == NULL) {
+	free(scan);
+	return NULL;
+    }
+    scan->state = state;
+    scan->nthreads = nthreads;
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->work, NULL);
+    for (i = 0; i < nthreads; i++) {
+	scan->workers[i].scan = scan;
+	pthread_mutex_init(&scan->workers[i].deque.lock, NULL);
+    }
+
+    return scan;
+}
+
+// Wait for the threads of the last scan.  Call with 'starting' set,
+// or from ypfs_scan_free(), so that nobody else does at once.
+static void scan_join(struct ypfs_scan *scan)
+{
+    struct scan_worker *w;
+    int i;
+
+    for (i = 0; i < scan->nthreads; i++) {
+	w = &scan->workers[i];
+	if (w->started) {
+	    pthread_join(w->thread, NULL);
+	    w->started = 0;
+	}
+	free(w->buf);
+	w->buf = NULL;
+    }
+}
+
+int ypfs_scan_start(struct ypfs_scan *scan)
+{
+    struct scan_worker *w;
+    char *root;
+    int started = 0;
+    int err = 0;
+    int i;
+
+    // Claimed before the lock is dropped, so that a second start
+    // meanwhile gets EBUSY rather than joining the same threads.  Not
+    // 'running' yet: the last scan's threads may still be on their
+    // way out, and the last of them clears that.
+    pthread_mutex_lock(&scan->lock);
+    if (scan->running || scan->starting) {
+	pthread_mutex_unlock(&scan->lock);
+	return -EBUSY;
+    }
+    scan->starting = 1;
+    // they have finished, or 'running' would still be set
+    pthread_mutex_unlock(&scan->lock);
+    scan_join(scan);
+
+    for (i = 0; i < scan->nthreads; i++) {
+	scan->workers[i].buf = malloc(SCAN_DIRENT_BUF);
+	if (scan->workers[i].buf == NULL)
+	    break;
+    }
+    root = i == scan->nthreads ? strdup("/") : NULL;
+    if (root == NULL) {
+	scan_join(scan);
+	pthread_mutex_lock(&scan->lock);
+	scan->starting = 0;
+	pthread_mutex_unlock(&scan->lock);
+	return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    scan->starting = 0;
+    scan->running = 1;
+    scan->stopping = 0;
+    scan->dirs = scan->files = scan->requeued = scan->errors = 0;
+    clock_gettime(CLOCK_MONOTONIC, &scan->started);
+    scan_push(&scan->workers[0], root);
+
+    for (i = 0; i < scan->nthreads; i++) {
+	w = &scan->workers[i];
+	err = pthread_create(&w->thread, NULL, scan_worker, w);
+	if (err != 0)
+	    break;
+	w->started = 1;
+	started++;
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    // any thread will do, since they steal
+    if (started == 0) {
+	free(scan_pop(&scan->workers[0]));
+	scan->pending = 0;
+	scan_join(scan);
+	pthread_mutex_lock(&scan->lock);
+	scan->running = 0;
+	pthread_mutex_unlock(&scan->lock);
+	return -err;
+    }
+
+    return 0;
+}
+
+int ypfs_scan_status(struct ypfs_scan *scan, char *buf, size_t size)
+{
+    struct timespec now;
+    double secs;
+    int ret;
+
+    pthread_mutex_lock(&scan->lock);
+    if (scan->running)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+    else
+	now = scan->finished;
+    secs = scan_seconds(&scan->started, &now);
+    if (scan->started.tv_sec == 0 && scan->started.tv_nsec == 0)
+	ret = snprintf(buf, size, "idle");
+    else
+	ret = snprintf(buf, size, "%s dirs=%zu files=%zu requeued=%zu errors=%zu "
+		       "seconds=%.1f files_per_sec=%.0f",
+		       scan->running ? "running" : "done",
+		       __atomic_load_n(&scan->dirs, __ATOMIC_RELAXED),
+		       __atomic_load_n(&scan->files, __ATOMIC_RELAXED),
+		       __atomic_load_n(&scan->requeued, __ATOMIC_RELAXED),
+		       __atomic_load_n(&scan->errors, __ATOMIC_RELAXED),
+		       secs, secs > 0 ? scan->files / secs : 0.0);
+    pthread_mutex_unlock(&scan->lock);
+
+    return ret;
+}
+
+void ypfs_scan_free(struct ypfs_scan *scan)
+{
+    char *path;
+    int i;
+
+    if (scan == NULL)
+	return;
+
+    scan->stopping = 1;
+    pthread_mutex_lock(&scan->lock);
+    pthread_cond_broadcast(&scan->work);
+    pthread_mutex_unlock(&scan->lock);
+    // workers drain their deques without reading, then quit
+    scan_join(scan);
+
+    for (i = 0; i < scan->nthreads; i++) {
+	while ((path = scan_pop(&scan->workers[i])) != NULL)
+	    free(path);
+	free(scan->workers[i].deque.items);
+	pthread_mutex_destroy(&scan->workers[i].deque.lock);
+    }
+    pthread_cond_destroy(&scan->work);
+    pthread_mutex_destroy(&scan->lock);
+    free(scan->workers);
+    free(scan);
+}
@@ -0,0 +1,40 @@
+// Tree scanner
+//
+// Mounted over a library that is already years deep, ypfs knows
+// nothing about the tree until it is touched, and files that were in
+// the inbox when the last mount went away (a crash, a kill) sit there
+// unsorted.  The scanner walks rootdir in the background with a pool
+// of threads and
+//
+//  - re-queues regular files left in the root for ingest,
+//  - adds the directories it finds to the directory cache, and
+//  - puts the attributes of what it stats into the attribute cache,
+//
+// while the mount carries on serving requests.  It runs at mount with
+// -o scan, and on demand by setting the user.ypfs.scan xattr on the
+// mount's root; getting that xattr reports progress and the rate.
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+struct ypfs_state;
+struct ypfs_scan;
+
+#define YPFS_XATTR_SCAN "user.ypfs.scan"
+
+struct ypfs_scan *ypfs_scan_new(struct ypfs_state *state, int nthreads);
+
+// Stop a running scan and free everything
+void ypfs_scan_free(struct ypfs_scan *scan);
+
+// Start a scan in the background.  Returns 0, -EBUSY if one is
+// already running, or -errno.
+int ypfs_scan_start(struct ypfs_scan *scan);
+
+// One line on how the current or last scan went, NUL-terminated.
+// Returns its length, as snprintf() does.
+int ypfs_scan_status(struct ypfs_scan *scan, char *buf, size_t size);
+
+#endif
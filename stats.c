@@ -0,0 +1,537 @@
+/*
+  Latency statistics
+
+  Each thread that counts anything gets a struct stats_thread the
+  first time, found again through a thread-local pointer.  Only that
+  thread writes to it, so counting is plain loads and stores; they
+  are atomic only so that a reader merging concurrently never sees a
+  torn value.  A reader may see a count a moment before its bucket,
+  which is as good as an instant later.
+
+  libfuse starts and stops worker threads as the load changes, so a
+  thread's block is handed on to the next new thread when it exits,
+  rather than freed: the counts in it stay in the totals, and memory
+  stays bounded by the most threads ever running at once.
+
+  A histogram bucket is picked from the top five significant bits of
+  the latency in nanoseconds: 16 linear buckets per power of two from
+  16ns up to 2^40ns (about 18 minutes), everything longer in the last.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fuse_lowlevel.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 40
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB)
+#define STATS_ERRNO 256
+
+struct stats_op {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t max;			// ns
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_thread {
+    struct stats_thread *next;
+    int live;				// a running thread has it
+    struct stats_op ops[YPFS_STATS_OPS];
+    uint64_t errnos[STATS_ERRNO];	// the last counts anything higher
+};
+
+struct ypfs_stats {
+    pthread_mutex_t lock;
+    pthread_key_t key;			// to notice threads exiting
+    struct stats_thread *threads;
+};
+
+static __thread struct stats_thread *stats_self;
+
+// how the request being served went, see ypfs_stats_error()
+static __thread int stats_err;
+static __thread size_t stats_bytes;
+
+static void stats_thread_exit(void *arg)
+{
+    struct stats_thread *t = arg;
+
+    __atomic_store_n(&t->live, 0, __ATOMIC_RELEASE);
+}
+
+struct ypfs_stats *ypfs_stats_new(void)
+{
+    struct ypfs_stats *stats;
+
+    stats = calloc(1, sizeof(*stats));
+    if (stats == NULL)
+	return NULL;
+    if (pthread_key_create(&stats->key, stats_thread_exit) != 0) {
+	free(stats);
+	return NULL;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+
+    return stats;
+}
+
+void ypfs_stats_free(struct ypfs_stats *stats)
+{
+    struct stats_thread *t, *next;
+
+    if (stats == NULL)
+	return;
+
+    pthread_key_delete(stats->key);
+    for (t = stats->threads; t != NULL; t = next) {
+	next = t->next;
+	free(t);
+    }
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+}
+
+// This thread's block, taking over one a thread left behind if there
+// is one
+static struct stats_thread *stats_thread(struct ypfs_stats *stats)
+{
+    struct stats_thread *t;
+
+    pthread_mutex_lock(&stats->lock);
+    for (t = stats->threads; t != NULL; t = t->next)
+	if (!__atomic_load_n(&t->live, __ATOMIC_ACQUIRE))
+	    break;
+    if (t == NULL) {
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+	    pthread_mutex_unlock(&stats->lock);
+	    return NULL;
+	}
+	t->next = stats->threads;
+	stats->threads = t;
+    }
+    t->live = 1;
+    pthread_mutex_unlock(&stats->lock);
+
+    pthread_setspecific(stats->key, t);
+    stats_self = t;
+    return t;
+}
+
+static unsigned stats_bucket(uint64_t ns)
+{
+    unsigned e;
+
+    if (ns < STATS_SUB)
+	return ns;
+    e = 63 - __builtin_clzll(ns);
+    if (e > STATS_MAX_EXP)
+	return STATS_BUCKETS - 1;
+    return (e - STATS_SUB_BITS + 1) * STATS_SUB + ((ns >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+// The highest latency that goes in bucket 'b'
+static uint64_t stats_value(unsigned b)
+{
+    unsigned e;
+
+    if (b < STATS_SUB)
+	return b;
+    e = b / STATS_SUB + STATS_SUB_BITS - 1;
+    return ((uint64_t) (STATS_SUB + b % STATS_SUB + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+// Only the owning thread adds to its counters
+static void stats_inc(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t ypfs_stats_start(struct ypfs_state *state)
+{
+    if (state->stats == NULL && state->trace == NULL)
+	return 0;
+    return stats_clock();
+}
+
+// Count one 'op' that took 'ns', moving 'bytes', failing with 'err'
+// unless that is 0.  A NULL 'stats' does nothing.
+static void stats_add(struct ypfs_stats *stats, enum ypfs_stats_op op, uint64_t ns, int err,
+		      size_t bytes)
+{
+    struct stats_thread *t = stats_self;
+    struct stats_op *o;
+
+    if (stats == NULL)
+	return;
+    if (t == NULL) {
+	t = stats_thread(stats);
+	if (t == NULL)
+	    return;
+    }
+
+    o = &t->ops[op];
+    stats_inc(&o->count, 1);
+    stats_inc(&o->buckets[stats_bucket(ns)], 1);
+    stats_inc(&o->bytes, bytes);
+    if (ns > o->max)
+	__atomic_store_n(&o->max, ns, __ATOMIC_RELAXED);
+    if (err != 0) {
+	if (err < 0)
+	    err = -err;
+	stats_inc(&o->errors, 1);
+	stats_inc(&t->errnos[err < STATS_ERRNO ? err : STATS_ERRNO - 1], 1);
+    }
+}
+
+// Count and trace 'op', which started at 'start' and ended now; 'rec'
+// has what the trace wants to know about it, filled in beforehand if
+// there is a trace
+static void stats_done(struct ypfs_state *state, enum ypfs_stats_op op, uint64_t start,
+		       struct ypfs_trace_record *rec, int err, size_t bytes)
+{
+    uint64_t ns;
+
+    if (start == 0)
+	return;
+
+    ns = stats_clock() - start;
+    stats_add(state->stats, op, ns, err, bytes);
+    if (state->trace != NULL) {
+	rec->err = err < 0 ? -err : err;
+	if (bytes != 0)
+	    rec->size = bytes;
+	ypfs_trace_add(state->trace, rec, start, ns);
+    }
+}
+
+// What the trace wants to know about 'op' on 'ino', through 'fi'
+// and with 'name' in it if either is given
+static void stats_trace(struct ypfs_trace_record *rec, enum ypfs_stats_op op, fuse_ino_t ino,
+			const struct fuse_file_info *fi, const char *name, off_t off, size_t size)
+{
+    rec->ino = ino;
+    rec->fh = fi != NULL ? fi->fh : 0;
+    rec->path = name != NULL ? ypfs_trace_hash(name, ino) : 0;
+    rec->offset = off;
+    rec->size = size;
+    rec->op = op;
+    rec->err = 0;
+}
+
+void ypfs_stats_stage(struct ypfs_state *state, enum ypfs_stats_op op, uint64_t start, int err,
+		      size_t bytes, const char *path)
+{
+    struct ypfs_trace_record rec;
+
+    if (start == 0)
+	return;
+    if (state->trace != NULL)
+	stats_trace(&rec, op, 0, NULL, path, -1, 0);
+    stats_done(state, op, start, &rec, err, bytes);
+}
+
+void ypfs_stats_error(int err)
+{
+    stats_err = err;
+}
+
+void ypfs_stats_bytes(size_t bytes)
+{
+    stats_bytes = bytes;
+}
+
+// Latency at quantile 'q' of 'o', in ns
+static uint64_t stats_quantile(const struct stats_op *o, double q)
+{
+    uint64_t want = (uint64_t) (q * o->count + 0.999999);
+    uint64_t seen = 0;
+    unsigned b;
+
+    if (want == 0)
+	want = 1;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+	seen += o->buckets[b];
+	if (seen >= want)
+	    return stats_value(b) < o->max ? stats_value(b) : o->max;
+    }
+    return o->max;
+}
+
+ssize_t ypfs_stats_render(struct ypfs_stats *stats, char **text)
+{
+    struct stats_op *ops;
+    struct stats_thread *t;
+    uint64_t errnos[STATS_ERRNO] = { 0 };
+    struct stats_op *o;
+    size_t len;
+    FILE *f;
+    unsigned threads = 0;
+    int i, b;
+
+    ops = calloc(YPFS_STATS_OPS, sizeof(*ops));
+    if (ops == NULL)
+	return -ENOMEM;
+
+    pthread_mutex_lock(&stats->lock);
+    for (t = stats->threads; t != NULL; t = t->next) {
+	threads++;
+	for (i = 0; i < YPFS_STATS_OPS; i++) {
+	    o = &t->ops[i];
+	    ops[i].count += __atomic_load_n(&o->count, __ATOMIC_RELAXED);
+	    ops[i].errors += __atomic_load_n(&o->errors, __ATOMIC_RELAXED);
+	    ops[i].bytes += __atomic_load_n(&o->bytes, __ATOMIC_RELAXED);
+	    if (__atomic_load_n(&o->max, __ATOMIC_RELAXED) > ops[i].max)
+		ops[i].max = __atomic_load_n(&o->max, __ATOMIC_RELAXED);
+	    for (b = 0; b < STATS_BUCKETS; b++)
+		ops[i].buckets[b] += __atomic_load_n(&o->buckets[b], __ATOMIC_RELAXED);
+	}
+	for (b = 0; b < STATS_ERRNO; b++)
+	    errnos[b] += __atomic_load_n(&t->errnos[b], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    f = open_memstream(text, &len);
+    if (f == NULL) {
+	free(ops);
+	return -ENOMEM;
+    }
+
+    // latencies in microseconds
+    fprintf(f, "%-16s %10s %8s %14s %10s %10s %10s %10s\n", "op", "count", "errors", "bytes",
+	    "p50", "p99", "p999", "max");
+    for (i = 0; i < YPFS_STATS_OPS; i++) {
+	o = &ops[i];
+	if (o->count == 0)
+	    continue;
+	// buckets may be a moment behind the count
+	o->count = 0;
+	for (b = 0; b < STATS_BUCKETS; b++)
+	    o->count += o->buckets[b];
+	fprintf(f, "%-16s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f\n", ypfs_trace_op_name(i),
+		(unsigned long long) o->count, (unsigned long long) o->errors,
+		(unsigned long long) o->bytes, stats_quantile(o, 0.50) / 1e3,
+		stats_quantile(o, 0.99) / 1e3, stats_quantile(o, 0.999) / 1e3, o->max / 1e3);
+    }
+
+    fprintf(f, "\n%-16s %10s\n", "errno", "count");
+    for (b = 1; b < STATS_ERRNO; b++)
+	if (errnos[b] != 0)
+	    fprintf(f, "%-16d %10llu\n", b, (unsigned long long) errnos[b]);
+    fprintf(f, "\nthreads %u\n", threads);
+
+    free(ops);
+    if (fclose(f) != 0) {
+	free(*text);
+	return -ENOMEM;
+    }
+    return len;
+}
+
+// The operations table wrapped by ypfs_stats_wrap().  Each wrapper
+// times the real operation, which replies before it returns, and
+// counts whatever it noted through ypfs_stats_error() and
+// ypfs_stats_bytes().  'req' is gone by then, and whatever came with
+// it, so the state is looked up and the trace record filled in from
+// 'event', a list of what stats_trace() takes after the op, first.
+
+static struct fuse_lowlevel_ops stats_inner;
+
+#define STATS_TRACE(ino, fi, name, off, size) ino, fi, name, off, size
+
+#define STATS_WRAP(name, op, params, args, event)			\
+    static void stats_##name params					\
+    {									\
+	struct ypfs_state *state = YPFS_DATA(req);			\
+	struct ypfs_trace_record rec;					\
+	uint64_t start = ypfs_stats_start(state);			\
+									\
+	if (state->trace != NULL)					\
+	    stats_trace(&rec, op, STATS_TRACE event);			\
+	stats_err = 0;							\
+	stats_bytes = 0;						\
+	stats_inner.name args;						\
+	stats_done(state, op, start, &rec, stats_err, stats_bytes);	\
+    }
+
+STATS_WRAP(lookup, YPFS_OP_LOOKUP,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(forget, YPFS_OP_FORGET,
+	   (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup), (req, ino, nlookup),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(forget_multi, YPFS_OP_FORGET_MULTI,
+	   (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+	   (req, count, forgets),
+	   (0, NULL, NULL, -1, count))
+STATS_WRAP(getattr, YPFS_OP_GETATTR,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(setattr, YPFS_OP_SETATTR,
+	   (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	    struct fuse_file_info *fi), (req, ino, attr, to_set, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(readlink, YPFS_OP_READLINK, (fuse_req_t req, fuse_ino_t ino), (req, ino),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(mknod, YPFS_OP_MKNOD,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev),
+	   (req, parent, name, mode, rdev),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(mkdir, YPFS_OP_MKDIR,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+	   (req, parent, name, mode),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(unlink, YPFS_OP_UNLINK,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(rmdir, YPFS_OP_RMDIR,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(symlink, YPFS_OP_SYMLINK,
+	   (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name),
+	   (req, link, parent, name),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(rename, YPFS_OP_RENAME,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+	    const char *newname, unsigned int flags),
+	   (req, parent, name, newparent, newname, flags),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(link, YPFS_OP_LINK,
+	   (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname),
+	   (req, ino, newparent, newname),
+	   (newparent, NULL, newname, -1, 0))
+STATS_WRAP(open, YPFS_OP_OPEN,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(read, YPFS_OP_READ,
+	   (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, size, off, fi),
+	   (ino, fi, NULL, off, size))
+STATS_WRAP(write, YPFS_OP_WRITE,
+	   (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+	    struct fuse_file_info *fi), (req, ino, buf, size, off, fi),
+	   (ino, fi, NULL, off, size))
+STATS_WRAP(write_buf, YPFS_OP_WRITE_BUF,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+	    struct fuse_file_info *fi), (req, ino, bufv, off, fi),
+	   (ino, fi, NULL, off, fuse_buf_size(bufv)))
+STATS_WRAP(statfs, YPFS_OP_STATFS, (fuse_req_t req, fuse_ino_t ino), (req, ino),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(flush, YPFS_OP_FLUSH,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(release, YPFS_OP_RELEASE,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(fsync, YPFS_OP_FSYNC,
+	   (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+	   (req, ino, datasync, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(setxattr, YPFS_OP_SETXATTR,
+	   (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size,
+	    int flags), (req, ino, name, value, size, flags),
+	   (ino, NULL, NULL, -1, size))
+STATS_WRAP(getxattr, YPFS_OP_GETXATTR,
+	   (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size),
+	   (req, ino, name, size),
+	   (ino, NULL, NULL, -1, size))
+STATS_WRAP(listxattr, YPFS_OP_LISTXATTR,
+	   (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size),
+	   (ino, NULL, NULL, -1, size))
+STATS_WRAP(removexattr, YPFS_OP_REMOVEXATTR,
+	   (fuse_req_t req, fuse_ino_t ino, const char *name), (req, ino, name),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(opendir, YPFS_OP_OPENDIR,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(readdir, YPFS_OP_READDIR,
+	   (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, size, off, fi),
+	   (ino, fi, NULL, off, size))
+STATS_WRAP(readdirplus, YPFS_OP_READDIRPLUS,
+	   (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, size, off, fi),
+	   (ino, fi, NULL, off, size))
+STATS_WRAP(releasedir, YPFS_OP_RELEASEDIR,
+	   (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(fsyncdir, YPFS_OP_FSYNCDIR,
+	   (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+	   (req, ino, datasync, fi),
+	   (ino, fi, NULL, -1, 0))
+STATS_WRAP(access, YPFS_OP_ACCESS, (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask),
+	   (ino, NULL, NULL, -1, 0))
+STATS_WRAP(create, YPFS_OP_CREATE,
+	   (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+	    struct fuse_file_info *fi), (req, parent, name, mode, fi),
+	   (parent, NULL, name, -1, 0))
+STATS_WRAP(copy_file_range, YPFS_OP_COPY_FILE_RANGE,
+	   (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+	    fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len,
+	    int flags), (req, ino_in, off_in, fi_in, ino_out, off_out, fi_out, len, flags),
+	   (ino_out, fi_out, NULL, off_out, len))
+
+#define STATS_HOOK(name)			\
+    if (ops->name != NULL)			\
+	ops->name = stats_##name
+
+void ypfs_stats_wrap(struct fuse_lowlevel_ops *ops)
+{
+    stats_inner = *ops;
+
+    STATS_HOOK(lookup);
+    STATS_HOOK(forget);
+    STATS_HOOK(forget_multi);
+    STATS_HOOK(getattr);
+    STATS_HOOK(setattr);
+    STATS_HOOK(readlink);
+    STATS_HOOK(mknod);
+    STATS_HOOK(mkdir);
+    STATS_HOOK(unlink);
+    STATS_HOOK(rmdir);
+    STATS_HOOK(symlink);
+    STATS_HOOK(rename);
+    STATS_HOOK(link);
+    STATS_HOOK(open);
+    STATS_HOOK(read);
+    STATS_HOOK(write);
+    STATS_HOOK(write_buf);
+    STATS_HOOK(statfs);
+    STATS_HOOK(flush);
+    STATS_HOOK(release);
+    STATS_HOOK(fsync);
+    STATS_HOOK(setxattr);
+    STATS_HOOK(getxattr);
+    STATS_HOOK(listxattr);
+    STATS_HOOK(removexattr);
+    STATS_HOOK(opendir);
+    STATS_HOOK(readdir);
+    STATS_HOOK(readdirplus);
+    STATS_HOOK(releasedir);
+    STATS_HOOK(fsyncdir);
+    STATS_HOOK(access);
+    STATS_HOOK(create);
+    STATS_HOOK(copy_file_range);
+}
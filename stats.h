@@ -0,0 +1,108 @@
+// Latency statistics
+//
+// With -o stats, every request is timed on its way through the
+// operations table, and so are the stages of ingest that tend to be
+// slow: reading the EXIF date, hashing, making the day directory, the
+// rename, the catalog record.  Each thread counts into histograms of
+// its own, log-bucketed the way HdrHistogram does it (16 buckets per
+// power of two, so within about 6%), and nothing is shared or locked
+// on the way; reading /.ypfs/stats merges them into one table of
+// counts, bytes, errors and p50/p99/p999 latencies per operation,
+// followed by error counts by errno.
+//
+// /.ypfs/stats is made up when it is opened and isn't listed in
+// /.ypfs.  Without -o stats, it doesn't exist, and unless a trace
+// (see trace.h) wants the same timings, nothing is timed.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "catalog.h"
+
+struct fuse_lowlevel_ops;
+struct ypfs_state;
+
+// in YPFS_CATALOG_DIR
+#define YPFS_STATS_FILE "stats"
+
+enum ypfs_stats_op {
+    YPFS_OP_LOOKUP,
+    YPFS_OP_FORGET,
+    YPFS_OP_FORGET_MULTI,
+    YPFS_OP_GETATTR,
+    YPFS_OP_SETATTR,
+    YPFS_OP_READLINK,
+    YPFS_OP_MKNOD,
+    YPFS_OP_MKDIR,
+    YPFS_OP_UNLINK,
+    YPFS_OP_RMDIR,
+    YPFS_OP_SYMLINK,
+    YPFS_OP_RENAME,
+    YPFS_OP_LINK,
+    YPFS_OP_OPEN,
+    YPFS_OP_READ,
+    YPFS_OP_WRITE,
+    YPFS_OP_WRITE_BUF,
+    YPFS_OP_STATFS,
+    YPFS_OP_FLUSH,
+    YPFS_OP_RELEASE,
+    YPFS_OP_FSYNC,
+    YPFS_OP_SETXATTR,
+    YPFS_OP_GETXATTR,
+    YPFS_OP_LISTXATTR,
+    YPFS_OP_REMOVEXATTR,
+    YPFS_OP_OPENDIR,
+    YPFS_OP_READDIR,
+    YPFS_OP_READDIRPLUS,
+    YPFS_OP_RELEASEDIR,
+    YPFS_OP_FSYNCDIR,
+    YPFS_OP_ACCESS,
+    YPFS_OP_CREATE,
+    YPFS_OP_COPY_FILE_RANGE,
+
+    // stages of ingest, timed wherever ingest runs
+    YPFS_STAGE_INGEST,		// the whole of ypfs_ingest_file()
+    YPFS_STAGE_EXIF,		// dating from the file
+    YPFS_STAGE_HASH,
+    YPFS_STAGE_MKDIR,
+    YPFS_STAGE_RENAME,
+    YPFS_STAGE_CATALOG,
+    YPFS_STAGE_IMPORT,		// a file of a bulk import, see import.h
+
+    YPFS_STATS_OPS
+};
+
+struct ypfs_stats;
+
+struct ypfs_stats *ypfs_stats_new(void);
+void ypfs_stats_free(struct ypfs_stats *stats);
+
+// Put a timing wrapper around each operation in 'ops', which counts
+// into ypfs_state.stats and traces into ypfs_state.trace, whichever
+// are set when the request comes.  Call before the session is made.
+void ypfs_stats_wrap(struct fuse_lowlevel_ops *ops);
+
+// For timing a stage: a start time for ypfs_stats_stage(), or 0 if
+// neither stats nor a trace are on
+uint64_t ypfs_stats_start(struct ypfs_state *state);
+
+// Count and trace one stage 'op' of the work on fs-relative 'path'
+// that started at 'start' and ended now, moving 'bytes', failing
+// with 'err' unless that is 0.  A 'start' of 0 does nothing.
+void ypfs_stats_stage(struct ypfs_state *state, enum ypfs_stats_op op, uint64_t start, int err,
+		      size_t bytes, const char *path);
+
+// Note how the request this thread is serving went, for its wrapper
+// to count.  Cheap enough to call whether or not requests are timed.
+void ypfs_stats_error(int err);
+void ypfs_stats_bytes(size_t bytes);
+
+// Render the merged statistics as text into a malloc()ed buffer.
+// Returns its length, or -ENOMEM.
+ssize_t ypfs_stats_render(struct ypfs_stats *stats, char **text);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+  Thumbnail cache
+
+  One mutex covers a chained hash table and an LRU list through the
+  same entries.  Entries are charged what their thumbnail takes, and
+  the least recently used go once the total is over budget.  The
+  thumbnails themselves are reference counted: the cache holds one
+  reference and every handle reading it another, so an evicted
+  thumbnail lives on until the last of them is done.
+
+  An entry is only good while the photo has the size, mtime and ctime
+  it was read at; anything that rewrites a photo changes them, so
+  nothing needs invalidating by hand.  Reading a thumbnail happens
+  without the lock, and two threads missing on the same photo just
+  both read it.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "exifdate.h"
+#include "thumbcache.h"
+
+#define THUMBCACHE_BUCKETS 4096
+
+struct thumbcache_entry {
+    struct thumbcache_entry *next;	// hash chain
+    struct thumbcache_entry *lru_prev;	// most recently used first
+    struct thumbcache_entry *lru_next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    struct ypfs_thumb *thumb;		// NULL if the photo has none
+};
+
+struct ypfs_thumbcache {
+    pthread_mutex_t lock;
+    struct thumbcache_entry *buckets[THUMBCACHE_BUCKETS];
+    struct thumbcache_entry *lru_head;
+    struct thumbcache_entry *lru_tail;
+    size_t used;
+    size_t budget;
+};
+
+static size_t thumbcache_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t) dev;
+
+    return (size_t) (h ^ (h >> 31)) % THUMBCACHE_BUCKETS;
+}
+
+static size_t thumbcache_charge(const struct thumbcache_entry *e)
+{
+    return sizeof(*e) + (e->thumb != NULL ? sizeof(*e->thumb) + e->thumb->len : 0);
+}
+
+struct ypfs_thumbcache *ypfs_thumbcache_new(size_t bytes)
+{
+    struct ypfs_thumbcache *cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+	return NULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->budget = bytes;
+
+    return cache;
+}
+
+void ypfs_thumbcache_free(struct ypfs_thumbcache *cache)
+{
+    struct thumbcache_entry *e, *next;
+
+    if (cache == NULL)
+	return;
+
+    for (e = cache->lru_head; e != NULL; e = next) {
+	next = e->lru_next;
+	ypfs_thumb_put(e->thumb);
+	free(e);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void ypfs_thumb_put(struct ypfs_thumb *thumb)
+{
+    if (thumb != NULL && __atomic_sub_fetch(&thumb->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	free(thumb);
+}
+
+static int thumbcache_fresh(const struct thumbcache_entry *e, const struct stat *st)
+{
+    return e->size == st->st_size
+	&& e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec
+	&& e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// call with cache->lock held
+static struct thumbcache_entry **thumbcache_find(struct ypfs_thumbcache *cache, dev_t dev,
+						 ino_t ino)
+{
+    struct thumbcache_entry **ep;
+
+    for (ep = &cache->buckets[thumbcache_hash(dev, ino)]; *ep != NULL; ep = &(*ep)->next)
+	if ((*ep)->ino == ino && (*ep)->dev == dev)
+	    break;
+    return ep;
+}
+
+// call with cache->lock held
+static void thumbcache_lru_unlink(struct ypfs_thumbcache *cache, struct thumbcache_entry *e)
+{
+    if (e->lru_prev != NULL)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	cache->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	cache->lru_tail = e->lru_prev;
+}
+
+// call with cache->lock held
+static void thumbcache_lru_push(struct ypfs_thumbcache *cache, struct thumbcache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+	cache->lru_head->lru_prev = e;
+    else
+	cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+// Take 'e' out of the cache.  Call with cache->lock held; the caller
+// frees it once the lock is dropped.
+static void thumbcache_remove(struct ypfs_thumbcache *cache, struct thumbcache_entry *e)
+{
+    struct thumbcache_entry **ep = thumbcache_find(cache, e->dev, e->ino);
+
+    *ep = e->next;
+    thumbcache_lru_unlink(cache, e);
+    cache->used -= thumbcache_charge(e);
+}
+
+static void thumbcache_free_entry(struct thumbcache_entry *e)
+{
+    if (e != NULL) {
+	ypfs_thumb_put(e->thumb);
+	free(e);
+    }
+}
+
+// Read the thumbnail of the photo 'fd' is open on
+static int thumbcache_read(int fd, struct ypfs_thumb **thumb)
+{
+    struct ypfs_thumb *t;
+    char procpath[64];
+    off_t offset;
+    size_t len;
+    ssize_t n;
+    int rfd;
+    int ret;
+
+    // 'fd' may well be O_PATH
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+    rfd = open(procpath, O_RDONLY);
+    if (rfd < 0)
+	return -errno;
+
+    ret = ypfs_exif_thumb_fd(rfd, &offset, &len);
+    if (ret < 0)
+	goto out;
+
+    t = malloc(sizeof(*t) + len);
+    if (t == NULL) {
+	ret = -ENOMEM;
+	goto out;
+    }
+    n = pread(rfd, t->data, len, offset);
+    if (n < 0) {
+	ret = -errno;
+	free(t);
+	goto out;
+    }
+
+    // a pointer past the end of the file, or to something other than
+    // a JPEG, is as good as no thumbnail
+    if ((size_t) n != len || len < 2 || t->data[0] != 0xFF || t->data[1] != 0xD8) {
+	ret = -ENOENT;
+	free(t);
+	goto out;
+    }
+    t->refs = 1;
+    t->len = len;
+    *thumb = t;
+
+ out:
+    close(rfd);
+    return ret;
+}
+
+int ypfs_thumbcache_get(struct ypfs_thumbcache *cache, int fd, struct ypfs_thumb **thumb)
+{
+    struct thumbcache_entry *e;
+    struct thumbcache_entry *dead = NULL;
+    struct thumbcache_entry *evicted = NULL;
+    struct stat st;
+    struct ypfs_thumb *t = NULL;
+    int ret;
+
+    if (fstat(fd, &st) < 0)
+	return -errno;
+    if (!S_ISREG(st.st_mode))
+	return -ENOENT;
+
+    if (cache != NULL) {
+	pthread_mutex_lock(&cache->lock);
+	e = *thumbcache_find(cache, st.st_dev, st.st_ino);
+	if (e != NULL && thumbcache_fresh(e, &st)) {
+	    thumbcache_lru_unlink(cache, e);
+	    thumbcache_lru_push(cache, e);
+	    t = e->thumb;
+	    if (t != NULL)
+		__atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&cache->lock);
+	    if (t == NULL)
+		return -ENOENT;
+	    *thumb = t;
+	    return 0;
+	}
+	if (e != NULL) {
+	    // the photo has changed since
+	    thumbcache_remove(cache, e);
+	    dead = e;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	thumbcache_free_entry(dead);
+    }
+
+    ret = thumbcache_read(fd, &t);
+    if (cache == NULL || (ret < 0 && ret != -ENOENT)) {
+	// read errors may pass; don't remember them
+	if (ret == 0)
+	    *thumb = t;
+	return ret;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+	if (ret == 0)
+	    *thumb = t;
+	return ret;
+    }
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->ctime = st.st_ctim;
+    e->thumb = t;
+    if (t != NULL)
+	t->refs++;			// the cache's, nobody else has it yet
+
+    pthread_mutex_lock(&cache->lock);
+    dead = *thumbcache_find(cache, e->dev, e->ino);
+    if (dead != NULL)
+	thumbcache_remove(cache, dead);	// another miss got here first
+    e->next = cache->buckets[thumbcache_hash(e->dev, e->ino)];
+    cache->buckets[thumbcache_hash(e->dev, e->ino)] = e;
+    thumbcache_lru_push(cache, e);
+    cache->used += thumbcache_charge(e);
+    while (cache->used > cache->budget && cache->lru_tail != e) {
+	struct thumbcache_entry *old = cache->lru_tail;
+
+	thumbcache_remove(cache, old);
+	old->next = evicted;
+	evicted = old;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    thumbcache_free_entry(dead);
+    while (evicted != NULL) {
+	dead = evicted;
+	evicted = evicted->next;
+	thumbcache_free_entry(dead);
+    }
+
+    if (ret == 0)
+	*thumb = t;
+    return ret;
+}
+
+void ypfs_thumbcache_prime(struct ypfs_thumbcache *cache, int dirfd, const char *name)
+{
+    struct ypfs_thumb *thumb;
+    int fd;
+
+    if (cache == NULL)
+	return;
+
+    fd = openat(dirfd, name, O_PATH | O_NOFOLLOW);
+    if (fd < 0)
+	return;
+    if (ypfs_thumbcache_get(cache, fd, &thumb) == 0)
+	ypfs_thumb_put(thumb);
+    close(fd);
+}
@@ -0,0 +1,50 @@
+// Thumbnails, for the .thumbs view of /Dates
+//
+// Gallery apps open every full-size photo in a day just to draw a
+// grid.  Most cameras embed a small JPEG thumbnail in the EXIF, a few
+// KB inside the first 64K of the file, so every directory under
+// /Dates has a hidden .thumbs directory next to the photos: for each
+// photo with an embedded thumbnail it holds a read-only file of the
+// same name whose contents are that thumbnail.  .thumbs doesn't show
+// up in listings, so find and backups don't see every photo twice;
+// apps that know of it just open it by name.
+//
+// Thumbnails are kept in an LRU cache of bounded size, keyed on the
+// photo's (st_dev, st_ino) and checked against its size and mtime.
+// Photos without one are remembered too.  The cache is filled as the
+// view is read, and by ingest for photos it sorts.  Handles hold a
+// reference to their thumbnail, so eviction never pulls one out from
+// under a read.
+
+#ifndef _THUMBCACHE_H_
+#define _THUMBCACHE_H_
+
+#include <stddef.h>
+
+#define YPFS_THUMBS_DIR ".thumbs"
+
+struct ypfs_thumbcache;
+
+struct ypfs_thumb {
+    unsigned refs;		// updated atomically
+    size_t len;
+    unsigned char data[];
+};
+
+// A cache of at most 'bytes' of thumbnails
+struct ypfs_thumbcache *ypfs_thumbcache_new(size_t bytes);
+void ypfs_thumbcache_free(struct ypfs_thumbcache *cache);
+
+// Thumbnail of the file 'fd' is open on, O_PATH fds included, with a
+// reference the caller drops with ypfs_thumb_put().  A NULL cache
+// reads it every time.  Returns 0, -ENOENT if the file has none, or
+// -errno.
+int ypfs_thumbcache_get(struct ypfs_thumbcache *cache, int fd, struct ypfs_thumb **thumb);
+
+void ypfs_thumb_put(struct ypfs_thumb *thumb);
+
+// Read the thumbnail of 'name' in 'dirfd' into the cache, if it isn't
+// there yet
+void ypfs_thumbcache_prime(struct ypfs_thumbcache *cache, int dirfd, const char *name);
+
+#endif
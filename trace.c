@@ -0,0 +1,384 @@
+/*
+  Event trace
+
+  Each thread that traces gets a struct trace_ring the first time,
+  as stats.c hands out its blocks, and likewise hands it on when the
+  thread exits.  A ring has one writer, its thread, which only moves
+  'head', and one reader, the flusher, which only moves 'tail'; a
+  release store on each publishes the records between them.
+
+  The flusher wakes every TRACE_INTERVAL_MS, copies what every ring
+  has into a buffer of TRACE_BUF records and writes the buffer out
+  whenever it fills, and at the end of the round.  Closing wakes it
+  for a last round.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "catalog.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_RING 4096			// records per thread, a power of 2
+#define TRACE_BUF 16384			// records per write
+#define TRACE_INTERVAL_MS 100
+
+struct trace_ring {
+    struct trace_ring *next;
+    int live;				// a running thread has it
+    uint32_t tid;
+    uint64_t dropped;			// by the writer
+    uint64_t dropped_seen;		// by the flusher
+
+    // on lines of their own, since different threads write them
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    struct ypfs_trace_record recs[TRACE_RING];
+};
+
+struct ypfs_trace {
+    int fd;
+    uint64_t start;			// CLOCK_MONOTONIC ns at the start
+    pthread_key_t key;			// to notice threads exiting
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+    pthread_t flusher;
+    struct trace_ring *rings;
+    struct ypfs_trace_record *buf;
+    size_t buffered;
+};
+
+static const char *trace_names[YPFS_STATS_OPS] = {
+    [YPFS_OP_LOOKUP] = "lookup",
+    [YPFS_OP_FORGET] = "forget",
+    [YPFS_OP_FORGET_MULTI] = "forget_multi",
+    [YPFS_OP_GETATTR] = "getattr",
+    [YPFS_OP_SETATTR] = "setattr",
+    [YPFS_OP_READLINK] = "readlink",
+    [YPFS_OP_MKNOD] = "mknod",
+    [YPFS_OP_MKDIR] = "mkdir",
+    [YPFS_OP_UNLINK] = "unlink",
+    [YPFS_OP_RMDIR] = "rmdir",
+    [YPFS_OP_SYMLINK] = "symlink",
+    [YPFS_OP_RENAME] = "rename",
+    [YPFS_OP_LINK] = "link",
+    [YPFS_OP_OPEN] = "open",
+    [YPFS_OP_READ] = "read",
+    [YPFS_OP_WRITE] = "write",
+    [YPFS_OP_WRITE_BUF] = "write_buf",
+    [YPFS_OP_STATFS] = "statfs",
+    [YPFS_OP_FLUSH] = "flush",
+    [YPFS_OP_RELEASE] = "release",
+    [YPFS_OP_FSYNC] = "fsync",
+    [YPFS_OP_SETXATTR] = "setxattr",
+    [YPFS_OP_GETXATTR] = "getxattr",
+    [YPFS_OP_LISTXATTR] = "listxattr",
+    [YPFS_OP_REMOVEXATTR] = "removexattr",
+    [YPFS_OP_OPENDIR] = "opendir",
+    [YPFS_OP_READDIR] = "readdir",
+    [YPFS_OP_READDIRPLUS] = "readdirplus",
+    [YPFS_OP_RELEASEDIR] = "releasedir",
+    [YPFS_OP_FSYNCDIR] = "fsyncdir",
+    [YPFS_OP_ACCESS] = "access",
+    [YPFS_OP_CREATE] = "create",
+    [YPFS_OP_COPY_FILE_RANGE] = "copy_file_range",
+    [YPFS_STAGE_INGEST] = "ingest",
+    [YPFS_STAGE_EXIF] = "ingest.exif",
+    [YPFS_STAGE_HASH] = "ingest.hash",
+    [YPFS_STAGE_MKDIR] = "ingest.mkdir",
+    [YPFS_STAGE_RENAME] = "ingest.rename",
+    [YPFS_STAGE_CATALOG] = "ingest.catalog",
+    [YPFS_STAGE_IMPORT] = "import",
+};
+
+static __thread struct trace_ring *trace_self;
+
+const char *ypfs_trace_op_name(unsigned op)
+{
+    if (op == YPFS_TRACE_DROPPED)
+	return "dropped";
+    return op < YPFS_STATS_OPS ? trace_names[op] : NULL;
+}
+
+uint64_t ypfs_trace_hash(const char *s, uint64_t seed)
+{
+    uint64_t h = 0xCBF29CE484222325ULL ^ seed;
+
+    for (; *s != '\0'; s++) {
+	h ^= (unsigned char) *s;
+	h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static void trace_thread_exit(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    __atomic_store_n(&ring->live, 0, __ATOMIC_RELEASE);
+}
+
+// This thread's ring, taking over one a thread left behind if there
+// is one
+static struct trace_ring *trace_ring(struct ypfs_trace *trace)
+{
+    struct trace_ring *ring;
+
+    pthread_mutex_lock(&trace->lock);
+    for (ring = trace->rings; ring != NULL; ring = ring->next)
+	if (!__atomic_load_n(&ring->live, __ATOMIC_ACQUIRE))
+	    break;
+    if (ring == NULL) {
+	if (posix_memalign((void **) &ring, 64, sizeof(*ring)) != 0) {
+	    pthread_mutex_unlock(&trace->lock);
+	    return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->next = trace->rings;
+	trace->rings = ring;
+    }
+    ring->live = 1;
+    ring->tid = syscall(SYS_gettid);
+    pthread_mutex_unlock(&trace->lock);
+
+    pthread_setspecific(trace->key, ring);
+    trace_self = ring;
+    return ring;
+}
+
+void ypfs_trace_add(struct ypfs_trace *trace, struct ypfs_trace_record *rec, uint64_t start,
+		    uint64_t latency)
+{
+    struct trace_ring *ring = trace_self;
+    uint64_t head;
+
+    if (trace == NULL)
+	return;
+    if (ring == NULL) {
+	ring = trace_ring(trace);
+	if (ring == NULL)
+	    return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+	__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+	return;
+    }
+    rec->time = start - trace->start;
+    rec->latency = latency;
+    rec->tid = ring->tid;
+    ring->recs[head & (TRACE_RING - 1)] = *rec;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Write out the buffer.  Only the flusher calls this.
+static void trace_write(struct ypfs_trace *trace)
+{
+    const char *p = (const char *) trace->buf;
+    size_t len = trace->buffered * sizeof(*trace->buf);
+    ssize_t n;
+
+    for (; len > 0; p += n, len -= n) {
+	n = write(trace->fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		n = 0;
+		continue;
+	    }
+	    perror("ypfs trace write");
+	    break;
+	}
+    }
+    trace->buffered = 0;
+}
+
+static void trace_put(struct ypfs_trace *trace, const struct ypfs_trace_record *rec)
+{
+    trace->buf[trace->buffered++] = *rec;
+    if (trace->buffered == TRACE_BUF)
+	trace_write(trace);
+}
+
+// Take everything there is out of every ring
+static void trace_collect(struct ypfs_trace *trace)
+{
+    struct ypfs_trace_record lost;
+    struct trace_ring *ring;
+    uint64_t head, tail;
+    uint64_t dropped;
+    struct timespec now;
+
+    pthread_mutex_lock(&trace->lock);
+    ring = trace->rings;
+    pthread_mutex_unlock(&trace->lock);
+
+    // rings are only ever added at the front, so the rest of the list
+    // stays as it is
+    for (; ring != NULL; ring = ring->next) {
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (tail = ring->tail; tail != head; tail++)
+	    trace_put(trace, &ring->recs[tail & (TRACE_RING - 1)]);
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->dropped_seen) {
+	    memset(&lost, 0, sizeof(lost));
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    lost.time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec - trace->start;
+	    lost.offset = -1;
+	    lost.size = dropped - ring->dropped_seen;
+	    lost.tid = ring->tid;
+	    lost.op = YPFS_TRACE_DROPPED;
+	    trace_put(trace, &lost);
+	    ring->dropped_seen = dropped;
+	}
+    }
+    trace_write(trace);
+}
+
+static void *trace_flusher(void *arg)
+{
+    struct ypfs_trace *trace = arg;
+    struct timespec until;
+    int stopping;
+
+    do {
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += TRACE_INTERVAL_MS * 1000000L;
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&trace->lock);
+	if (!trace->stopping)
+	    pthread_cond_timedwait(&trace->wake, &trace->lock, &until);
+	stopping = trace->stopping;
+	pthread_mutex_unlock(&trace->lock);
+
+	trace_collect(trace);
+    } while (!stopping);
+
+    return NULL;
+}
+
+// Whether relative 'path' has a ".." in it
+static int trace_climbs(const char *path)
+{
+    const char *p;
+
+    for (p = path; (p = strstr(p, "..")) != NULL; p += 2)
+	if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+	    return 1;
+    return 0;
+}
+
+struct ypfs_trace *ypfs_trace_open(int rootfd, const char *path)
+{
+    struct ypfs_trace_header header;
+    struct ypfs_trace *trace;
+    struct timespec now;
+    int dirfd;
+    int err;
+
+    trace = calloc(1, sizeof(*trace));
+    if (trace == NULL)
+	return NULL;
+    trace->fd = -1;
+    trace->buf = malloc(TRACE_BUF * sizeof(*trace->buf));
+    if (trace->buf == NULL)
+	goto fail;
+    if (path[0] == '/')
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    else if (trace_climbs(path)) {
+	errno = EINVAL;
+	goto fail;
+    } else {
+	mkdirat(rootfd, YPFS_CATALOG_DIR, S_IRWXU);
+	dirfd = openat(rootfd, YPFS_CATALOG_DIR, O_PATH | O_DIRECTORY);
+	if (dirfd < 0)
+	    goto fail;
+	trace->fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	err = errno;
+	close(dirfd);
+	errno = err;
+    }
+    if (trace->fd < 0)
+	goto fail;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, YPFS_TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct ypfs_trace_record);
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.start_sec = now.tv_sec;
+    header.start_nsec = now.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    trace->start = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    if (write(trace->fd, &header, sizeof(header)) != sizeof(header))
+	goto fail;
+
+    err = pthread_key_create(&trace->key, trace_thread_exit);
+    if (err != 0) {
+	errno = err;
+	goto fail;
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->wake, NULL);
+    err = pthread_create(&trace->flusher, NULL, trace_flusher, trace);
+    if (err != 0) {
+	pthread_key_delete(trace->key);
+	pthread_cond_destroy(&trace->wake);
+	pthread_mutex_destroy(&trace->lock);
+	errno = err;
+	goto fail;
+    }
+
+    return trace;
+
+ fail:
+    err = errno;
+    if (trace->fd >= 0)
+	close(trace->fd);
+    free(trace->buf);
+    free(trace);
+    errno = err;
+    return NULL;
+}
+
+void ypfs_trace_close(struct ypfs_trace *trace)
+{
+    struct trace_ring *ring, *next;
+
+    if (trace == NULL)
+	return;
+
+    pthread_mutex_lock(&trace->lock);
+    trace->stopping = 1;
+    pthread_cond_signal(&trace->wake);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->flusher, NULL);
+
+    pthread_key_delete(trace->key);
+    for (ring = trace->rings; ring != NULL; ring = next) {
+	next = ring->next;
+	free(ring);
+    }
+    close(trace->fd);
+    pthread_cond_destroy(&trace->wake);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->buf);
+    free(trace);
+}
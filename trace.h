@@ -0,0 +1,74 @@
+// Event trace
+//
+// With -o trace=FILE, every request and ingest stage that stats.h
+// times also leaves a fixed-size binary record in FILE (relative to
+// YPFS_CATALOG_DIR under rootdir, or absolute): what it was, on what,
+// how long it took and how it ended.  Each thread appends its records
+// to a ring of its own without locks or syscalls; a background thread
+// collects them every so often and writes them out in large
+// sequential writes.
+// When a ring is full, records are dropped rather than holding up a
+// request, and a record saying how many were lost takes their place.
+//
+// ypfstrace decodes a trace file.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define YPFS_TRACE_MAGIC "YPFSTRC1"
+
+// op of a record standing for 'size' records that were dropped
+#define YPFS_TRACE_DROPPED 0xFFFF
+
+// A trace file is this header followed by records, in the order they
+// were collected: by thread, and in time order within a thread.
+// Host byte order throughout.
+struct ypfs_trace_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t pad;
+    int64_t start_sec;			// CLOCK_REALTIME when the trace started
+    int64_t start_nsec;
+};
+
+struct ypfs_trace_record {
+    uint64_t time;			// ns since the start, when the op began
+    uint64_t latency;			// ns
+    uint64_t ino;			// the kernel's inode or parent, or 0
+    uint64_t fh;			// file handle, or 0
+    uint64_t path;			// ypfs_trace_hash() of the name or path, or 0
+    int64_t offset;			// -1 if none
+    uint64_t size;			// bytes moved, else asked for
+    uint32_t tid;
+    uint16_t op;			// enum ypfs_stats_op
+    uint16_t err;			// errno, or 0
+};
+
+struct ypfs_trace;
+
+// Start tracing into 'path', relative to YPFS_CATALOG_DIR under
+// 'rootfd' unless absolute.  A relative path that climbs out of there
+// is refused with EINVAL: rootdir's top level is the inbox, where
+// ingest would sort the trace into /Dates while it is being written.
+// Returns NULL with errno set on failure.
+struct ypfs_trace *ypfs_trace_open(int rootfd, const char *path);
+
+// Write out whatever is still in the rings and stop
+void ypfs_trace_close(struct ypfs_trace *trace);
+
+// Append 'rec' for an op that began at 'start' (CLOCK_MONOTONIC ns)
+// and took 'latency'.  Fills in time, latency and tid.  A NULL trace
+// does nothing.
+void ypfs_trace_add(struct ypfs_trace *trace, struct ypfs_trace_record *rec, uint64_t start,
+		    uint64_t latency);
+
+// FNV-1a of 's', starting from 'seed' (0 for a path, the parent's
+// inode for a name)
+uint64_t ypfs_trace_hash(const char *s, uint64_t seed);
+
+// Name of op 'op', or NULL
+const char *ypfs_trace_op_name(unsigned op);
+
+#endif
@@ -0,0 +1,720 @@
+/*
+  io_uring backend
+
+  Straight on the syscalls and <linux/io_uring.h>, so there is no
+  liburing to build against.  Each call fills in an SQE under the
+  ring's lock and wakes the submitter thread, which hands everything
+  queued by then to the kernel in one io_uring_enter().  Callers wait
+  on a semaphore of their own, whose address is the SQE's user_data;
+  the reaper thread posts the result to it.  No more than the SQ's
+  size of requests are ever in flight at once, so neither ring can
+  overflow.
+
+  Only the submitter submits, because the kernel ties a request to
+  the task that submitted it, and cancels it when that task exits.
+  FUSE retires idle workers, and scan and import threads come and go,
+  so none of them may submit a request that another is waiting on.
+  If io_uring_enter() fails outright, what it didn't take is taken
+  back out of the SQ and failed with its error, and the ring is not
+  used again.
+
+  Which ops the kernel has is asked with IORING_REGISTER_PROBE; those
+  it hasn't are made as plain syscalls.  Registering the buffers or the
+  file table can fail (older kernels charge buffers to RLIMIT_MEMLOCK),
+  which just leaves the ring without them.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+struct ypfs_uring {
+    int fd;
+
+    // submission ring, and the SQE array it indexes
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_len;
+    void *cq_map;
+    size_t cq_len;
+    size_t sqes_len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t space;
+    pthread_cond_t queued;
+    unsigned inflight;		// queued or submitted, not yet reaped
+    unsigned pending;		// queued, not yet submitted
+    int stopping;
+    int broken;			// io_uring_enter() failed; plain syscalls
+    int nop_lost;		// ypfs_uring_free()'s NOP was failed instead
+    int timed;			// waits can time out (IORING_FEAT_EXT_ARG)
+    pthread_t submitter;
+    pthread_t reaper;
+
+    unsigned char ops[IORING_OP_LAST];	// the kernel has this op
+
+    // sparse fixed file table, and the slots free in it
+    int *free_slots;
+    unsigned nfree_slots;
+
+    // registered buffers, and those free
+    char *bufs;
+    int free_bufs[YPFS_URING_BUFS];
+    unsigned nfree_bufs;
+};
+
+struct uring_wait {
+    sem_t done;
+    int res;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Wait for a completion, for up to 'secs' if the kernel can time out
+// a wait
+static int uring_wait_cqe(struct ypfs_uring *ring, long secs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    if (!ring->timed)
+	return uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = secs;
+    ts.tv_nsec = 0;
+    arg.ts = (uintptr_t) &ts;
+    return syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+		   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_has(struct ypfs_uring *ring, int op)
+{
+    return ring != NULL && ring->ops[op] && !__atomic_load_n(&ring->broken, __ATOMIC_RELAXED);
+}
+
+// Whether io_uring_enter() failing with 'err' is worth trying again
+static int uring_retry(int err)
+{
+    return err == EINTR || err == EAGAIN || err == EBUSY;
+}
+
+// Put 'sqe' on the SQ for the submitter.  Called with ring->lock held.
+static void uring_push(struct ypfs_uring *ring, const struct io_uring_sqe *sqe)
+{
+    unsigned tail, index;
+
+    while (ring->inflight == ring->sq_entries)
+	pthread_cond_wait(&ring->space, &ring->lock);
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    ring->sqes[index] = *sqe;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    ring->inflight++;
+    pthread_cond_signal(&ring->queued);
+}
+
+static void uring_queue(struct ypfs_uring *ring, const struct io_uring_sqe *sqe)
+{
+    pthread_mutex_lock(&ring->lock);
+    uring_push(ring, sqe);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Take what the kernel hasn't out of the SQ again, and fail it with
+// 'err'.  Called with ring->lock held, by the submitter.
+static void uring_fail(struct ypfs_uring *ring, int err)
+{
+    struct io_uring_sqe *sqe;
+    struct uring_wait *wait;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    for (; head != tail; head++) {
+	sqe = &ring->sqes[ring->sq_array[head & *ring->sq_mask]];
+	wait = (struct uring_wait *) (uintptr_t) sqe->user_data;
+	if (wait != NULL) {
+	    wait->res = err;
+	    sem_post(&wait->done);
+	} else
+	    ring->nop_lost = 1;
+	ring->inflight--;
+    }
+    ring->pending = 0;
+    __atomic_store_n(&ring->broken, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&ring->space);
+}
+
+static void *uring_submitter(void *arg)
+{
+    struct ypfs_uring *ring = arg;
+    unsigned n;
+    int ret, err;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+	while (ring->pending == 0 && !ring->stopping)
+	    pthread_cond_wait(&ring->queued, &ring->lock);
+	if (ring->pending == 0)
+	    break;
+
+	// whatever else is queued while we're in there goes next time
+	n = ring->pending;
+	pthread_mutex_unlock(&ring->lock);
+	ret = uring_enter(ring->fd, n, 0, 0);
+	err = errno;
+	pthread_mutex_lock(&ring->lock);
+	if (ret > 0)
+	    ring->pending -= ret;
+	else if (ret < 0 && !uring_retry(err))
+	    uring_fail(ring, -err);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+// Queue 'sqe' and wait for its result
+static int uring_call(struct ypfs_uring *ring, struct io_uring_sqe *sqe)
+{
+    struct uring_wait wait;
+
+    sem_init(&wait.done, 0, 0);
+    sqe->user_data = (uintptr_t) &wait;
+    uring_queue(ring, sqe);
+    while (sem_wait(&wait.done) < 0 && errno == EINTR)
+	;
+    sem_destroy(&wait.done);
+
+    return wait.res;
+}
+
+static void *uring_reaper(void *arg)
+{
+    struct ypfs_uring *ring = arg;
+    struct io_uring_cqe *cqe;
+    struct uring_wait *wait;
+    unsigned head, tail, n;
+    int done = 0;
+    int err;
+
+    while (!done) {
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+	    // Timed, so that we notice being stopped with nothing left
+	    // to come, as when the ring broke and ypfs_uring_free()'s NOP
+	    // never got to the kernel
+	    if (uring_wait_cqe(ring, 1) < 0 && !uring_retry(err = errno)) {
+		pthread_mutex_lock(&ring->lock);
+		done = ring->stopping && ring->inflight == 0;
+		pthread_mutex_unlock(&ring->lock);
+		// there's no waiting on a ring like that; just see it out
+		if (!done && err != ETIME)
+		    sched_yield();
+	    }
+	    continue;
+	}
+
+	for (n = 0; head != tail; head++, n++) {
+	    cqe = &ring->cqes[head & *ring->cq_mask];
+	    wait = (struct uring_wait *) (uintptr_t) cqe->user_data;
+	    // ypfs_uring_free()'s NOP has nobody waiting
+	    if (wait == NULL)
+		continue;
+	    // the waiter may be gone as soon as it's posted
+	    wait->res = cqe->res;
+	    sem_post(&wait->done);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ring->lock);
+	ring->inflight -= n;
+	pthread_cond_broadcast(&ring->space);
+	done = ring->stopping && ring->inflight == 0;
+	pthread_mutex_unlock(&ring->lock);
+    }
+
+    return NULL;
+}
+
+static void uring_probe(struct ypfs_uring *ring)
+{
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int i;
+
+    probe = calloc(1, len);
+    if (probe == NULL)
+	return;
+    if (uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+	for (i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+	    if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+		ring->ops[i] = 1;
+    free(probe);
+}
+
+// The file table and buffers, if the kernel will have them
+static void uring_register_extras(struct ypfs_uring *ring)
+{
+    struct iovec iov[YPFS_URING_BUFS];
+    int *fds;
+    int i;
+
+    fds = malloc(YPFS_URING_FILES * sizeof(int));
+    ring->free_slots = malloc(YPFS_URING_FILES * sizeof(int));
+    if (fds != NULL && ring->free_slots != NULL) {
+	for (i = 0; i < YPFS_URING_FILES; i++)
+	    fds[i] = -1;
+	if (uring_register(ring->fd, IORING_REGISTER_FILES, fds, YPFS_URING_FILES) == 0)
+	    for (i = YPFS_URING_FILES - 1; i >= 0; i--)
+		ring->free_slots[ring->nfree_slots++] = i;
+    }
+    free(fds);
+
+    ring->bufs = mmap(NULL, YPFS_URING_BUFS * YPFS_URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+	ring->bufs = NULL;
+	return;
+    }
+    for (i = 0; i < YPFS_URING_BUFS; i++) {
+	iov[i].iov_base = ring->bufs + (size_t) i * YPFS_URING_BUF_SIZE;
+	iov[i].iov_len = YPFS_URING_BUF_SIZE;
+    }
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, YPFS_URING_BUFS) < 0) {
+	munmap(ring->bufs, YPFS_URING_BUFS * YPFS_URING_BUF_SIZE);
+	ring->bufs = NULL;
+	return;
+    }
+    for (i = YPFS_URING_BUFS - 1; i >= 0; i--)
+	ring->free_bufs[ring->nfree_bufs++] = i;
+}
+
+static void uring_unmap(struct ypfs_uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+	munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+	munmap(ring->cq_map, ring->cq_len);
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+	munmap(ring->sq_map, ring->sq_len);
+}
+
+struct ypfs_uring *ypfs_uring_new(unsigned entries)
+{
+    struct io_uring_params p;
+    struct ypfs_uring *ring;
+    char *sq, *cq;
+    int err;
+
+    if (entries == 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+	return NULL;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = uring_setup(entries, &p);
+    if (ring->fd < 0) {
+	err = errno;
+	free(ring);
+	errno = err;
+	return NULL;
+    }
+
+    ring->timed = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_len > ring->sq_len)
+	    ring->sq_len = ring->cq_len;
+	ring->cq_len = ring->sq_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_map = ring->sq_map;
+    else {
+	ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_map == MAP_FAILED)
+	    goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+	goto fail;
+
+    sq = ring->sq_map;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    cq = ring->cq_map;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    uring_probe(ring);
+    uring_register_extras(ring);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->space, NULL);
+    pthread_cond_init(&ring->queued, NULL);
+    err = pthread_create(&ring->submitter, NULL, uring_submitter, ring);
+    if (err == 0) {
+	err = pthread_create(&ring->reaper, NULL, uring_reaper, ring);
+	if (err != 0) {
+	    pthread_mutex_lock(&ring->lock);
+	    ring->stopping = 1;
+	    pthread_cond_signal(&ring->queued);
+	    pthread_mutex_unlock(&ring->lock);
+	    pthread_join(ring->submitter, NULL);
+	}
+    }
+    if (err != 0) {
+	pthread_cond_destroy(&ring->queued);
+	pthread_cond_destroy(&ring->space);
+	pthread_mutex_destroy(&ring->lock);
+	errno = err;
+	goto fail;
+    }
+
+    return ring;
+
+ fail:
+    err = errno;
+    uring_unmap(ring);
+    if (ring->bufs != NULL)
+	munmap(ring->bufs, YPFS_URING_BUFS * YPFS_URING_BUF_SIZE);
+    free(ring->free_slots);
+    close(ring->fd);
+    free(ring);
+    errno = err;
+    return NULL;
+}
+
+void ypfs_uring_free(struct ypfs_uring *ring)
+{
+    struct io_uring_sqe sqe;
+    int ret, err;
+
+    if (ring == NULL)
+	return;
+
+    // the submitter quits once it has submitted everything, and a
+    // NOP with no waiter wakes the reaper to quit once it has reaped
+    // everything
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    pthread_mutex_lock(&ring->lock);
+    uring_push(ring, &sqe);
+    ring->stopping = 1;
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->submitter, NULL);
+
+    // If the ring broke, the submitter may have failed the NOP, and
+    // the reaper would wait for it until its wait times out, or on a
+    // kernel without timed waits, forever.  Submit it again, here;
+    // nobody else submits now.
+    pthread_mutex_lock(&ring->lock);
+    if (ring->nop_lost) {
+	ring->nop_lost = 0;
+	uring_push(ring, &sqe);
+	pthread_mutex_unlock(&ring->lock);
+	while ((ret = uring_enter(ring->fd, 1, 0, 0)) < 0 && uring_retry(errno))
+	    ;
+	err = errno;
+	pthread_mutex_lock(&ring->lock);
+	if (ret > 0)
+	    ring->pending = 0;
+	else
+	    uring_fail(ring, ret < 0 ? -err : -EIO);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->reaper, NULL);
+
+    pthread_cond_destroy(&ring->queued);
+    pthread_cond_destroy(&ring->space);
+    pthread_mutex_destroy(&ring->lock);
+    // closing the ring unregisters the files and buffers
+    uring_unmap(ring);
+    close(ring->fd);
+    if (ring->bufs != NULL)
+	munmap(ring->bufs, YPFS_URING_BUFS * YPFS_URING_BUF_SIZE);
+    free(ring->free_slots);
+    free(ring);
+}
+
+// An SQE for 'op' on 'fd', or on fixed file 'slot' if there is one
+static void uring_prep(struct io_uring_sqe *sqe, int op, int fd, int slot, const void *addr,
+		       unsigned len, uint64_t off)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    if (slot >= 0) {
+	sqe->fd = slot;
+	sqe->flags = IOSQE_FIXED_FILE;
+    } else
+	sqe->fd = fd;
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+ssize_t ypfs_uring_pread(struct ypfs_uring *ring, int fd, int slot, void *buf, size_t len,
+			 off_t offset, int buf_index)
+{
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+
+    if (buf_index >= 0 && uring_has(ring, IORING_OP_READ_FIXED)) {
+	uring_prep(&sqe, IORING_OP_READ_FIXED, fd, slot, buf, len, offset);
+	sqe.buf_index = buf_index;
+	return uring_call(ring, &sqe);
+    }
+    if (uring_has(ring, IORING_OP_READ)) {
+	uring_prep(&sqe, IORING_OP_READ, fd, slot, buf, len, offset);
+	return uring_call(ring, &sqe);
+    }
+
+    ret = pread(fd, buf, len, offset);
+    return ret < 0 ? -errno : ret;
+}
+
+ssize_t ypfs_uring_pwrite(struct ypfs_uring *ring, int fd, int slot, const void *buf, size_t len,
+			  off_t offset)
+{
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+
+    if (uring_has(ring, IORING_OP_WRITE)) {
+	uring_prep(&sqe, IORING_OP_WRITE, fd, slot, buf, len, offset);
+	return uring_call(ring, &sqe);
+    }
+
+    ret = pwrite(fd, buf, len, offset);
+    return ret < 0 ? -errno : ret;
+}
+
+int ypfs_uring_fsync(struct ypfs_uring *ring, int fd, int slot, int datasync)
+{
+    struct io_uring_sqe sqe;
+    int ret;
+
+    if (uring_has(ring, IORING_OP_FSYNC)) {
+	uring_prep(&sqe, IORING_OP_FSYNC, fd, slot, NULL, 0, 0);
+	if (datasync)
+	    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+	return uring_call(ring, &sqe);
+    }
+
+    ret = datasync ? fdatasync(fd) : fsync(fd);
+    return ret < 0 ? -errno : 0;
+}
+
+int ypfs_uring_fstatat(struct ypfs_uring *ring, int dirfd, const char *path, struct stat *st,
+		       int flags)
+{
+    struct io_uring_sqe sqe;
+    struct statx stx;
+    int ret;
+
+    if (!uring_has(ring, IORING_OP_STATX))
+	return fstatat(dirfd, path, st, flags) < 0 ? -errno : 0;
+
+    uring_prep(&sqe, IORING_OP_STATX, dirfd, -1, path, STATX_BASIC_STATS, (uintptr_t) &stx);
+    sqe.statx_flags = flags;
+    ret = uring_call(ring, &sqe);
+    if (ret < 0)
+	return ret;
+
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+    return 0;
+}
+
+int ypfs_uring_openat(struct ypfs_uring *ring, int dirfd, const char *path, int flags,
+		      mode_t mode)
+{
+    struct io_uring_sqe sqe;
+    int fd;
+
+    if (uring_has(ring, IORING_OP_OPENAT)) {
+	uring_prep(&sqe, IORING_OP_OPENAT, dirfd, -1, path, mode, 0);
+	sqe.open_flags = flags;
+	return uring_call(ring, &sqe);
+    }
+
+    fd = openat(dirfd, path, flags, mode);
+    return fd < 0 ? -errno : fd;
+}
+
+int ypfs_uring_mkdirat(struct ypfs_uring *ring, int dirfd, const char *path, mode_t mode)
+{
+    struct io_uring_sqe sqe;
+
+    if (uring_has(ring, IORING_OP_MKDIRAT)) {
+	uring_prep(&sqe, IORING_OP_MKDIRAT, dirfd, -1, path, mode, 0);
+	return uring_call(ring, &sqe);
+    }
+
+    return mkdirat(dirfd, path, mode) < 0 ? -errno : 0;
+}
+
+int ypfs_uring_renameat2(struct ypfs_uring *ring, int olddirfd, const char *oldpath,
+			 int newdirfd, const char *newpath, unsigned flags)
+{
+    struct io_uring_sqe sqe;
+
+    if (uring_has(ring, IORING_OP_RENAMEAT)) {
+	uring_prep(&sqe, IORING_OP_RENAMEAT, olddirfd, -1, oldpath, newdirfd,
+		   (uintptr_t) newpath);
+	sqe.rename_flags = flags;
+	return uring_call(ring, &sqe);
+    }
+
+    return syscall(SYS_renameat2, olddirfd, oldpath, newdirfd, newpath, flags) < 0 ? -errno : 0;
+}
+
+// Point 'slot' of the file table at 'fd', or -1 for nothing
+static int uring_update_slot(struct ypfs_uring *ring, int slot, int fd)
+{
+    struct io_uring_files_update up;
+
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uintptr_t) &fd;
+    return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+int ypfs_uring_register(struct ypfs_uring *ring, int fd)
+{
+    int slot;
+
+    if (ring == NULL)
+	return -1;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->nfree_slots == 0) {
+	pthread_mutex_unlock(&ring->lock);
+	return -1;
+    }
+    slot = ring->free_slots[--ring->nfree_slots];
+    pthread_mutex_unlock(&ring->lock);
+
+    if (uring_update_slot(ring, slot, fd) < 0) {
+	pthread_mutex_lock(&ring->lock);
+	ring->free_slots[ring->nfree_slots++] = slot;
+	pthread_mutex_unlock(&ring->lock);
+	return -1;
+    }
+
+    return slot;
+}
+
+void ypfs_uring_unregister(struct ypfs_uring *ring, int slot)
+{
+    if (ring == NULL || slot < 0)
+	return;
+
+    uring_update_slot(ring, slot, -1);
+    pthread_mutex_lock(&ring->lock);
+    ring->free_slots[ring->nfree_slots++] = slot;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void *ypfs_uring_buf_get(struct ypfs_uring *ring, size_t len, int *index)
+{
+    void *buf = NULL;
+
+    if (ring == NULL || len > YPFS_URING_BUF_SIZE || !ring->ops[IORING_OP_READ_FIXED])
+	return NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->nfree_bufs > 0) {
+	*index = ring->free_bufs[--ring->nfree_bufs];
+	buf = ring->bufs + (size_t) *index * YPFS_URING_BUF_SIZE;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return buf;
+}
+
+void ypfs_uring_buf_put(struct ypfs_uring *ring, int index)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->free_bufs[ring->nfree_bufs++] = index;
+    pthread_mutex_unlock(&ring->lock);
+}
@@ -0,0 +1,75 @@
+// io_uring backend
+//
+// With -o uring=N, the data calls of read (with copy_io), write and
+// fsync, and the metadata calls of ingest, go through one io_uring
+// of N entries instead of being made one syscall per request.  The
+// calling thread still waits for its own result, but requests from
+// all threads are handed to the kernel together: a submitter thread,
+// which lives as long as the ring, submits everything queued so far
+// in one io_uring_enter(), and a reaper thread reaps completions and
+// wakes the callers.  What blocks, like a read from a cold disk, the
+// kernel carries on with in its own workers, so more of it can be in
+// flight than there are threads.
+//
+// Busy handles register their fd as a fixed file, which saves the
+// kernel looking it up on every request, and reads with copy_io go
+// into YPFS_URING_BUFS registered buffers while there are any free,
+// which saves it mapping the pages.
+//
+// Every call takes a NULL ring, and falls back to the plain syscall
+// for an op the kernel's io_uring doesn't have, so callers needn't
+// care whether there is a ring.  Results are as from the syscall,
+// with -errno for failure.
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define YPFS_URING_BUFS 32
+#define YPFS_URING_BUF_SIZE (128 * 1024)
+#define YPFS_URING_FILES 1024
+
+// requests a handle makes before its fd is made a fixed file
+#define YPFS_URING_HOT 16
+
+struct ypfs_uring;
+
+// A ring of 'entries' and its submitter and reaper threads.  Returns
+// NULL with errno set if the kernel has no io_uring or won't give us
+// one.
+struct ypfs_uring *ypfs_uring_new(unsigned entries);
+
+// Wait for what is in flight and tear the ring down
+void ypfs_uring_free(struct ypfs_uring *ring);
+
+// 'slot' is from ypfs_uring_register(), or -1 to use 'fd'.  For
+// pread, 'buf_index' is from ypfs_uring_buf_get(), or -1.
+ssize_t ypfs_uring_pread(struct ypfs_uring *ring, int fd, int slot, void *buf, size_t len,
+			 off_t offset, int buf_index);
+ssize_t ypfs_uring_pwrite(struct ypfs_uring *ring, int fd, int slot, const void *buf, size_t len,
+			  off_t offset);
+int ypfs_uring_fsync(struct ypfs_uring *ring, int fd, int slot, int datasync);
+
+// fstatat() by way of statx
+int ypfs_uring_fstatat(struct ypfs_uring *ring, int dirfd, const char *path, struct stat *st,
+		       int flags);
+int ypfs_uring_openat(struct ypfs_uring *ring, int dirfd, const char *path, int flags,
+		      mode_t mode);
+int ypfs_uring_mkdirat(struct ypfs_uring *ring, int dirfd, const char *path, mode_t mode);
+int ypfs_uring_renameat2(struct ypfs_uring *ring, int olddirfd, const char *oldpath,
+			 int newdirfd, const char *newpath, unsigned flags);
+
+// Make 'fd' a fixed file until ypfs_uring_unregister(), and return
+// its slot, or -1 if there is no ring or no slot free
+int ypfs_uring_register(struct ypfs_uring *ring, int fd);
+void ypfs_uring_unregister(struct ypfs_uring *ring, int slot);
+
+// A free registered buffer of at least 'len' bytes, and its index in
+// '*index', or NULL if there is none
+void *ypfs_uring_buf_get(struct ypfs_uring *ring, size_t len, int *index);
+void ypfs_uring_buf_put(struct ypfs_uring *ring, int index);
+
+#endif
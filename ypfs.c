@@ -12,7 +12,12 @@
   underlying filesystem.  The information is saved in a logfile named
   bbfs.log, in the directory from which you run bbfs.
 
-  gcc -Wall `pkg-config fuse --cflags --libs` -o bbfs bbfs.c
+  ypfs talks to the kernel through the low-level libfuse 3 API: the
+  kernel names files by inode number rather than by path, and each
+  inode number maps straight to an O_PATH fd for the backing file
+  (see inode.h), so nothing here depends on how deep a file sits.
+
+  gcc -Wall `pkg-config fuse3 --cflags --libs` -o ypfs ypfs.c ...
 */
 
 #include "params.h"
@@ -21,21 +26,282 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 
-#include <libexif/exif-data.h>
-#include <libexif/exif-tag.h>
+#include "attrcache.h"
+#include "catalog.h"
+#include "dedup.h"
+#include "dircache.h"
+#include "exifdate.h"
+#include "import.h"
+#include "ingest.h"
+#include "inode.h"
+#include "prefetch.h"
+#include "scan.h"
+#include "stats.h"
+#include "thumbcache.h"
+#include "trace.h"
+#include "uring.h"
+
+int __mkdir(struct ypfs_state *, const char *);
+int _mkdir(struct ypfs_state *, const char *, mode_t);
+
+// What fi->fh points to for an open file
+struct ypfs_file {
+    int fd;
+    struct ypfs_inode *inode;	// the kernel keeps it alive while open
+    int changed;		// created, truncated or written through this
+    struct ypfs_thumb *thumb;	// for a thumbnail, read instead of fd
+    char *snapshot;		// for /.ypfs/stats, likewise
+    size_t snapshot_len;
+
+    // capture date and content hash, picked out of the data as it
+    // is written
+    pthread_mutex_t stream_lock;
+    struct ypfs_exif_sniff sniff;
+    struct ypfs_hasher hash;
+
+    // write-behind, see ypfs_wb_write(): 'wb_len' bytes for 'wb_off'
+    // not written to fd yet.  'wb_cap' is 0 for a handle that writes
+    // straight through.  'wb_err' is the first error writing it out
+    // that flush or fsync hasn't reported yet, and 'wb_lost' stays set
+    // once any was dropped.
+    pthread_mutex_t wb_lock;
+    char *wb;
+    size_t wb_len;
+    size_t wb_cap;
+    off_t wb_off;
+    int wb_err;
+    int wb_lost;
+
+    // where reads have been going, see prefetch.h
+    struct ypfs_readahead ra;
+
+    // the ring requests on fd go through, and fd's fixed file slot
+    // there once it has had YPFS_URING_HOT of them, see uring.h
+    struct ypfs_uring *ring;
+    int slot;
+    unsigned ios;
+};
+#define YPFS_FILE(fi) ((struct ypfs_file *) (uintptr_t) (fi)->fh)
+
+// What fi->fh points to for an open directory.  Entries are read
+// with getdents64 into 'buf', where 'pos' is the first one not yet
+// returned; 'offset' is the cookie of the last one that was.
+struct ypfs_dir {
+    int fd;
+    off_t offset;
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+#define YPFS_DIR(fi) ((struct ypfs_dir *) (uintptr_t) (fi)->fh)
+#define YPFS_DIR_BUF 32768
+
+// What getdents64 fills the buffer with
+struct ypfs_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Wrap a freshly opened backing fd in a handle for fi->fh.  An empty
+// file in the inbox opened for writing is hashed as it is written,
+// for ingest.
+static int ypfs_file_new(fuse_req_t req, struct ypfs_inode *inode, int fd,
+			 struct fuse_file_info *fi)
+{
+    struct ypfs_file *file;
+    struct stat statbuf;
+
+    file = malloc(sizeof(*file));
+    if (file == NULL)
+	return -ENOMEM;
+    file->fd = fd;
+    file->inode = inode;
+    file->changed = (fi->flags & O_TRUNC) != 0;
+    file->thumb = NULL;
+    file->snapshot = NULL;
+    __atomic_add_fetch(&inode->opens, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&file->stream_lock, NULL);
+    pthread_mutex_init(&file->wb_lock, NULL);
+    ypfs_readahead_init(&file->ra);
+    file->ring = YPFS_DATA(req)->uring;
+    file->slot = -1;
+    file->ios = 0;
+    file->wb = NULL;
+    file->wb_len = 0;
+    file->wb_off = 0;
+    file->wb_err = 0;
+    file->wb_lost = 0;
+    // appends go where the kernel thinks the end is, which buffered
+    // data would leave behind
+    file->wb_cap = 0;
+    if (fd >= 0 && (fi->flags & O_ACCMODE) != O_RDONLY && !(fi->flags & O_APPEND))
+	file->wb_cap = (size_t) YPFS_DATA(req)->write_buffer << 10;
+    ypfs_exif_sniff_init(&file->sniff);
+    memset(&file->hash, 0, sizeof(file->hash));
+    if (YPFS_DATA(req)->dedup != NULL && (fi->flags & O_ACCMODE) != O_RDONLY
+	&& inode->parent == ypfs_inode_get(YPFS_DATA(req)->inodes, FUSE_ROOT_ID)
+	&& fstat(fd, &statbuf) == 0 && statbuf.st_size == 0)
+	ypfs_hasher_start(&file->hash, __atomic_load_n(&inode->truncs, __ATOMIC_RELAXED),
+			  __atomic_load_n(&inode->writes, __ATOMIC_RELAXED));
+
+    fi->fh = (uintptr_t) file;
+
+    return 0;
+}
+
+static void ypfs_file_free(struct ypfs_file *file)
+{
+    __atomic_sub_fetch(&file->inode->opens, 1, __ATOMIC_RELAXED);
+    ypfs_exif_sniff_free(&file->sniff);
+    ypfs_hasher_free(&file->hash);
+    ypfs_thumb_put(file->thumb);
+    free(file->snapshot);
+    free(file->wb);
+    pthread_mutex_destroy(&file->wb_lock);
+    pthread_mutex_destroy(&file->stream_lock);
+    ypfs_readahead_destroy(&file->ra);
+    ypfs_uring_unregister(file->ring, file->slot);
+    free(file);
+}
+
+// The fixed file slot for a request on 'file', or -1 for its fd.  The
+// request that makes it busy enough registers it.
+static int ypfs_file_slot(struct ypfs_file *file)
+{
+    int slot;
+
+    if (file->ring == NULL || file->fd < 0)
+	return -1;
+    slot = __atomic_load_n(&file->slot, __ATOMIC_ACQUIRE);
+    if (slot < 0 && __atomic_add_fetch(&file->ios, 1, __ATOMIC_RELAXED) == YPFS_URING_HOT) {
+	slot = ypfs_uring_register(file->ring, file->fd);
+	__atomic_store_n(&file->slot, slot, __ATOMIC_RELEASE);
+    }
+    return slot;
+}
+
+// Write out whatever 'file' has gathered.  Called with wb_lock held.
+// Returns 0 or -errno; the data is dropped either way, as the page
+// cache drops pages it couldn't write back, and like the kernel's
+// writeback errors, the error is kept for the next flush or fsync.
+static int ypfs_wb_drain(struct ypfs_file *file)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < file->wb_len; done += n) {
+	n = ypfs_uring_pwrite(file->ring, file->fd, ypfs_file_slot(file), file->wb + done,
+			      file->wb_len - done, file->wb_off + done);
+	if (n < 0) {
+	    if (n == -EINTR) {
+		n = 0;
+		continue;
+	    }
+	    file->wb_len = 0;
+	    if (file->wb_err == 0)
+		file->wb_err = n;
+	    file->wb_lost = 1;
+	    return n;
+	}
+    }
+    file->wb_len = 0;
+    return 0;
+}
+
+// Write out what 'file' has gathered, for a flush, fsync, read or
+// the like.  Returns 0 or -errno.
+static int ypfs_wb_flush(struct ypfs_file *file)
+{
+    int retstat;
+
+    if (file->wb_cap == 0)
+	return 0;
+    pthread_mutex_lock(&file->wb_lock);
+    retstat = ypfs_wb_drain(file);
+    pthread_mutex_unlock(&file->wb_lock);
 
-int __mkdir(const char *);
-int _mkdir(const char *, mode_t);
+    return retstat;
+}
+
+// ypfs_wb_flush() for flush and fsync, which also report an error
+// that an earlier drain ran into, whoever it was reported to then
+static int ypfs_wb_sync(struct ypfs_file *file)
+{
+    int retstat;
+
+    if (file->wb_cap == 0)
+	return 0;
+    pthread_mutex_lock(&file->wb_lock);
+    ypfs_wb_drain(file);
+    retstat = file->wb_err;
+    file->wb_err = 0;
+    pthread_mutex_unlock(&file->wb_lock);
+
+    return retstat;
+}
+
+// Gather a write of 'size' bytes at 'offset' into the handle's
+// buffer if it carries on from what is there, writing the buffer out
+// when it fills or the writes jump elsewhere.  Card dumps and copies
+// in are written front to back in requests of max_write at most, so
+// this turns them into a pwrite() per write_buffer.  Returns 1 if
+// the data was taken, 0 if the caller should write it itself, or
+// -errno if writing out what was gathered before failed; as with
+// write-back, the error goes to whichever request finds it.
+static int ypfs_wb_write(struct ypfs_file *file, const char *buf, size_t size, off_t offset)
+{
+    int retstat = 0;
+
+    if (file->wb_cap == 0)
+	return 0;
+
+    pthread_mutex_lock(&file->wb_lock);
+    if (file->wb_len > 0
+	&& (offset != file->wb_off + file->wb_len || file->wb_len + size > file->wb_cap))
+	retstat = ypfs_wb_drain(file);
+    if (retstat < 0 || size >= file->wb_cap)
+	goto out;
+
+    if (file->wb == NULL) {
+	file->wb = malloc(file->wb_cap);
+	if (file->wb == NULL)
+	    goto out;
+    }
+    if (file->wb_len == 0)
+	file->wb_off = offset;
+    memcpy(file->wb + file->wb_len, buf, size);
+    file->wb_len += size;
+    retstat = 1;
+    if (file->wb_len == file->wb_cap) {
+	retstat = ypfs_wb_drain(file);
+	if (retstat == 0)
+	    retstat = 1;
+    }
+
+ out:
+    pthread_mutex_unlock(&file->wb_lock);
+    return retstat;
+}
 
 // Report errors to logfile and give -errno to caller
 int ypfs_error(char *str)
@@ -46,88 +312,599 @@ int ypfs_error(char *str)
     return ret;
 }
 
-//  All the paths I see are relative to the root of the mounted
-//  filesystem.  In order to get to the underlying filesystem, I need to
-//  have the mountpoint.  I'll save it away early on in main(), and then
-//  whenever I need a path for something I'll call this to construct
-//  it.
-void ypfs_fullpath(char fpath[PATH_MAX], const char *path)
+// Every error reply goes through here, so the stats can count it
+static void ypfs_reply_err(fuse_req_t req, int err)
+{
+    ypfs_stats_error(err);
+    fuse_reply_err(req, err);
+}
+
+//  Paths still matter to ingest and the directory cache, which deal
+//  in fs-relative paths like "/Dates/2010/03/14".  The underlying
+//  directory is opened once in ypfs_init() and kept as
+//  YPFS_DATA->rootfd, and those paths are reached with the *at()
+//  calls relative to it.  This turns such a path into the relative
+//  form those calls want.
+const char *ypfs_relpath(const char *path)
+{
+    while (*path == '/')
+	path++;
+    return *path ? path : ".";
+}
+
+static struct ypfs_inode *ypfs_inode(fuse_req_t req, fuse_ino_t ino)
+{
+    return ypfs_inode_get(YPFS_DATA(req)->inodes, ino);
+}
+
+// Most calls that don't take a directory fd can still reach an O_PATH
+// fd's file through its /proc/self/fd link
+static void ypfs_procpath(char procpath[64], int fd)
+{
+    snprintf(procpath, 64, "/proc/self/fd/%d", fd);
+}
+
+// How long names and attributes of 'inode' may be cached, by the
+// kernel and by us
+static double ypfs_timeout(struct ypfs_state *state, struct ypfs_inode *inode)
+{
+    return inode->archive ? state->archive_timeout : state->inbox_timeout;
+}
+
+// Forget our cached attributes for 'inode', which we just changed
+static void ypfs_invalidate(fuse_req_t req, struct ypfs_inode *inode)
+{
+    ypfs_attrcache_invalidate(YPFS_DATA(req)->attrs, inode->dev, inode->ino);
+}
+
+// ... or for whatever 'name' in directory 'parent' is
+static void ypfs_invalidate_name(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ypfs_attrcache_invalidate_at(YPFS_DATA(req)->attrs, ypfs_inode(req, parent)->fd, name);
+}
+
+// A notice waiting for the notifier thread, see ypfs_notify()
+struct ypfs_notice {
+    struct ypfs_notice *next;
+    struct stat gone;
+    int has_gone;
+    char path[];
+};
+
+struct ypfs_notifier {
+    struct ypfs_state *state;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct ypfs_notice *head;
+    struct ypfs_notice **tail;
+    int stopping;
+    pthread_t thread;
+};
+
+// Send the notices for ypfs_notify(), on the notifier thread
+static void ypfs_notify_now(struct ypfs_state *state, const char *path, const struct stat *gone)
+{
+    const char *slash = strrchr(path, '/');
+    const char *name;
+    char dir[PATH_MAX];
+    struct stat statbuf;
+    fuse_ino_t parent;
+    fuse_ino_t child = 0;
+
+    if (state->se == NULL || slash == NULL || slash - path >= sizeof(dir))
+	return;
+    name = slash + 1;
+
+    if (slash == path)
+	parent = FUSE_ROOT_ID;
+    else {
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = '\0';
+	if (fstatat(state->rootfd, ypfs_relpath(dir), &statbuf, 0) < 0)
+	    return;
+	// nothing is cached for a directory the kernel hasn't seen
+	parent = ypfs_inode_id(state->inodes, statbuf.st_dev, statbuf.st_ino);
+	if (parent == 0)
+	    return;
+    }
+
+    if (gone != NULL)
+	child = ypfs_inode_id(state->inodes, gone->st_dev, gone->st_ino);
+    if (child == 0 || fuse_lowlevel_notify_delete(state->se, parent, child, name, strlen(name)) < 0)
+	fuse_lowlevel_notify_inval_entry(state->se, parent, name, strlen(name));
+    fuse_lowlevel_notify_inval_inode(state->se, parent, 0, 0);
+}
+
+static void *ypfs_notifier_thread(void *arg)
+{
+    struct ypfs_notifier *notifier = arg;
+    struct ypfs_notice *notice;
+
+    pthread_mutex_lock(&notifier->lock);
+    for (;;) {
+	while (notifier->head == NULL && !notifier->stopping)
+	    pthread_cond_wait(&notifier->wake, &notifier->lock);
+	if (notifier->head == NULL)
+	    break;
+
+	notice = notifier->head;
+	notifier->head = notice->next;
+	if (notifier->head == NULL)
+	    notifier->tail = &notifier->head;
+	pthread_mutex_unlock(&notifier->lock);
+
+	ypfs_notify_now(notifier->state, notice->path, notice->has_gone ? &notice->gone : NULL);
+	free(notice);
+
+	pthread_mutex_lock(&notifier->lock);
+    }
+    pthread_mutex_unlock(&notifier->lock);
+
+    return NULL;
+}
+
+static struct ypfs_notifier *ypfs_notifier_start(struct ypfs_state *state)
+{
+    struct ypfs_notifier *notifier;
+    int err;
+
+    notifier = calloc(1, sizeof(*notifier));
+    if (notifier == NULL)
+	return NULL;
+    notifier->state = state;
+    notifier->tail = &notifier->head;
+    pthread_mutex_init(&notifier->lock, NULL);
+    pthread_cond_init(&notifier->wake, NULL);
+
+    err = pthread_create(&notifier->thread, NULL, ypfs_notifier_thread, notifier);
+    if (err != 0) {
+	pthread_cond_destroy(&notifier->wake);
+	pthread_mutex_destroy(&notifier->lock);
+	free(notifier);
+	errno = err;
+	return NULL;
+    }
+
+    return notifier;
+}
+
+// Send what is still queued, then stop the thread
+static void ypfs_notifier_stop(struct ypfs_notifier *notifier)
 {
-    strcpy(fpath, YPFS_DATA->rootdir);
-    strncat(fpath, path, PATH_MAX); // ridiculously long paths will
-				    // break here
+    if (notifier == NULL)
+	return;
+
+    pthread_mutex_lock(&notifier->lock);
+    notifier->stopping = 1;
+    pthread_cond_signal(&notifier->wake);
+    pthread_mutex_unlock(&notifier->lock);
+    pthread_join(notifier->thread, NULL);
+
+    pthread_cond_destroy(&notifier->wake);
+    pthread_mutex_destroy(&notifier->lock);
+    free(notifier);
+}
+
+// Tell the kernel that fs-relative 'path' was changed behind its
+// back, by ingest, an import or the like, so that it can otherwise
+// cache names and attributes for as long as the timeouts let it.  The
+// name is dropped from its cache, whatever it stood for, along with
+// the attributes and listing of the directory it is in.  'gone', if
+// not NULL, is the file that was removed from there, which the kernel
+// is told has been deleted.
+//
+// A notice waits for the kernel's lock on the directory, which a
+// request in progress may hold while it waits for a FUSE thread; when
+// release sorts the file itself, with ingest_threads=0 or a full
+// queue, under -s that is the very thread sending it.  So the notices
+// go to a thread of their own, and this never waits.  Without one,
+// they are skipped, and the kernel's caches time out as they used to.
+void ypfs_notify(struct ypfs_state *state, const char *path, const struct stat *gone)
+{
+    struct ypfs_notifier *notifier = state->notifier;
+    struct ypfs_notice *notice;
+    size_t len = strlen(path);
+
+    if (notifier == NULL)
+	return;
+    notice = malloc(sizeof(*notice) + len + 1);
+    if (notice == NULL)
+	return;
+    notice->next = NULL;
+    notice->has_gone = gone != NULL;
+    if (gone != NULL)
+	notice->gone = *gone;
+    memcpy(notice->path, path, len + 1);
+
+    pthread_mutex_lock(&notifier->lock);
+    *notifier->tail = notice;
+    notifier->tail = &notice->next;
+    pthread_cond_signal(&notifier->wake);
+    pthread_mutex_unlock(&notifier->lock);
+}
+
+// Names that desktops and photo tools look for next to every file,
+// and which are hardly ever there: sidecars and folder metadata
+static int ypfs_probe_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return strcmp(name, ".DS_Store") == 0
+	|| strcasecmp(name, "Thumbs.db") == 0
+	|| (len > 4 && strcasecmp(name + len - 4, ".xmp") == 0);
+}
+
+// Look up 'name' in 'parent' and answer 'req' with the entry, taking
+// the lookup reference that the kernel will later forget
+static void ypfs_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct ypfs_state *state = YPFS_DATA(req);
+    struct fuse_entry_param e;
+    int retstat;
+
+    retstat = ypfs_inode_lookup(state->inodes, parent, name, &e);
+    if (retstat == -ENOENT && ypfs_probe_name(name) && state->negative_timeout > 0) {
+	// An entry with inode 0 lets the kernel cache the miss
+	memset(&e, 0, sizeof(e));
+	e.entry_timeout = state->negative_timeout;
+	fuse_reply_entry(req, &e);
+	return;
+    }
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+    e.attr_timeout = ypfs_timeout(state, ypfs_inode(req, e.ino));
+    e.entry_timeout = e.attr_timeout;
 
+    fuse_reply_entry(req, &e);
+}
+
+// Whether 'ino' is one of the made-up inodes of a .thumbs view,
+// which can't be changed
+static int ypfs_virtual(fuse_req_t req, fuse_ino_t ino)
+{
+    return ypfs_inode(req, ino)->kind != YPFS_INODE_BACKING;
+}
+
+// Attributes of a made-up inode, from those of what it is made from:
+// a directory that can't be written, a file the size of the
+// thumbnail, or a file of no size in particular for the stats.  The
+// inode number is moved out of the way of the backing file's, or find
+// would take .thumbs for a loop.
+static int ypfs_virtual_attr(struct ypfs_state *state, struct ypfs_inode *inode, struct stat *st)
+{
+    struct ypfs_thumb *thumb;
+    int retstat;
+
+    if (fstatat(inode->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+	return -errno;
+    if (inode->kind == YPFS_INODE_THUMB) {
+	retstat = ypfs_thumbcache_get(state->thumbs, inode->fd, &thumb);
+	if (retstat < 0)
+	    return retstat;
+	st->st_mode = S_IFREG | (st->st_mode & 0444);
+	st->st_nlink = 1;
+	st->st_size = thumb->len;
+	st->st_blocks = (thumb->len + 511) / 512;
+	ypfs_thumb_put(thumb);
+    } else if (inode->kind == YPFS_INODE_STATS) {
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = 0;
+	st->st_blocks = 0;
+    } else {
+	st->st_mode = S_IFDIR | (st->st_mode & 0555);
+	st->st_nlink = 2;
+    }
+    st->st_ino ^= (ino_t) inode->kind << 56;
+
+    return 0;
+}
+
+// Look up the made-up inode of 'kind' for 'name' in 'parent' into 'e',
+// taking a lookup reference as ypfs_inode_lookup() does
+static int ypfs_virtual_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+			      enum ypfs_inode_kind kind, struct fuse_entry_param *e)
+{
+    struct ypfs_state *state = YPFS_DATA(req);
+    int retstat;
+
+    retstat = ypfs_inode_lookup_virtual(state->inodes, parent, name, kind, e);
+    if (retstat < 0)
+	return retstat;
+    retstat = ypfs_virtual_attr(state, ypfs_inode(req, e->ino), &e->attr);
+    if (retstat < 0) {
+	ypfs_inode_forget(state->inodes, e->ino, 1);
+	return retstat;
+    }
+    e->attr_timeout = ypfs_timeout(state, ypfs_inode(req, e->ino));
+    e->entry_timeout = e->attr_timeout;
+
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
-// come indirectly from /usr/include/fuse.h
+// come indirectly from /usr/include/fuse3/fuse_lowlevel.h
 //
+/** Look up a directory entry by name and get its attributes.
+ *
+ * Valid replies:
+ *   fuse_reply_entry
+ *   fuse_reply_err
+ */
+void ypfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct ypfs_inode *dir = ypfs_inode(req, parent);
+    struct fuse_entry_param e;
+    struct stat statbuf;
+    int retstat;
+
+    // .thumbs isn't in any listing, but it is in every directory of
+    // the archive for those who ask, and everything in it is made up.
+    // The same goes for /.ypfs/stats.
+    if (dir->kind == YPFS_INODE_THUMBS)
+	retstat = ypfs_virtual_entry(req, parent, name, YPFS_INODE_THUMB, &e);
+    else if (dir->kind == YPFS_INODE_BACKING && dir->archive && YPFS_DATA(req)->thumbs != NULL
+	     && strcmp(name, YPFS_THUMBS_DIR) == 0)
+	retstat = ypfs_virtual_entry(req, parent, name, YPFS_INODE_THUMBS, &e);
+    else if (dir->kind == YPFS_INODE_BACKING && YPFS_DATA(req)->stats != NULL
+	     && strcmp(name, YPFS_STATS_FILE) == 0
+	     && fstatat(YPFS_DATA(req)->rootfd, YPFS_CATALOG_DIR, &statbuf, AT_SYMLINK_NOFOLLOW) == 0
+	     && statbuf.st_ino == dir->ino && statbuf.st_dev == dir->dev)
+	retstat = ypfs_virtual_entry(req, parent, name, YPFS_INODE_STATS, &e);
+    else {
+	ypfs_reply_entry(req, parent, name);
+	return;
+    }
+
+    if (retstat < 0)
+	ypfs_reply_err(req, -retstat);
+    else
+	fuse_reply_entry(req, &e);
+}
+
+/** Forget about an inode
+ *
+ * This function is called when the kernel removes an inode from its
+ * internal caches.  The inode's lookup count increases by one for
+ * every call to fuse_reply_entry and fuse_reply_create.  The
+ * nlookup parameter indicates by how much the lookup count should be
+ * decreased.
+ *
+ * Valid replies:
+ *   fuse_reply_none
+ */
+void ypfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    ypfs_inode_forget(YPFS_DATA(req)->inodes, ino, nlookup);
+    fuse_reply_none(req);
+}
+
+/** Forget about multiple inodes
+ *
+ * See description of the forget function for more information.
+ */
+void ypfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+	ypfs_inode_forget(YPFS_DATA(req)->inodes, forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
 /** Get file attributes.
  *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
- * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
- * mount option is given.
+ * If writeback caching is enabled, the kernel may have a better idea
+ * of a file's length than the FUSE file system (eg if there has been
+ * a write that extended the file size, but that has not yet been
+ * passed to the filesystem.
+ *
+ * 'fi' will always be NULL, unless the file is open and the kernel
+ * is asking on behalf of an fstat().
  */
-int ypfs_getattr(const char *path, struct stat *statbuf)
+void ypfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = lstat(fpath, statbuf);
-    if (retstat != 0)
-	retstat = ypfs_error("ypfs_getattr lstat");
-    
-    return retstat;
+    struct ypfs_state *state = YPFS_DATA(req);
+    struct ypfs_inode *inode = ypfs_inode(req, ino);
+    double timeout = ypfs_timeout(state, inode);
+    struct stat statbuf;
+    uint64_t gen;
+
+    // made up every time; they are cheap, and the thumbnail cache
+    // knows when the photo changes
+    if (inode->kind != YPFS_INODE_BACKING) {
+	retstat = ypfs_virtual_attr(state, inode, &statbuf);
+	if (retstat < 0)
+	    ypfs_reply_err(req, -retstat);
+	else
+	    fuse_reply_attr(req, &statbuf, timeout);
+	return;
+    }
+
+    // fstat() gets the size the writer expects; stat() by name lags
+    // by whatever handles have gathered, until they flush
+    if (fi != NULL) {
+	retstat = ypfs_wb_flush(YPFS_FILE(fi));
+	if (retstat < 0) {
+	    ypfs_reply_err(req, -retstat);
+	    return;
+	}
+    }
+
+    // Everything that changes a file through us invalidates it, so a
+    // cached stat is as good as a fresh one, open file or not
+    if (ypfs_attrcache_get(state->attrs, inode->dev, inode->ino, timeout, &statbuf)) {
+	fuse_reply_attr(req, &statbuf, timeout);
+	return;
+    }
+
+    gen = ypfs_attrcache_gen(state->attrs, inode->dev, inode->ino);
+    if (fi != NULL)
+	retstat = fstat(YPFS_FILE(fi)->fd, &statbuf);
+    else
+	retstat = fstatat(inode->fd, "", &statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_getattr fstatat"));
+	return;
+    }
+    ypfs_attrcache_put(state->attrs, &statbuf, gen);
+
+    fuse_reply_attr(req, &statbuf, timeout);
+}
+
+/** Set file attributes
+ *
+ * In the 'attr' argument only members indicated by the 'to_set'
+ * bitmask contain valid values.  Other members contain undefined
+ * values.  This covers what the high-level API split into chmod,
+ * chown, truncate, ftruncate and utimens.
+ *
+ * If the setattr was invoked from the ftruncate() system call under
+ * Linux kernel versions 2.6.15 or later, the fi->fh will contain the
+ * value set by the open method or will be undefined if the open
+ * method didn't set any value.  Otherwise (not ftruncate call, or
+ * kernel version earlier than 2.6.15) the fi parameter will be NULL.
+ */
+void ypfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		  struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct ypfs_inode *inode = ypfs_inode(req, ino);
+    int fd = fi != NULL ? YPFS_FILE(fi)->fd : -1;
+    char procpath[64];
+
+    if (ypfs_virtual(req, ino)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    // an ftruncate() mustn't be undone by data written out after it
+    if (fi != NULL) {
+	retstat = ypfs_wb_flush(YPFS_FILE(fi));
+	if (retstat < 0) {
+	    ypfs_reply_err(req, -retstat);
+	    return;
+	}
+    }
+
+    ypfs_procpath(procpath, inode->fd);
+
+    // Change the permission bits of a file
+    if (to_set & FUSE_SET_ATTR_MODE) {
+	if (fd >= 0)
+	    retstat = fchmod(fd, attr->st_mode);
+	else
+	    retstat = chmod(procpath, attr->st_mode);
+	if (retstat < 0)
+	    goto err;
+    }
+
+    // Change the owner and group of a file
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+	uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+	gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+	retstat = fchownat(inode->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (retstat < 0)
+	    goto err;
+    }
+
+    // Change the size of a file.  That spoils any hash being taken
+    // as it is written.
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+	__atomic_add_fetch(&inode->truncs, 1, __ATOMIC_RELAXED);
+	if (fd >= 0) {
+	    YPFS_FILE(fi)->changed = 1;
+	    retstat = ftruncate(fd, attr->st_size);
+	} else
+	    retstat = truncate(procpath, attr->st_size);
+	if (retstat < 0)
+	    goto err;
+    }
+
+    // Change the access and/or modification times of a file
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+	struct timespec tv[2];
+
+	tv[0].tv_sec = 0;
+	tv[0].tv_nsec = UTIME_OMIT;
+	tv[1].tv_sec = 0;
+	tv[1].tv_nsec = UTIME_OMIT;
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+	    tv[0].tv_nsec = UTIME_NOW;
+	else if (to_set & FUSE_SET_ATTR_ATIME)
+	    tv[0] = attr->st_atim;
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+	    tv[1].tv_nsec = UTIME_NOW;
+	else if (to_set & FUSE_SET_ATTR_MTIME)
+	    tv[1] = attr->st_mtim;
+
+	if (fd >= 0)
+	    retstat = futimens(fd, tv);
+	else
+	    retstat = utimensat(AT_FDCWD, procpath, tv, 0);
+	if (retstat < 0)
+	    goto err;
+    }
+
+    ypfs_invalidate(req, inode);
+    ypfs_getattr(req, ino, fi);
+    return;
+
+ err:
+    retstat = ypfs_error("ypfs_setattr");
+    // some of the changes may have been made
+    ypfs_invalidate(req, inode);
+    ypfs_reply_err(req, -retstat);
 }
 
 /** Read the target of a symbolic link
  *
- * The buffer should be filled with a null terminated string.  The
- * buffer size argument includes the space for the terminating
- * null character.  If the linkname is too long to fit in the
- * buffer, it should be truncated.  The return value should be 0
- * for success.
+ * Valid replies:
+ *   fuse_reply_readlink
+ *   fuse_reply_err
  */
-// the description given above doesn't correspond to the readlink(2)
-// man page -- according to that, if the link is too long for the
-// buffer, it ends up without the null termination
-int ypfs_readlink(const char *path, char *link, size_t size)
+void ypfs_readlink(fuse_req_t req, fuse_ino_t ino)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = readlink(fpath, link, size);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_readlink readlink");
-    
-    return 0;
+    char link[PATH_MAX + 1];
+
+    retstat = readlinkat(ypfs_inode(req, ino)->fd, "", link, sizeof(link) - 1);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_readlink readlinkat"));
+	return;
+    }
+    link[retstat] = '\0';
+
+    fuse_reply_readlink(req, link);
 }
 
 /** Create a file node
  *
- * There is no create() operation, mknod() will be called for
- * creation of all non-directory, non-symlink nodes.
+ * Create a regular file, character device, block device, fifo or
+ * socket node.
  */
-// shouldn't that comment be "if" there is no.... ?
-int ypfs_mknod(const char *path, mode_t mode, dev_t dev)
+void ypfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
+    int dirfd = ypfs_inode(req, parent)->fd;
+
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
     // On Linux this could just be 'mknod(path, mode, rdev)' but this
     //  is more portable
     if (S_ISREG(mode)) {
-        retstat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+        retstat = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
 	if (retstat < 0)
-	    retstat = ypfs_error("ypfs_mknod open");
+	    retstat = ypfs_error("ypfs_mknod openat");
         else {
             retstat = close(retstat);
 	    if (retstat < 0)
@@ -135,335 +912,689 @@ int ypfs_mknod(const char *path, mode_t mode, dev_t dev)
 	}
     } else
 	if (S_ISFIFO(mode)) {
-	    retstat = mkfifo(fpath, mode);
+	    retstat = mkfifoat(dirfd, name, mode);
 	    if (retstat < 0)
-		retstat = ypfs_error("ypfs_mknod mkfifo");
+		retstat = ypfs_error("ypfs_mknod mkfifoat");
 	} else {
-	    retstat = mknod(fpath, mode, dev);
+	    retstat = mknodat(dirfd, name, mode, dev);
 	    if (retstat < 0)
-		retstat = ypfs_error("ypfs_mknod mknod");
+		retstat = ypfs_error("ypfs_mknod mknodat");
 	}
-    
-    return retstat;
+
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    ypfs_invalidate(req, ypfs_inode(req, parent));
+    ypfs_reply_entry(req, parent, name);
+}
+
+// Parent directory of fs-relative 'path' is known to exist.  Only
+// then may 'path' go into the directory cache, which must never hold
+// a directory without its parents.
+static int ypfs_parent_cached(struct ypfs_state *state, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash == path)
+	return 1;
+    return ypfs_dircache_has(state->dirs, path, slash - path);
 }
 
 /** Create a directory */
-int ypfs_mkdir(const char *path, mode_t mode)
+void ypfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = _mkdir(fpath, mode);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_mkdir mkdir");
-    
-    return retstat;
+    struct ypfs_state *state = YPFS_DATA(req);
+    char path[PATH_MAX];
+
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    retstat = mkdirat(ypfs_inode(req, parent)->fd, name, mode);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_mkdir mkdirat"));
+	return;
+    }
+
+    if (ypfs_inode_path(state->inodes, parent, name, path, sizeof(path)) == 0
+	&& ypfs_parent_cached(state, path))
+	ypfs_dircache_add(state->dirs, path, strlen(path));
+
+    ypfs_invalidate(req, ypfs_inode(req, parent));
+    ypfs_reply_entry(req, parent, name);
 }
 
-int __mkdir(const char *path) {
-    return _mkdir(path, S_IRWXU);
+int __mkdir(struct ypfs_state *state, const char *path) {
+    return _mkdir(state, path, S_IRWXU);
 }
 
-int _mkdir(const char *path, mode_t mode)
+// Create fs-relative directory 'path' and any missing parents, like
+// mkdir -p.  Directories in the cache are taken on trust, so sorting
+// into an existing day makes no syscalls here at all.
+int _mkdir(struct ypfs_state *state, const char *path, mode_t mode)
 {
-        char opath[256];
-        char *p;
-        size_t len;
-        int res;
+    char prefix[PATH_MAX];
+    size_t len = strlen(path);
+    size_t i;
+    int retstat;
 
-        strncpy(opath, path, sizeof(opath));
-        len = strlen(opath);
-        if(opath[len - 1] == '/')
-                opath[len - 1] = '\0';
-        for(p = opath; *p; p++)
-                if(*p == '/') {
-                        *p = '\0';
-                        if(access(opath, F_OK))
-                                res = mkdir(opath, mode);
-                        *p = '/';
-                }
-        if(access(opath, F_OK))         /* if path is not terminated with / */
-                res = mkdir(opath, mode);
-        return res;
+    while (len > 1 && path[len - 1] == '/')
+	len--;
+    if (ypfs_dircache_has(state->dirs, path, len))
+	return 0;
+    if (len >= PATH_MAX)
+	return -ENAMETOOLONG;
+
+    for (i = 1; i <= len; i++) {
+	// path[0..i) is the next prefix to make sure of
+	if (i < len && path[i] != '/')
+	    continue;
+	if (ypfs_dircache_has(state->dirs, path, i))
+	    continue;
+	memcpy(prefix, path, i);
+	prefix[i] = '\0';
+	retstat = ypfs_uring_mkdirat(state->uring, state->rootfd, ypfs_relpath(prefix), mode);
+	if (retstat < 0) {
+	    if (retstat != -EEXIST)
+		return retstat;
+	} else {
+	    // the parent just got a new entry
+	    ypfs_notify(state, prefix, NULL);
+	    *strrchr(prefix, '/') = '\0';
+	    ypfs_attrcache_invalidate_at(state->attrs, state->rootfd, ypfs_relpath(prefix));
+	}
+	ypfs_dircache_add(state->dirs, path, i);
+    }
+
+    return 0;
 }
 
 /** Remove a file */
-int ypfs_unlink(const char *path)
+void ypfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = unlink(fpath);
+
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    // the file loses a link, which can't be looked up once it's gone
+    ypfs_invalidate_name(req, parent, name);
+
+    retstat = unlinkat(ypfs_inode(req, parent)->fd, name, 0);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_unlink unlink");
-    
-    return retstat;
+	retstat = ypfs_error("ypfs_unlink unlinkat");
+    else
+	ypfs_invalidate(req, ypfs_inode(req, parent));
+
+    ypfs_reply_err(req, -retstat);
 }
 
 /** Remove a directory */
-int ypfs_rmdir(const char *path)
+void ypfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = rmdir(fpath);
+    struct ypfs_state *state = YPFS_DATA(req);
+    char path[PATH_MAX];
+
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    ypfs_invalidate_name(req, parent, name);
+
+    retstat = unlinkat(ypfs_inode(req, parent)->fd, name, AT_REMOVEDIR);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_rmdir rmdir");
-    
-    return retstat;
+	retstat = ypfs_error("ypfs_rmdir unlinkat");
+    else {
+	ypfs_invalidate(req, ypfs_inode(req, parent));
+	if (ypfs_inode_path(state->inodes, parent, name, path, sizeof(path)) == 0)
+	    ypfs_dircache_remove(state->dirs, path, strlen(path));
+    }
+
+    ypfs_reply_err(req, -retstat);
 }
 
 /** Create a symbolic link */
-// The parameters here are a little bit confusing, but do correspond
-// to the symlink() system call.  The 'path' is where the link points,
-// while the 'link' is the link itself.  So we need to leave the path
-// unaltered, but insert the link into the mounted directory.
-int ypfs_symlink(const char *path, const char *link)
+// 'link' is where the link points, while 'name' is the link itself
+// inside 'parent'.  So we need to leave link unaltered.
+void ypfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
     int retstat = 0;
-    char flink[PATH_MAX];
-    
-    ypfs_fullpath(flink, link);
-    
-    retstat = symlink(path, flink);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_symlink symlink");
-    
-    return retstat;
+
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    retstat = symlinkat(link, ypfs_inode(req, parent)->fd, name);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_symlink symlinkat"));
+	return;
+    }
+
+    ypfs_invalidate(req, ypfs_inode(req, parent));
+    ypfs_reply_entry(req, parent, name);
 }
 
-/** Rename a file */
-// both path and newpath are fs-relative
-int ypfs_rename(const char *path, const char *newpath)
+/** Rename a file
+ *
+ * If the target exists it should be atomically replaced.  If
+ * 'flags' is RENAME_NOREPLACE or RENAME_EXCHANGE, do as renameat2()
+ * would.
+ */
+void ypfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		 fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    ypfs_fullpath(fnewpath, newpath);
-    
-    retstat = rename(fpath, fnewpath);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_rename rename");
-    
-    return retstat;
+    struct ypfs_state *state = YPFS_DATA(req);
+    char path[PATH_MAX];
+    char newpath[PATH_MAX];
+    int have_paths;
+
+    if (ypfs_virtual(req, parent) || ypfs_virtual(req, newparent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    // work out the paths first; afterwards 'name' is gone
+    have_paths = ypfs_inode_path(state->inodes, parent, name, path, sizeof(path)) == 0
+	&& ypfs_inode_path(state->inodes, newparent, newname, newpath, sizeof(newpath)) == 0;
+
+    // whatever is replaced loses a link, and can't be found by name
+    // afterwards
+    ypfs_invalidate_name(req, newparent, newname);
+
+    if (flags)
+	retstat = renameat2(ypfs_inode(req, parent)->fd, name,
+			    ypfs_inode(req, newparent)->fd, newname, flags);
+    else
+	retstat = renameat(ypfs_inode(req, parent)->fd, name,
+			   ypfs_inode(req, newparent)->fd, newname);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_rename renameat"));
+	return;
+    }
+
+    ypfs_inode_moved(state->inodes, newparent, newname);
+    ypfs_invalidate_name(req, newparent, newname);
+    if (flags & RENAME_EXCHANGE)
+	ypfs_invalidate_name(req, parent, name);
+    ypfs_invalidate(req, ypfs_inode(req, parent));
+    ypfs_invalidate(req, ypfs_inode(req, newparent));
+
+    if (!have_paths) {
+	// can't tell what moved; start the cache over
+	ypfs_dircache_remove(state->dirs, "/Dates", strlen("/Dates"));
+    } else if (ypfs_dircache_has(state->dirs, path, strlen(path))) {
+	// a directory moved, taking everything under it along
+	ypfs_dircache_remove(state->dirs, path, strlen(path));
+	ypfs_dircache_remove(state->dirs, newpath, strlen(newpath));
+	if (ypfs_parent_cached(state, newpath))
+	    ypfs_dircache_add(state->dirs, newpath, strlen(newpath));
+    } else
+	// it may have replaced an (empty) directory
+	ypfs_dircache_remove(state->dirs, newpath, strlen(newpath));
+
+    ypfs_reply_err(req, 0);
 }
 
 /** Create a hard link to a file */
-int ypfs_link(const char *path, const char *newpath)
+void ypfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
 {
     int retstat = 0;
-    char fpath[PATH_MAX], fnewpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    ypfs_fullpath(fnewpath, newpath);
-    
-    retstat = link(fpath, fnewpath);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_link link");
-    
-    return retstat;
-}
+    char procpath[64];
 
-/** Change the permission bits of a file */
-int ypfs_chmod(const char *path, mode_t mode)
-{
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = chmod(fpath, mode);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_chmod chmod");
-    
-    return retstat;
+    if (ypfs_virtual(req, ino) || ypfs_virtual(req, newparent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    // linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH; going
+    // through /proc doesn't
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+    retstat = linkat(AT_FDCWD, procpath, ypfs_inode(req, newparent)->fd, newname,
+		     AT_SYMLINK_FOLLOW);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_link linkat"));
+	return;
+    }
+    ypfs_invalidate(req, ypfs_inode(req, ino));
+    ypfs_invalidate(req, ypfs_inode(req, newparent));
+
+    ypfs_reply_entry(req, newparent, newname);
 }
 
-/** Change the owner and group of a file */
-int ypfs_chown(const char *path, uid_t uid, gid_t gid)
-  
+// Open a thumbnail: the handle holds it, and reads are served from it
+static void ypfs_open_thumb(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = chown(fpath, uid, gid);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_chown chown");
-    
-    return retstat;
+    struct ypfs_thumb *thumb;
+    int retstat;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    retstat = ypfs_thumbcache_get(YPFS_DATA(req)->thumbs, ypfs_inode(req, ino)->fd, &thumb);
+    if (retstat == 0) {
+	retstat = ypfs_file_new(req, ypfs_inode(req, ino), -1, fi);
+	if (retstat < 0)
+	    ypfs_thumb_put(thumb);
+	else
+	    YPFS_FILE(fi)->thumb = thumb;
+    }
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    // it only changes with the photo, which in the archive is never
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
 }
 
-/** Change the size of a file */
-int ypfs_truncate(const char *path, off_t newsize)
+// Open /.ypfs/stats: the statistics as they are now are kept with the
+// handle, so reading it in pieces makes sense
+static void ypfs_open_stats(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = truncate(fpath, newsize);
-    if (retstat < 0)
-	ypfs_error("ypfs_truncate truncate");
-    
-    return retstat;
+    ssize_t len;
+    char *text;
+    int retstat;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    len = ypfs_stats_render(YPFS_DATA(req)->stats, &text);
+    if (len < 0) {
+	ypfs_reply_err(req, -len);
+	return;
+    }
+    retstat = ypfs_file_new(req, ypfs_inode(req, ino), -1, fi);
+    if (retstat < 0) {
+	free(text);
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+    YPFS_FILE(fi)->snapshot = text;
+    YPFS_FILE(fi)->snapshot_len = len;
+
+    // its size is whatever it is this time
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
 }
 
-/** Change the access and/or modification times of a file */
-/* note -- I'll want to change this as soon as 2.6 is in debian testing */
-int ypfs_utime(const char *path, struct utimbuf *ubuf)
+// Answer a read of 'size' bytes at 'offset' from 'len' bytes in memory
+static void ypfs_reply_mem(fuse_req_t req, const void *data, size_t len, size_t size,
+			   off_t offset)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = utime(fpath, ubuf);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_utime utime");
-    
-    return retstat;
+    if ((size_t) offset >= len)
+	size = 0;
+    else if (size > len - offset)
+	size = len - offset;
+    ypfs_stats_bytes(size);
+    fuse_reply_buf(req, size > 0 ? (const char *) data + offset : NULL, size);
 }
 
 /** File open operation
  *
- * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
- * will be passed to open().  Open should check if the operation
- * is permitted for the given flags.  Optionally open may also
- * return an arbitrary filehandle in the fuse_file_info structure,
- * which will be passed to all file operations.
- *
- * Changed in version 2.2
+ * No creation (O_CREAT, O_EXCL) and by default also no truncation
+ * (O_TRUNC) flags will be passed to open().  Open should check if
+ * the operation is permitted for the given flags.  Optionally open
+ * may also return an arbitrary filehandle in the fuse_file_info
+ * structure, which will be passed to all file operations.
  */
-int ypfs_open(const char *path, struct fuse_file_info *fi)
+void ypfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int retstat = 0;
     int fd;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    fd = open(fpath, fi->flags);
-    if (fd < 0)
-	retstat = ypfs_error("ypfs_open open");
-    
-    fi->fh = fd;
-    
-    return 0;
+    char procpath[64];
+
+    if (ypfs_inode(req, ino)->kind == YPFS_INODE_THUMB) {
+	ypfs_open_thumb(req, ino, fi);
+	return;
+    }
+    if (ypfs_inode(req, ino)->kind == YPFS_INODE_STATS) {
+	ypfs_open_stats(req, ino, fi);
+	return;
+    }
+
+    // The kernel leaves O_TRUNC to us, which changes the size just
+    // as setattr would, and spoils hashes being taken on other handles
+    if (fi->flags & O_TRUNC)
+	__atomic_add_fetch(&ypfs_inode(req, ino)->truncs, 1, __ATOMIC_RELAXED);
+
+    // O_PATH fds can't be read; reopen the file properly
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+    fd = open(procpath, fi->flags & ~O_NOFOLLOW);
+    if (fd < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_open open"));
+	return;
+    }
+    if (fi->flags & O_TRUNC)
+	ypfs_invalidate(req, ypfs_inode(req, ino));
+
+    retstat = ypfs_file_new(req, ypfs_inode(req, ino), fd, fi);
+    if (retstat < 0) {
+	close(fd);
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    fuse_reply_open(req, fi);
 }
 
-/** Read data from an open file
+/** Read data
  *
- * Read should return exactly the number of bytes requested except
+ * Read should send exactly the number of bytes requested except
  * on EOF or error, otherwise the rest of the data will be
- * substituted with zeroes.  An exception to this is when the
- * 'direct_io' mount option is specified, in which case the return
+ * substituted with zeroes.  An exception to this is when the file
+ * has been opened in 'direct_io' mode, in which case the return
  * value of the read system call will reflect the return value of
  * this operation.
- *
- * Changed in version 2.2
  */
-// I don't fully understand the documentation above -- it doesn't
-// match the documentation for the read() system call which says it
-// can return with anything up to the amount of data requested. nor
-// with the fusexmp code which returns the amount of data also
-// returned by read.
-int ypfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void ypfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	       struct fuse_file_info *fi)
 {
     int retstat = 0;
-    
-    // no need to get fpath on this one, since I work from fi->fh not the path
-    
-    retstat = pread(fi->fh, buf, size, offset);
+    struct ypfs_state *state = YPFS_DATA(req);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    struct ypfs_thumb *thumb = YPFS_FILE(fi)->thumb;
+    struct ypfs_inode *inode;
+    char path[PATH_MAX];
+    char *buf;
+    int index;
+
+    if (thumb != NULL) {
+	ypfs_reply_mem(req, thumb->data, thumb->len, size, offset);
+	return;
+    }
+    if (YPFS_FILE(fi)->snapshot != NULL) {
+	ypfs_reply_mem(req, YPFS_FILE(fi)->snapshot, YPFS_FILE(fi)->snapshot_len, size, offset);
+	return;
+    }
+
+    // what was written through this handle has to be there to read
+    retstat = ypfs_wb_flush(YPFS_FILE(fi));
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    // Reads in order have the file read ahead of them, and a photo
+    // in the archive read that way the next few of its day as well
+    if (ypfs_readahead_read(&YPFS_FILE(fi)->ra, YPFS_FILE(fi)->fd, offset, size)
+	&& state->prefetch != NULL) {
+	inode = ypfs_inode(req, ino);
+	if (inode->archive && inode->kind == YPFS_INODE_BACKING
+	    && ypfs_inode_path(state->inodes, ino, NULL, path, sizeof(path)) == 0)
+	    ypfs_prefetch_next(state->prefetch, path);
+    }
+
+    // Hand libfuse the backing fd rather than the data, so it can
+    // splice straight from the file into /dev/fuse.  How much it
+    // finds there we don't get to know; count what was asked for.
+    if (!state->copy_io) {
+	ypfs_stats_bytes(size);
+	bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	bufv.buf[0].fd = YPFS_FILE(fi)->fd;
+	bufv.buf[0].pos = offset;
+	fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+	return;
+    }
+
+    // into one of the ring's registered buffers if there's one free
+    buf = ypfs_uring_buf_get(state->uring, size, &index);
+    if (buf == NULL) {
+	index = -1;
+	buf = malloc(size);
+	if (buf == NULL) {
+	    ypfs_reply_err(req, ENOMEM);
+	    return;
+	}
+    }
+
+    retstat = ypfs_uring_pread(state->uring, YPFS_FILE(fi)->fd, ypfs_file_slot(YPFS_FILE(fi)),
+			       buf, size, offset, index);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_read read");
-    
-    return retstat;
+	ypfs_reply_err(req, -retstat);
+    else {
+	ypfs_stats_bytes(retstat);
+	fuse_reply_buf(req, buf, retstat);
+    }
+
+    if (index >= 0)
+	ypfs_uring_buf_put(state->uring, index);
+    else
+	free(buf);
 }
 
-/** Write data to an open file
+/** Write data
  *
  * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
- *
- * Changed in version 2.2
+ * except on error.  An exception to this is when the file has
+ * been opened in 'direct_io' mode, in which case the return value
+ * of the write system call will reflect the return value of this
+ * operation.
  */
-int ypfs_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+void ypfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
 {
     int retstat = 0;
-    
-    // no need to get fpath on this one, since I work from fi->fh not the path
-	
-    retstat = pwrite(fi->fh, buf, size, offset);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_write pwrite");
-    
-    return retstat;
+    struct ypfs_file *file = YPFS_FILE(fi);
+
+    // no need for the inode on this one, since I work from fi->fh
+
+    retstat = ypfs_wb_write(file, buf, size, offset);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+    if (retstat == 1)
+	retstat = size;
+    else {
+	retstat = ypfs_uring_pwrite(file->ring, file->fd, ypfs_file_slot(file), buf, size,
+				    offset);
+	if (retstat < 0) {
+	    ypfs_reply_err(req, -retstat);
+	    return;
+	}
+    }
+
+    // Look at what went by for the EXIF date and the content hash,
+    // so ingest won't have to read it back.  Once the sniffer has its
+    // answer that part is just a comparison.  Every write is counted,
+    // so that hashes on other handles know they missed it.
+    __atomic_add_fetch(&file->inode->writes, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&file->stream_lock);
+    ypfs_exif_sniff_feed(&file->sniff, buf, retstat, offset);
+    ypfs_hasher_feed(&file->hash, buf, retstat, offset);
+    pthread_mutex_unlock(&file->stream_lock);
+    file->changed = 1;
+
+    ypfs_invalidate(req, ypfs_inode(req, ino));
+
+    ypfs_stats_bytes(retstat);
+    fuse_reply_write(req, retstat);
+}
+
+/** Write data made available in a buffer
+ *
+ * This is a more generic version of the write method.  If
+ * FUSE_CAP_SPLICE_READ is set in conn.want and the kernel supports
+ * splicing from the fuse device, then the data will be made
+ * available in pipe for supporting zero copy data transfer.
+ *
+ * We splice the pipe straight into the backing file, except while the
+ * EXIF sniffer is still waiting for the start of the file, the file
+ * is being hashed, or the handle gathers its writes: those writes
+ * come through memory and go to ypfs_write.
+ */
+void ypfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+		    struct fuse_file_info *fi)
+{
+    struct ypfs_file *file = YPFS_FILE(fi);
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+    ssize_t res;
+    int pending;
+
+    pthread_mutex_lock(&file->stream_lock);
+    pending = file->sniff.result == YPFS_SNIFF_PENDING || ypfs_hasher_live(&file->hash);
+    pthread_mutex_unlock(&file->stream_lock);
+    // one too big to gather is written as it is
+    if (file->wb_cap > size)
+	pending = 1;
+
+    if (pending) {
+	out.buf[0].mem = malloc(size);
+	if (out.buf[0].mem == NULL) {
+	    ypfs_reply_err(req, ENOMEM);
+	    return;
+	}
+	res = fuse_buf_copy(&out, bufv, 0);
+	if (res < 0)
+	    ypfs_reply_err(req, -res);
+	else
+	    ypfs_write(req, ino, out.buf[0].mem, res, offset, fi);
+	free(out.buf[0].mem);
+	return;
+    }
+
+    // anything gathered goes first, in case this overwrites it
+    res = ypfs_wb_flush(file);
+    if (res < 0) {
+	ypfs_reply_err(req, -res);
+	return;
+    }
+
+    out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out.buf[0].fd = file->fd;
+    out.buf[0].pos = offset;
+
+    res = fuse_buf_copy(&out, bufv, 0);
+    if (res < 0) {
+	ypfs_reply_err(req, -res);
+	return;
+    }
+    __atomic_add_fetch(&file->inode->writes, 1, __ATOMIC_RELAXED);
+    file->changed = 1;
+
+    ypfs_invalidate(req, ypfs_inode(req, ino));
+
+    ypfs_stats_bytes(res);
+    fuse_reply_write(req, res);
 }
 
-/** Get file system statistics
+/**
+ * Copy a range of data from one opened file to another
  *
- * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
+ * Both are backing files of ours, so the data needn't come through
+ * the daemon at all.  A copy of a whole file into an empty one is
+ * tried as a reflink first, sharing the blocks on btrfs or XFS; the
+ * rest goes to copy_file_range() on the backing files, which the
+ * kernel turns into a reflink where it can and an in-kernel copy
+ * otherwise.  Whatever it can't do at all (across filesystems, from
+ * a thumbnail) the kernel falls back to copying through read and
+ * write.
  *
- * Replaced 'struct statfs' parameter with 'struct statvfs' in
- * version 2.5
+ * The destination's sniffer and hash don't see the data, so ingest
+ * reads it back when it is released into the inbox.
  */
-int ypfs_statfs(const char *path, struct statvfs *statv)
+void ypfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+			  struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+			  struct fuse_file_info *fi_out, size_t len, int flags)
+{
+    struct ypfs_file *in = YPFS_FILE(fi_in);
+    struct ypfs_file *out = YPFS_FILE(fi_out);
+    struct stat instat, outstat;
+    off_t start = off_out;	// copy_file_range() moves off_out on
+    ssize_t res = -1;
+    int retstat;
+
+    if (in->fd < 0 || out->fd < 0) {
+	ypfs_reply_err(req, EOPNOTSUPP);
+	return;
+    }
+
+    // both ends as they would be read and written
+    retstat = ypfs_wb_flush(in);
+    if (retstat == 0)
+	retstat = ypfs_wb_flush(out);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    if (off_in == 0 && off_out == 0 && fstat(in->fd, &instat) == 0 && len >= instat.st_size
+	&& fstat(out->fd, &outstat) == 0 && outstat.st_size == 0
+	&& ioctl(out->fd, FICLONE, in->fd) == 0)
+	res = instat.st_size;
+    if (res < 0)
+	res = copy_file_range(in->fd, &off_in, out->fd, &off_out, len, 0);
+    if (res < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_copy_file_range copy_file_range"));
+	return;
+    }
+
+    __atomic_add_fetch(&out->inode->writes, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&out->stream_lock);
+    ypfs_exif_sniff_unseen(&out->sniff, start);
+    ypfs_hasher_break(&out->hash);
+    pthread_mutex_unlock(&out->stream_lock);
+    out->changed = 1;
+
+    ypfs_invalidate(req, ypfs_inode(req, ino_out));
+
+    ypfs_stats_bytes(res);
+    fuse_reply_write(req, res);
+}
+
+/** Get file system statistics */
+void ypfs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
+    struct statvfs statv;
+
     // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_statfs statvfs");
-    
-    
-    return retstat;
+    retstat = fstatvfs(ypfs_inode(req, ino)->fd, &statv);
+    if (retstat < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_statfs fstatvfs"));
+	return;
+    }
+
+    fuse_reply_statfs(req, &statv);
 }
 
-/** Possibly flush cached data
+/** Flush method
  *
- * BIG NOTE: This is not equivalent to fsync().  It's not a
- * request to sync dirty data.
+ * This is called on each close() of the opened file.
  *
- * Flush is called on each close() of a file descriptor.  So if a
- * filesystem wants to return write errors in close() and the file
- * has cached dirty data, this is a good place to write back data
- * and return any errors.  Since many applications ignore close()
- * errors this is not always useful.
- *
- * NOTE: The flush() method may be called more than once for each
- * open().  This happens if more than one file descriptor refers
- * to an opened file due to dup(), dup2() or fork() calls.  It is
- * not possible to determine if a flush is final, so each flush
- * should be treated equally.  Multiple write-flush sequences are
- * relatively rare, so this shouldn't be a problem.
+ * Since file descriptors can be duplicated (dup, dup2, fork), for
+ * one open call there may be many flush calls.
  *
  * Filesystems shouldn't assume that flush will always be called
  * after some writes, or that if will be called at all.
  *
- * Changed in version 2.2
+ * NOTE: the name of the method is misleading, since (unlike
+ * fsync) the filesystem is not forced to flush pending writes.
+ * One reason to flush data is if the filesystem wants to return
+ * write errors during close.  However, such use is non-portable
+ * because POSIX does not require [close] to wait for delayed I/O to
+ * complete.
  */
-int ypfs_flush(const char *path, struct fuse_file_info *fi)
+void ypfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-	
-    return retstat;
+    // so that close() reports what went wrong writing out the buffer
+    ypfs_reply_err(req, -ypfs_wb_sync(YPFS_FILE(fi)));
 }
 
 /** Release an open file
@@ -472,331 +1603,720 @@ int ypfs_flush(const char *path, struct fuse_file_info *fi)
  * file: all file descriptors are closed and all memory mappings
  * are unmapped.
  *
- * For every open() call there will be exactly one release() call
- * with the same flags and file descriptor.  It is possible to
- * have a file opened more than once, in which case only the last
- * release will mean, that no more reads/writes will happen on the
- * file.  The return value of release is ignored.
+ * For every open call there will be exactly one release call (unless
+ * the filesystem is force-unmounted).
  *
- * Changed in version 2.2
+ * The filesystem may reply with an error, but error values are
+ * not returned to close() or munmap() which triggered the
+ * release.
  */
-int ypfs_release(const char *path, struct fuse_file_info *fi)
+void ypfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-    // TODO
+    struct ypfs_state *state = YPFS_DATA(req);
+    struct ypfs_file *file = YPFS_FILE(fi);
+    struct ypfs_inode *inode = ypfs_inode(req, ino);
+    struct ypfs_hash hash;
+    struct stat statbuf;
+    char path[PATH_MAX];
+
+    // Normally flush has done this already, and there is nobody left
+    // to tell if it fails
+    ypfs_wb_flush(file);
+
     // We copy files from elsewhere into the root directory.
     // When the copying is done, release is the last call done.
-    // If the file is released and in the root directory, move to the proper place
-    // (with creating new directories as necessary)
-    // Will need to write a function to check for exif data
-    // If the exif exists, use the exif date to place the directory
-    // Otherwise, use old file modified date (since create date does not exist in linux)
-    
-    char fpath[PATH_MAX];
-    char datefpath[PATH_MAX];
-    int exif_found = 1;
-    ExifEntry *date_taken_entry;
-    ypfs_fullpath(fpath, path);
-    ExifData *picture_data = exif_data_new_from_file(fpath);
-    if (picture_data == NULL) {
-        exif_found = 0;
-    } else {
-        date_taken_entry = exif_data_get_entry(picture_data, EXIF_TAG_DATE_TIME);
-        if (date_taken_entry == NULL) {
-            exif_found = 0;
-        } else {
-            if (date_taken_entry->data == NULL) {
-                exif_found = 0;
-            } else {
-                exif_found = 1;
-            }
-        }
-    }
-
-    if (exif_found) {
-        char *date_taken = (char *)date_taken_entry->data;
-        char *year = strtok(date_taken, ":");
-        char *month = strtok(NULL, ":");
-        char *day = strtok(NULL, " ");
-        char datepath[PATH_MAX];
-        //fprintf(stderr, "/Dates/%s/%s/%s/\n", year, month, day);
-        sprintf(datepath, "/Dates/%s/%s/%s/", year, month, day);
-        ypfs_fullpath(datefpath, datepath);
-        //fprintf(stderr, "%s\n", datefpath);
-        __mkdir(datefpath);
-        rename(fpath, strcat(datefpath, path));
+    // If the file is released and in the root directory, move to the
+    // proper place (with creating new directories as necessary).
+    // That is slow, so hand it to the ingest threads unless there
+    // aren't any.  The date was usually sniffed during the writes;
+    // if not, it is read from the backing fd, which ingest closes
+    // once the file has been sorted.  The same goes for the hash.
+    // A handle that only read, as a gallery browsing the inbox does,
+    // leaves nothing new to sort, and costs just the close.  Nor
+    // does one that lost gathered data: the file is not what was
+    // written, so it stays in the inbox to be written again.  Ingest
+    // points the inode at where it put the file, but can't when the
+    // kernel hasn't seen that directory, so the name must still be
+    // this file's, and not that of one written since.
+    if (file->changed && !file->wb_lost && inode->parent == ypfs_inode(req, FUSE_ROOT_ID)
+	&& ypfs_inode_path(state->inodes, ino, NULL, path, sizeof(path)) == 0
+	&& fstatat(state->rootfd, ypfs_relpath(path), &statbuf, AT_SYMLINK_NOFOLLOW) == 0
+	&& statbuf.st_ino == inode->ino && statbuf.st_dev == inode->dev) {
+	ypfs_hasher_digest(&file->hash, __atomic_load_n(&inode->truncs, __ATOMIC_RELAXED),
+			   __atomic_load_n(&inode->writes, __ATOMIC_RELAXED), &hash);
+	if (state->ingest == NULL
+	    || ypfs_ingest_enqueue(state->ingest, path, file->fd, &file->sniff, &hash) < 0)
+	    ypfs_ingest_file(state, path, file->fd, &file->sniff, &hash);
+    } else if (file->fd >= 0)
+	close(file->fd);
+
+    ypfs_file_free(file);
+
+    ypfs_reply_err(req, 0);
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ */
+void ypfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+
+    // nothing to sync for a thumbnail
+    if (YPFS_FILE(fi)->fd < 0) {
+	ypfs_reply_err(req, 0);
+	return;
+    }
+
+    retstat = ypfs_wb_sync(YPFS_FILE(fi));
+    if (retstat < 0) {
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    retstat = ypfs_uring_fsync(YPFS_FILE(fi)->ring, YPFS_FILE(fi)->fd,
+			       ypfs_file_slot(YPFS_FILE(fi)), datasync);
+
+    ypfs_reply_err(req, -retstat);
+}
+
+// There are no *at() versions of the xattr calls, so they go through
+// the inode's /proc/self/fd link, which reaches the node even when it
+// is a symlink.
+
+/** Set extended attributes */
+void ypfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+		   size_t size, int flags)
+{
+    int retstat = 0;
+    char procpath[64];
+
+    // setting this on the root starts a scan, see scan.h
+    if (ino == FUSE_ROOT_ID && strcmp(name, YPFS_XATTR_SCAN) == 0) {
+	if (YPFS_DATA(req)->scan == NULL)
+	    ypfs_reply_err(req, ENOTSUP);
+	else
+	    ypfs_reply_err(req, -ypfs_scan_start(YPFS_DATA(req)->scan));
+	return;
+    }
+
+    // ... and this imports the directory it names, see import.h
+    if (ino == FUSE_ROOT_ID && strcmp(name, YPFS_XATTR_IMPORT) == 0) {
+	char source[PATH_MAX];
+
+	if (YPFS_DATA(req)->import == NULL)
+	    ypfs_reply_err(req, ENOTSUP);
+	else if (size == 0 || size >= sizeof(source))
+	    ypfs_reply_err(req, EINVAL);
+	else {
+	    memcpy(source, value, size);
+	    source[size] = '\0';
+	    ypfs_reply_err(req, -ypfs_import_start(YPFS_DATA(req)->import, source));
+	}
+	return;
+    }
+
+    if (ypfs_virtual(req, ino)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+
+    retstat = setxattr(procpath, name, value, size, flags);
+    if (retstat < 0)
+	retstat = ypfs_error("ypfs_setxattr setxattr");
+    else
+	ypfs_invalidate(req, ypfs_inode(req, ino));
+
+    ypfs_reply_err(req, -retstat);
+}
+
+/** Get an extended attribute
+ *
+ * If size is zero, the size of the value should be sent with
+ * fuse_reply_xattr.
+ *
+ * If the size is non-zero, and the value fits in the buffer, the
+ * value should be sent with fuse_reply_buf.
+ */
+void ypfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    int retstat = 0;
+    char procpath[64];
+    char *value = NULL;
+    char status[PATH_MAX + 256];
+
+    // ... and these report on them
+    if (ino == FUSE_ROOT_ID
+	&& ((strcmp(name, YPFS_XATTR_SCAN) == 0 && YPFS_DATA(req)->scan != NULL)
+	    || (strcmp(name, YPFS_XATTR_IMPORT) == 0 && YPFS_DATA(req)->import != NULL))) {
+	if (strcmp(name, YPFS_XATTR_SCAN) == 0)
+	    retstat = ypfs_scan_status(YPFS_DATA(req)->scan, status, sizeof(status));
+	else
+	    retstat = ypfs_import_status(YPFS_DATA(req)->import, status, sizeof(status));
+	if ((size_t) retstat >= sizeof(status))
+	    retstat = sizeof(status) - 1;
+	if (size == 0)
+	    fuse_reply_xattr(req, retstat);
+	else if (size < (size_t) retstat)
+	    ypfs_reply_err(req, ERANGE);
+	else
+	    fuse_reply_buf(req, status, retstat);
+	return;
+    }
 
-    } else {
-        // fallback to file modified time
-        struct stat filestat;
-        stat(fpath, &filestat);
-        time_t mtime = filestat.st_mtime;
-        struct tm *ts;
-        ts = localtime(&mtime);
-        char datepath[PATH_MAX];
-        strftime(datepath, sizeof(datepath), "/Dates/%Y/%m/%d/", ts);
-        //fprintf(stderr, "%s\n", datepath);
-        ypfs_fullpath(datefpath, datepath);
-        //fprintf(stderr, "%s\n", datefpath);
-        __mkdir(datefpath);
-        rename(fpath, strcat(datefpath, path));
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+
+    if (size > 0) {
+	value = malloc(size);
+	if (value == NULL) {
+	    ypfs_reply_err(req, ENOMEM);
+	    return;
+	}
     }
-    
-    return retstat;
+
+    retstat = getxattr(procpath, name, value, size);
+    if (retstat < 0)
+	ypfs_reply_err(req, -ypfs_error("ypfs_getxattr getxattr"));
+    else if (size == 0)
+	fuse_reply_xattr(req, retstat);
+    else
+	fuse_reply_buf(req, value, retstat);
+
+    free(value);
 }
 
-/** Synchronize file contents
- *
- * If the datasync parameter is non-zero, then only the user data
- * should be flushed, not the meta data.
+/** List extended attribute names
  *
- * Changed in version 2.2
+ * Same size conventions as getxattr.
  */
-int ypfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+void ypfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
     int retstat = 0;
-    
-    
-    if (datasync)
-	retstat = fdatasync(fi->fh);
-    else
-	retstat = fsync(fi->fh);
-    
+    char procpath[64];
+    char *list = NULL;
+
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+
+    if (size > 0) {
+	list = malloc(size);
+	if (list == NULL) {
+	    ypfs_reply_err(req, ENOMEM);
+	    return;
+	}
+    }
+
+    retstat = listxattr(procpath, list, size);
     if (retstat < 0)
-	ypfs_error("ypfs_fsync fsync");
-    
-    return retstat;
+	ypfs_reply_err(req, -ypfs_error("ypfs_listxattr listxattr"));
+    else if (size == 0)
+	fuse_reply_xattr(req, retstat);
+    else
+	fuse_reply_buf(req, list, retstat);
+
+    free(list);
 }
 
-/** Set extended attributes */
-int ypfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+/** Remove extended attributes */
+void ypfs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = lsetxattr(fpath, name, value, size, flags);
+    char procpath[64];
+
+    if (ypfs_virtual(req, ino)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+
+    retstat = removexattr(procpath, name);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_setxattr lsetxattr");
-    
-    return retstat;
+	retstat = ypfs_error("ypfs_removexattr removexattr");
+    else
+	ypfs_invalidate(req, ypfs_inode(req, ino));
+
+    ypfs_reply_err(req, -retstat);
 }
 
-/** Get extended attributes */
-int ypfs_getxattr(const char *path, const char *name, char *value, size_t size)
+/** Open directory
+ *
+ * This method should check if the open operation is permitted for
+ * this directory
+ */
+void ypfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = lgetxattr(fpath, name, value, size);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_getxattr lgetxattr");
-    
-    return retstat;
+    struct ypfs_dir *dir;
+
+    dir = calloc(1, sizeof(*dir));
+    if (dir != NULL)
+	dir->buf = malloc(YPFS_DIR_BUF);
+    if (dir == NULL || dir->buf == NULL) {
+	free(dir);
+	ypfs_reply_err(req, ENOMEM);
+	return;
+    }
+
+    dir->fd = openat(ypfs_inode(req, ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+    if (dir->fd < 0) {
+	retstat = ypfs_error("ypfs_opendir openat");
+	free(dir->buf);
+	free(dir);
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+
+    fi->fh = (uintptr_t) dir;
+
+    fuse_reply_open(req, fi);
 }
 
-/** List extended attributes */
-int ypfs_listxattr(const char *path, char *list, size_t size)
+// Next entry of 'dir', reading another batch when the buffer is used
+// up.  Returns NULL with errno set on error, or 0 at the end.
+static struct ypfs_dirent64 *ypfs_dir_next(struct ypfs_dir *dir)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = llistxattr(fpath, list, size);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_listxattr llistxattr");
-    
-    
-    return retstat;
+    long n;
+
+    if (dir->pos >= dir->len) {
+	n = syscall(SYS_getdents64, dir->fd, dir->buf, YPFS_DIR_BUF);
+	if (n <= 0) {
+	    errno = n < 0 ? errno : 0;
+	    return NULL;
+	}
+	dir->len = n;
+	dir->pos = 0;
+    }
+
+    return (struct ypfs_dirent64 *) (dir->buf + dir->pos);
 }
 
-/** Remove extended attributes */
-int ypfs_removexattr(const char *path, const char *name)
+static void ypfs_dir_advance(struct ypfs_dir *dir, struct ypfs_dirent64 *de)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    retstat = lremovexattr(fpath, name);
+    dir->offset = de->d_off;
+    dir->pos += de->d_reclen;
+}
+
+// Entry for 'de' in the .thumbs view 'ino', into 'e': just the inode
+// number and type, or with 'plus' a looked up entry.  Returns 0,
+// -ENOENT for anything that isn't a photo with a thumbnail, or
+// -errno.
+static int ypfs_thumbs_entry(fuse_req_t req, fuse_ino_t ino, struct ypfs_dir *dir,
+			     struct ypfs_dirent64 *de, int plus, struct fuse_entry_param *e)
+{
+    struct ypfs_thumb *thumb;
+    int retstat;
+    int fd;
+
+    if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+	return -ENOENT;
+    if (plus)
+	return ypfs_virtual_entry(req, ino, de->d_name, YPFS_INODE_THUMB, e);
+
+    fd = openat(dir->fd, de->d_name, O_PATH | O_NOFOLLOW);
+    if (fd < 0)
+	return -errno;
+    retstat = ypfs_thumbcache_get(YPFS_DATA(req)->thumbs, fd, &thumb);
+    close(fd);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_removexattr lrmovexattr");
-    
-    return retstat;
+	return retstat;
+    ypfs_thumb_put(thumb);
+
+    memset(e, 0, sizeof(*e));
+    e->attr.st_ino = de->d_ino ^ ((ino_t) YPFS_INODE_THUMB << 56);
+    e->attr.st_mode = S_IFREG;
+    return 0;
 }
 
-/** Open directory
- *
- * This method should check if the open operation is permitted for
- * this  directory
- *
- * Introduced in version 2.3
- */
-int ypfs_opendir(const char *path, struct fuse_file_info *fi)
+// Inode number to list for "." or ".." in directory 'ino'.  In a
+// .thumbs view they are the view and the directory it is made from.
+static ino_t ypfs_dot_ino(fuse_req_t req, fuse_ino_t ino, struct ypfs_dirent64 *de)
 {
-    DIR *dp;
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    
-    ypfs_fullpath(fpath, path);
-    
-    dp = opendir(fpath);
-    if (dp == NULL)
-	retstat = ypfs_error("ypfs_opendir opendir");
-    
-    fi->fh = (intptr_t) dp;
-    
-    
-    return retstat;
+    struct ypfs_inode *inode = ypfs_inode(req, ino);
+
+    if (inode->kind != YPFS_INODE_THUMBS)
+	return de->d_ino;
+    if (strcmp(de->d_name, ".") == 0)
+	return de->d_ino ^ ((ino_t) YPFS_INODE_THUMBS << 56);
+    return inode->ino;
+}
+
+// readdir and readdirplus.  With 'plus', each entry carries its
+// attributes and a lookup reference, so that 'ls -l' needs no lookup
+// or getattr per file.  The attributes come from an fstatat() on the
+// directory fd, and for a file we have already seen that is all.
+// A .thumbs view lists the photos of its directory that have
+// thumbnails, and nothing else.
+static void ypfs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			    struct fuse_file_info *fi, int plus)
+{
+    struct ypfs_state *state = YPFS_DATA(req);
+    struct ypfs_dir *dir = YPFS_DIR(fi);
+    struct ypfs_dirent64 *de;
+    struct fuse_entry_param e;
+    struct stat statbuf;
+    char *buf;
+    char *p;
+    size_t rem = size;
+    size_t entsize;
+    int thumbs = ypfs_inode(req, ino)->kind == YPFS_INODE_THUMBS;
+    int dot;
+    int err = 0;
+
+    buf = malloc(size);
+    if (buf == NULL) {
+	ypfs_reply_err(req, ENOMEM);
+	return;
+    }
+    p = buf;
+
+    // 'offset' is the d_off cookie of the last entry the kernel got,
+    // which the backing filesystem keeps valid for lseek()
+    if (offset != dir->offset) {
+	if (lseek(dir->fd, offset, SEEK_SET) < 0) {
+	    ypfs_reply_err(req, errno);
+	    free(buf);
+	    return;
+	}
+	dir->len = dir->pos = 0;
+	dir->offset = offset;
+    }
+
+    while ((de = ypfs_dir_next(dir)) != NULL) {
+	dot = strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0;
+	if (thumbs && !dot) {
+	    err = -ypfs_thumbs_entry(req, ino, dir, de, plus, &e);
+	    if (err == ENOENT) {
+		ypfs_dir_advance(dir, de);
+		err = 0;
+		continue;
+	    }
+	    if (err != 0)
+		break;
+	    if (plus)
+		entsize = fuse_add_direntry_plus(req, p, rem, de->d_name, &e, de->d_off);
+	    else
+		entsize = fuse_add_direntry(req, p, rem, de->d_name, &e.attr, de->d_off);
+	    if (entsize > rem) {
+		if (plus)
+		    ypfs_inode_forget(state->inodes, e.ino, 1);
+		break;
+	    }
+	} else if (!plus) {
+	    memset(&statbuf, 0, sizeof(statbuf));
+	    statbuf.st_ino = dot ? ypfs_dot_ino(req, ino, de) : de->d_ino;
+	    statbuf.st_mode = DTTOIF(de->d_type);
+	    entsize = fuse_add_direntry(req, p, rem, de->d_name, &statbuf, de->d_off);
+	    if (entsize > rem)
+		break;		// buffer full; keep the entry for next time
+	} else if (dot) {
+	    // the kernel doesn't look these up
+	    memset(&e, 0, sizeof(e));
+	    e.attr.st_ino = ypfs_dot_ino(req, ino, de);
+	    e.attr.st_mode = DTTOIF(de->d_type);
+	    entsize = fuse_add_direntry_plus(req, p, rem, de->d_name, &e, de->d_off);
+	    if (entsize > rem)
+		break;
+	} else {
+	    err = 0;
+	    if (fstatat(dir->fd, de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+		err = errno;
+	    else
+		err = -ypfs_inode_lookup_stat(state->inodes, ino, de->d_name, &statbuf, &e);
+	    if (err == ENOENT) {
+		// gone since getdents64; leave it out
+		ypfs_dir_advance(dir, de);
+		err = 0;
+		continue;
+	    }
+	    if (err != 0)
+		break;
+	    e.attr_timeout = ypfs_timeout(state, ypfs_inode(req, e.ino));
+	    e.entry_timeout = e.attr_timeout;
+	    entsize = fuse_add_direntry_plus(req, p, rem, de->d_name, &e, de->d_off);
+	    if (entsize > rem) {
+		// not sent, so the kernel won't forget it
+		ypfs_inode_forget(state->inodes, e.ino, 1);
+		break;
+	    }
+	}
+	p += entsize;
+	rem -= entsize;
+	ypfs_dir_advance(dir, de);
+    }
+    if (de == NULL)
+	err = errno;
+
+    // an error after some entries waits for the next call
+    if (err != 0 && p == buf)
+	ypfs_reply_err(req, err);
+    else
+	fuse_reply_buf(req, buf, p - buf);
+
+    free(buf);
 }
 
 /** Read directory
  *
- * This supersedes the old getdir() interface.  New applications
- * should use this.
+ * Send a buffer filled using fuse_add_direntry(), with size not
+ * exceeding the requested size.  Send an empty buffer on end of
+ * stream.
  *
- * The filesystem may choose between two modes of operation:
+ * Returning a directory entry from readdir() does not affect
+ * its lookup count.
  *
- * 1) The readdir implementation ignores the offset parameter, and
- * passes zero to the filler function's offset.  The filler
- * function will not return '1' (unless an error happens), so the
- * whole directory is read in a single readdir operation.  This
- * works just like the old getdir() method.
+ * The 'off' argument is the offset of the last entry already sent,
+ * as we gave it to fuse_add_direntry(); we use the cookies the
+ * backing filesystem put in d_off.
+ */
+void ypfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		  struct fuse_file_info *fi)
+{
+    ypfs_do_readdir(req, ino, size, offset, fi, 0);
+}
+
+/** Read directory with attributes
  *
- * 2) The readdir implementation keeps track of the offsets of the
- * directory entries.  It uses the offset parameter and always
- * passes non-zero offset to the filler function.  When the buffer
- * is full (or an error happens) the filler function will return
- * '1'.
+ * Send a buffer filled using fuse_add_direntry_plus(), with size not
+ * exceeding the requested size.  Send an empty buffer on end of
+ * stream.
  *
- * Introduced in version 2.3
+ * In contrast to readdir() (which does not affect the lookup counts),
+ * the lookup count of every entry returned by readdirplus(), except
+ * "." and "..", is incremented by one.
  */
-int ypfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-	       struct fuse_file_info *fi)
+void ypfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    DIR *dp;
-    struct dirent *de;
-    
-    // once again, no need for fullpath -- but note that I need to cast fi->fh
-    dp = (DIR *) (uintptr_t) fi->fh;
-
-    // Every directory contains at least two entries: . and ..  If my
-    // first call to the system readdir() returns NULL I've got an
-    // error; near as I can tell, that's the only condition under
-    // which I can get an error from readdir()
-    de = readdir(dp);
-    if (de == 0)
-	return -errno;
-
-    // This will copy the entire directory into the buffer.  The loop exits
-    // when either the system readdir() returns NULL, or filler()
-    // returns something non-zero.  The first case just means I've
-    // read the whole directory; the second means the buffer is full.
-    do {
-	if (filler(buf, de->d_name, NULL, 0) != 0)
-	    return -ENOMEM;
-    } while ((de = readdir(dp)) != NULL);
-    
-    
-    return retstat;
+    ypfs_do_readdir(req, ino, size, offset, fi, 1);
 }
 
-/** Release directory
+/** Release an open directory
  *
- * Introduced in version 2.3
+ * For every opendir call there will be exactly one releasedir
+ * call (unless the filesystem is force-unmounted).
  */
-int ypfs_releasedir(const char *path, struct fuse_file_info *fi)
+void ypfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-    
-    closedir((DIR *) (uintptr_t) fi->fh);
-    
-    return retstat;
+    struct ypfs_dir *dir = YPFS_DIR(fi);
+
+    close(dir->fd);
+    free(dir->buf);
+    free(dir);
+
+    ypfs_reply_err(req, 0);
 }
 
 /** Synchronize directory contents
  *
- * If the datasync parameter is non-zero, then only the user data
- * should be flushed, not the meta data
- *
- * Introduced in version 2.3
+ * If the datasync parameter is non-zero, then only the directory
+ * contents should be flushed, not the meta data.
  */
 // when exactly is this called?  when a user calls fsync and it
 // happens to be a directory? ???
-int ypfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+void ypfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-    
-    return retstat;
+    ypfs_reply_err(req, 0);
 }
 
 /**
  * Initialize filesystem
  *
- * The return value will passed in the private_data field of
- * fuse_context to all file operations and as a parameter to the
- * destroy() method.
+ * This function is called when libfuse establishes communication
+ * with the FUSE kernel module.  The file system should use this
+ * module to inspect and/or modify the connection parameters
+ * provided in the `conn` structure.
  *
- * Introduced in version 2.3
- * Changed in version 2.6
+ * 'userdata' is what we passed to fuse_session_new().
  */
-// Undocumented but extraordinarily useful fact:  the fuse_context is
-// set up before this function is called, and
-// fuse_get_context()->private_data returns the user_data passed to
-// fuse_main().  Really seems like either it should be a third
-// parameter coming in here, or else the fact should be documented
-// (and this might as well return void, as it did in older versions of
-// FUSE).
-void *ypfs_init(struct fuse_conn_info *conn)
+void ypfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-    
-    
-    return YPFS_DATA;
+    struct ypfs_state *state = userdata;
+
+    // Everything below is reached relative to this, so whatever
+    // happens to the rootdir path after mount, we stay on the
+    // directory we were mounted over.
+    state->rootfd = open(state->rootdir, O_PATH | O_DIRECTORY);
+    if (state->rootfd < 0) {
+	perror("ypfs_init open rootdir");
+	abort();
+    }
+    state->inodes = ypfs_inodes_new(state->rootfd);
+    if (state->inodes == NULL) {
+	perror("ypfs_init inodes_new");
+	abort();
+    }
+
+    // Let data move between /dev/fuse and the backing files by
+    // splice(), unless asked to copy it for comparison
+    if (!state->copy_io)
+	conn->want |= conn->capable
+	    & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    // Ask for writes as big as we may have, rather than the 128K
+    // default: fewer requests per file copied in.  libfuse holds this
+    // to what its buffers and the kernel's max_pages allow.
+    if (state->max_write > 0)
+	conn->max_write = (unsigned) state->max_write << 10;
+
+    if (state->attr_cache > 0) {
+	state->attrs = ypfs_attrcache_new(state->attr_cache);
+	if (state->attrs == NULL)
+	    perror("ypfs_init attrcache_new; not caching attributes");
+    }
+
+    if (state->thumb_cache > 0) {
+	state->thumbs = ypfs_thumbcache_new((size_t) state->thumb_cache << 20);
+	if (state->thumbs == NULL)
+	    perror("ypfs_init thumbcache_new; no .thumbs");
+    }
+
+    // /.ypfs/stats needs a /.ypfs to be in
+    if (state->stats != NULL)
+	mkdirat(state->rootfd, YPFS_CATALOG_DIR, S_IRWXU);
+
+    // Before anything that runs ingest, which is traced too
+    if (state->trace_path != NULL) {
+	state->trace = ypfs_trace_open(state->rootfd, state->trace_path);
+	if (state->trace == NULL)
+	    perror("ypfs_init trace_open; not tracing");
+    }
+
+    // Learn the /Dates/Y/M/D directories that are already there
+    ypfs_dircache_fill(state->dirs, state->rootfd, "/Dates", 3);
+
+    if (!state->no_catalog) {
+	if (state->catalog_path == NULL) {
+	    state->catalog_path = YPFS_CATALOG_DEFAULT;
+	    mkdirat(state->rootfd, YPFS_CATALOG_DIR, S_IRWXU);
+	}
+	state->catalog = ypfs_catalog_open(state->rootfd, state->catalog_path);
+	if (state->catalog == NULL)
+	    perror("ypfs_init catalog_open; not cataloging");
+    }
+
+    // What is already sorted comes from the catalog, while requests
+    // are served
+    if (!state->no_dedup) {
+	state->dedup = ypfs_dedup_new(state->rootfd);
+	if (state->dedup == NULL)
+	    perror("ypfs_init dedup_new; not collapsing duplicates");
+	else
+	    ypfs_dedup_load(state->dedup, state->catalog);
+    }
+
+    // Threads are started here rather than in main(), since
+    // fuse_daemonize() forks into the background after mounting.
+    // Ingest makes its calls through the ring, and like scans and
+    // imports tells the kernel what it changed, so those come first.
+    if (state->se != NULL) {
+	state->notifier = ypfs_notifier_start(state);
+	if (state->notifier == NULL)
+	    perror("ypfs_init notifier_start; not telling the kernel about ingest");
+    }
+
+    if (state->uring_depth > 0) {
+	state->uring = ypfs_uring_new(state->uring_depth);
+	if (state->uring == NULL)
+	    perror("ypfs_init uring_new; using plain syscalls");
+    }
+
+    if (state->ingest_threads > 0) {
+	state->ingest = ypfs_ingest_start(state, state->ingest_threads,
+					  state->ingest_queue);
+	if (state->ingest == NULL)
+	    perror("ypfs_init ingest_start; sorting in release instead");
+    }
+
+    if (state->prefetch_files > 0 && state->prefetch_mb > 0) {
+	state->prefetch = ypfs_prefetch_start(state->rootfd, state->prefetch_files,
+					      (size_t) state->prefetch_mb << 20);
+	if (state->prefetch == NULL)
+	    perror("ypfs_init prefetch_start; not prefetching");
+    }
+
+    // The scan runs alongside requests; nothing waits for it
+    if (state->scan_threads > 0) {
+	state->scan = ypfs_scan_new(state, state->scan_threads);
+	if (state->scan == NULL)
+	    perror("ypfs_init scan_new");
+	else if (state->scan_at_mount && ypfs_scan_start(state->scan) < 0)
+	    fprintf(stderr, "ypfs_init: couldn't start the scan\n");
+    }
+
+    // Imports wait to be asked for
+    if (state->import_threads > 0) {
+	state->import = ypfs_import_new(state, state->import_threads);
+	if (state->import == NULL)
+	    perror("ypfs_init import_new");
+    }
 }
 
 /**
  * Clean up filesystem
  *
  * Called on filesystem exit.
- *
- * Introduced in version 2.3
  */
 void ypfs_destroy(void *userdata)
 {
+    struct ypfs_state *state = userdata;
+
+    // the scanner feeds ingest, so it goes first; imports write to
+    // the catalog
+    ypfs_scan_free(state->scan);
+    state->scan = NULL;
+    ypfs_import_free(state->import);
+    state->import = NULL;
+    ypfs_ingest_stop(state->ingest);
+    state->ingest = NULL;
+    ypfs_prefetch_stop(state->prefetch);
+    state->prefetch = NULL;
+    ypfs_uring_free(state->uring);
+    state->uring = NULL;
+    ypfs_notifier_stop(state->notifier);
+    state->notifier = NULL;
+    ypfs_trace_close(state->trace);
+    state->trace = NULL;
+    ypfs_dedup_free(state->dedup);
+    state->dedup = NULL;
+    ypfs_catalog_close(state->catalog);
+    state->catalog = NULL;
+    ypfs_inodes_free(state->inodes);
+    state->inodes = NULL;
+    ypfs_thumbcache_free(state->thumbs);
+    state->thumbs = NULL;
+    ypfs_attrcache_free(state->attrs);
+    state->attrs = NULL;
+    close(state->rootfd);
 }
 
 /**
  * Check file access permissions
  *
- * This will be called for the access() system call.  If the
- * 'default_permissions' mount option is given, this method is not
- * called.
- *
- * This method is not called under Linux kernel versions 2.4.x
- *
- * Introduced in version 2.5
+ * This will be called for the access() and chdir() system
+ * calls.  If the 'default_permissions' mount option is given,
+ * this method is not called.
  */
-int ypfs_access(const char *path, int mask)
+void ypfs_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-   
-    ypfs_fullpath(fpath, path);
-    
-    retstat = access(fpath, mask);
-    
+    char procpath[64];
+
+    if ((mask & W_OK) && ypfs_virtual(req, ino)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
+
+    ypfs_procpath(procpath, ypfs_inode(req, ino)->fd);
+
+    retstat = faccessat(AT_FDCWD, procpath, mask, 0);
     if (retstat < 0)
-	retstat = ypfs_error("ypfs_access access");
-    
-    return retstat;
+	retstat = ypfs_error("ypfs_access faccessat");
+
+    ypfs_reply_err(req, -retstat);
 }
 
 /**
@@ -808,84 +2328,60 @@ int ypfs_access(const char *path, int mask)
  * If this method is not implemented or under Linux kernel
  * versions earlier than 2.6.15, the mknod() and open() methods
  * will be called instead.
- *
- * Introduced in version 2.5
  */
-int ypfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+void ypfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		 struct fuse_file_info *fi)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct fuse_entry_param e;
     int fd;
-    
-    ypfs_fullpath(fpath, path);
-    
-    fd = creat(fpath, mode);
-    if (fd < 0)
-	retstat = ypfs_error("ypfs_create creat");
-    
-    fi->fh = fd;
-    
-    
-    return retstat;
-}
 
-/**
- * Change the size of an open file
- *
- * This method is called instead of the truncate() method if the
- * truncation was invoked from an ftruncate() system call.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the truncate() method will be
- * called instead.
- *
- * Introduced in version 2.5
- */
-int ypfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
-{
-    int retstat = 0;
-    
-    
-    retstat = ftruncate(fi->fh, offset);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_ftruncate ftruncate");
-    
-    return retstat;
-}
+    if (ypfs_virtual(req, parent)) {
+	ypfs_reply_err(req, EROFS);
+	return;
+    }
 
-/**
- * Get attributes from an open file
- *
- * This method is called instead of the getattr() method if the
- * file information is available.
- *
- * Currently this is only called after the create() method if that
- * is implemented (see above).  Later it may be called for
- * invocations of fstat() too.
- *
- * Introduced in version 2.5
- */
-// Since it's currently only called after ypfs_create(), and ypfs_create()
-// opens the file, I ought to be able to just use the fd and ignore
-// the path...
-int ypfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
-{
-    int retstat = 0;
-    
-    
-    retstat = fstat(fi->fh, statbuf);
-    if (retstat < 0)
-	retstat = ypfs_error("ypfs_fgetattr fstat");
-    
-    
-    return retstat;
+    // Readable as well as whatever was asked for, so that ingest can
+    // read the EXIF date back through this same descriptor at
+    // release.  The mode doesn't stop us reading a file we just
+    // created.
+    fd = openat(ypfs_inode(req, parent)->fd, name,
+		(fi->flags & ~(O_ACCMODE | O_NOFOLLOW)) | O_CREAT | O_RDWR, mode);
+    if (fd < 0) {
+	ypfs_reply_err(req, -ypfs_error("ypfs_create openat"));
+	return;
+    }
+
+    ypfs_invalidate(req, ypfs_inode(req, parent));
+
+    retstat = ypfs_inode_lookup(YPFS_DATA(req)->inodes, parent, name, &e);
+    if (retstat == 0) {
+	retstat = ypfs_file_new(req, ypfs_inode(req, e.ino), fd, fi);
+	if (retstat < 0)
+	    ypfs_inode_forget(YPFS_DATA(req)->inodes, e.ino, 1);
+	else
+	    YPFS_FILE(fi)->changed = 1;
+    }
+    if (retstat < 0) {
+	close(fd);
+	ypfs_reply_err(req, -retstat);
+	return;
+    }
+    e.attr_timeout = ypfs_timeout(YPFS_DATA(req), ypfs_inode(req, e.ino));
+    e.entry_timeout = e.attr_timeout;
+
+    fuse_reply_create(req, &e, fi);
 }
 
-struct fuse_operations ypfs_oper = {
+struct fuse_lowlevel_ops ypfs_oper = {
+  .init = ypfs_init,
+  .destroy = ypfs_destroy,
+  .lookup = ypfs_lookup,
+  .forget = ypfs_forget,
+  .forget_multi = ypfs_forget_multi,
   .getattr = ypfs_getattr,
+  .setattr = ypfs_setattr,
   .readlink = ypfs_readlink,
-  // no .getdir -- that's deprecated
-  .getdir = NULL,
   .mknod = ypfs_mknod,
   .mkdir = ypfs_mkdir,
   .unlink = ypfs_unlink,
@@ -893,14 +2389,10 @@ struct fuse_operations ypfs_oper = {
   .symlink = ypfs_symlink,
   .rename = ypfs_rename,
   .link = ypfs_link,
-  .chmod = ypfs_chmod,
-  .chown = ypfs_chown,
-  .truncate = ypfs_truncate,
-  .utime = ypfs_utime,
   .open = ypfs_open,
   .read = ypfs_read,
   .write = ypfs_write,
-  /** Just a placeholder, don't set */ // huh???
+  .write_buf = ypfs_write_buf,
   .statfs = ypfs_statfs,
   .flush = ypfs_flush,
   .release = ypfs_release,
@@ -911,53 +2403,193 @@ struct fuse_operations ypfs_oper = {
   .removexattr = ypfs_removexattr,
   .opendir = ypfs_opendir,
   .readdir = ypfs_readdir,
+  .readdirplus = ypfs_readdirplus,
   .releasedir = ypfs_releasedir,
   .fsyncdir = ypfs_fsyncdir,
-  .init = ypfs_init,
-  .destroy = ypfs_destroy,
   .access = ypfs_access,
   .create = ypfs_create,
-  .ftruncate = ypfs_ftruncate,
-  .fgetattr = ypfs_fgetattr
+  .copy_file_range = ypfs_copy_file_range
 };
 
 void ypfs_usage()
 {
-    fprintf(stderr, "usage:  bbfs rootDir mountPoint\n");
+    fprintf(stderr, "usage:  ypfs [FUSE and mount options] rootDir mountPoint\n"
+	    "\n"
+	    "ypfs options:\n"
+	    "    -o ingest_threads=N    threads sorting files into /Dates (0 = sort in release)\n"
+	    "    -o ingest_queue=N      files that may wait for an ingest thread\n"
+	    "    -o attr_cache=N        file attributes to cache (0 = none)\n"
+	    "    -o archive_timeout=T   seconds to cache names and attributes under /Dates\n"
+	    "    -o inbox_timeout=T     seconds to cache them elsewhere\n"
+	    "    -o negative_timeout=T  seconds to cache missing .xmp, .DS_Store, Thumbs.db\n"
+	    "    -o thumb_cache=MB      memory for .thumbs thumbnails, see thumbcache.h (0 = no .thumbs)\n"
+	    "    -o stats               time requests for " YPFS_CATALOG_DIR "/" YPFS_STATS_FILE ", see stats.h\n"
+	    "    -o trace=FILE          binary event trace, relative to rootDir/" YPFS_CATALOG_DIR ", see trace.h\n"
+	    "    -o copy_io             read and write through a buffer instead of splicing\n"
+	    "    -o max_write=KB        largest write request to ask the kernel for\n"
+	    "    -o write_buffer=KB     gather each handle's sequential writes (0 = write through)\n"
+	    "    -o prefetch=N          files of a day to read ahead of one read in order, see prefetch.h (0 = none)\n"
+	    "    -o prefetch_mb=MB      most to read ahead of each one\n"
+	    "    -o uring=N             read, write, fsync and ingest through an io_uring of N entries, see uring.h (0 = none)\n"
+	    "    -o catalog=FILE        photo catalog, relative to rootDir (" YPFS_CATALOG_DEFAULT ")\n"
+	    "    -o no_catalog          don't keep a catalog\n"
+	    "    -o no_dedup            store duplicate files again, see dedup.h\n"
+	    "    -o scan                scan rootDir at mount, see scan.h\n"
+	    "    -o scan_threads=N      threads for scanning (0 = no scanning)\n"
+	    "    -o import_threads=N    threads copying in bulk imports, see import.h (0 = none)\n");
     abort();
 }
 
+#define YPFS_OPT(t, p) { t, offsetof(struct ypfs_state, p), 0 }
+
+static struct fuse_opt ypfs_opts[] = {
+    YPFS_OPT("ingest_threads=%d", ingest_threads),
+    YPFS_OPT("ingest_queue=%d", ingest_queue),
+    YPFS_OPT("attr_cache=%d", attr_cache),
+    YPFS_OPT("archive_timeout=%lf", archive_timeout),
+    YPFS_OPT("inbox_timeout=%lf", inbox_timeout),
+    YPFS_OPT("negative_timeout=%lf", negative_timeout),
+    YPFS_OPT("thumb_cache=%d", thumb_cache),
+    { "stats", offsetof(struct ypfs_state, stats_enabled), 1 },
+    YPFS_OPT("trace=%s", trace_path),
+    { "copy_io", offsetof(struct ypfs_state, copy_io), 1 },
+    YPFS_OPT("max_write=%d", max_write),
+    YPFS_OPT("write_buffer=%d", write_buffer),
+    YPFS_OPT("prefetch=%d", prefetch_files),
+    YPFS_OPT("prefetch_mb=%d", prefetch_mb),
+    YPFS_OPT("uring=%d", uring_depth),
+    YPFS_OPT("catalog=%s", catalog_path),
+    { "no_catalog", offsetof(struct ypfs_state, no_catalog), 1 },
+    { "no_dedup", offsetof(struct ypfs_state, no_dedup), 1 },
+    { "scan", offsetof(struct ypfs_state, scan_at_mount), 1 },
+    YPFS_OPT("scan_threads=%d", scan_threads),
+    YPFS_OPT("import_threads=%d", import_threads),
+    FUSE_OPT_END
+};
+
+// libfuse is able to do most of the command line parsing; all I
+// need to do is to extract the rootdir; this will be the first
+// non-option passed in.  I'm using the GNU non-standard extension
+// and having realpath malloc the space for the path
+// the string.
+static int ypfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    struct ypfs_state *ypfs_data = data;
+
+    if (key == FUSE_OPT_KEY_NONOPT && ypfs_data->rootdir == NULL) {
+	ypfs_data->rootdir = realpath(arg, NULL);
+	if (ypfs_data->rootdir == NULL) {
+	    perror(arg);
+	    abort();
+	}
+	return 0;
+    }
+
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
-    int i;
     int fuse_stat;
     struct ypfs_state *ypfs_data;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config config;
+    struct fuse_session *se;
 
     ypfs_data = calloc(sizeof(struct ypfs_state), 1);
     if (ypfs_data == NULL) {
 	perror("main calloc");
 	abort();
     }
-    
 
-    // libfuse is able to do most of the command line parsing; all I
-    // need to do is to extract the rootdir; this will be the first
-    // non-option passed in.  I'm using the GNU non-standard extension
-    // and having realpath malloc the space for the path
-    // the string.
-    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++);
-    if (i == argc)
+    ypfs_data->dirs = ypfs_dircache_new();
+    if (ypfs_data->dirs == NULL) {
+	perror("main dircache_new");
+	abort();
+    }
+
+    ypfs_data->ingest_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ypfs_data->ingest_threads < 1)
+	ypfs_data->ingest_threads = 1;
+    ypfs_data->ingest_queue = 256;
+    ypfs_data->attr_cache = 65536;
+    ypfs_data->archive_timeout = 3600.0;
+    ypfs_data->inbox_timeout = 1.0;
+    ypfs_data->negative_timeout = 10.0;
+    ypfs_data->thumb_cache = 64;
+    ypfs_data->max_write = 1024;
+    ypfs_data->prefetch_files = 4;
+    ypfs_data->prefetch_mb = 64;
+    ypfs_data->scan_threads = ypfs_data->ingest_threads;
+    ypfs_data->import_threads = ypfs_data->ingest_threads;
+
+    if (fuse_opt_parse(&args, ypfs_data, ypfs_opts, ypfs_opt_proc) < 0)
+	ypfs_usage();
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+	ypfs_usage();
+    if (opts.show_help) {
+	fprintf(stderr, "usage:  ypfs [options] rootDir mountPoint\n\n");
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+	return 0;
+    }
+    if (opts.show_version) {
+	fuse_lowlevel_version();
+	return 0;
+    }
+    if (ypfs_data->rootdir == NULL || opts.mountpoint == NULL
+	|| ypfs_data->ingest_threads < 0 || ypfs_data->ingest_queue < 1
+	|| ypfs_data->scan_threads < 0 || ypfs_data->import_threads < 0
+	|| ypfs_data->attr_cache < 0 || ypfs_data->thumb_cache < 0
+	|| ypfs_data->max_write < 0 || ypfs_data->write_buffer < 0
+	|| ypfs_data->prefetch_files < 0 || ypfs_data->prefetch_mb < 0
+	|| ypfs_data->uring_depth < 0
+	|| ypfs_data->archive_timeout < 0
+	|| ypfs_data->inbox_timeout < 0 || ypfs_data->negative_timeout < 0)
 	ypfs_usage();
-    
-    ypfs_data->rootdir = realpath(argv[i], NULL);
 
-    for (; i < argc; i++)
-	   argv[i] = argv[i+1];
-    argc--;
+    // write_buf takes over from write whenever it is there
+    if (ypfs_data->copy_io)
+	ypfs_oper.write_buf = NULL;
 
-    fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &ypfs_oper, ypfs_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
-    
-    return fuse_stat;
+    // Timing goes around the table as it ends up.  The trace only
+    // starts in ypfs_init(), but the wrappers look for it then.
+    if (ypfs_data->stats_enabled) {
+	ypfs_data->stats = ypfs_stats_new();
+	if (ypfs_data->stats == NULL)
+	    perror("main stats_new; not timing");
+    }
+    if (ypfs_data->stats != NULL || ypfs_data->trace_path != NULL)
+	ypfs_stats_wrap(&ypfs_oper);
+
+    se = fuse_session_new(&args, &ypfs_oper, sizeof(ypfs_oper), ypfs_data);
+    if (se == NULL)
+	return 1;
+    ypfs_data->se = se;
+    if (fuse_set_signal_handlers(se) != 0)
+	return 1;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+	return 1;
+
+    fuse_daemonize(opts.foreground);
+
+    fprintf(stderr, "about to run the fuse session loop\n");
+    if (opts.singlethread)
+	fuse_stat = fuse_session_loop(se);
+    else {
+	config.clone_fd = opts.clone_fd;
+	config.max_idle_threads = opts.max_idle_threads;
+	fuse_stat = fuse_session_loop_mt(se, &config);
+    }
+    fprintf(stderr, "fuse session loop returned %d\n", fuse_stat);
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    ypfs_stats_free(ypfs_data->stats);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return fuse_stat ? 1 : 0;
 }
@@ -0,0 +1,140 @@
+/*
+  ypfscat: look at the photo catalog ypfs keeps under rootDir
+
+    ypfscat rootDir list [FROM [TO]]
+	photos captured from FROM up to (not including) TO, in capture
+	order; dates are YYYY, YYYY-MM or YYYY-MM-DD
+
+    ypfscat rootDir check
+	compare the catalog with the files in rootDir; exits 1 if they
+	differ
+
+  It can run while ypfs is mounted on rootDir: the catalog is only
+  read, as it was when ypfscat started.
+
+  gcc -Wall -pthread -o ypfscat ypfscat.c catalog.c
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+
+static void ypfscat_usage(void)
+{
+    fprintf(stderr, "usage:  ypfscat [-c catalog] rootDir list [FROM [TO]]\n"
+	    "        ypfscat [-c catalog] rootDir check\n");
+    exit(2);
+}
+
+// YYYY[-MM[-DD]] as seconds, in the catalog's wall-clock-as-UTC
+// terms; 'end' gives the start of the following year/month/day
+static int64_t ypfscat_date(const char *arg, int end)
+{
+    struct tm tm;
+    int year, month = 1, day = 1;
+    int n;
+
+    n = sscanf(arg, "%d-%d-%d", &year, &month, &day);
+    if (n < 1 || month < 1 || month > 12 || day < 1 || day > 31)
+	ypfscat_usage();
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    if (end) {
+	if (n == 1)
+	    tm.tm_year++;
+	else if (n == 2)
+	    tm.tm_mon++;
+	else
+	    tm.tm_mday++;
+    }
+    return timegm(&tm);
+}
+
+static int ypfscat_print(const struct ypfs_catalog_record *rec, void *arg)
+{
+    time_t capture = rec->capture;
+    struct tm tm;
+    char when[32];
+
+    gmtime_r(&capture, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s%c %12" PRIu64 "  %-20s %s\n", when,
+	   (rec->flags & YPFS_CATALOG_EXIF_DATE) ? ' ' : '*',
+	   rec->size, rec->model[0] ? rec->model : "-", rec->path);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *catalog_path = YPFS_CATALOG_DEFAULT;
+    struct ypfs_catalog *cat;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int rootfd;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1)
+	if (opt == 'c')
+	    catalog_path = optarg;
+	else
+	    ypfscat_usage();
+    argc -= optind;
+    argv += optind;
+    if (argc < 2)
+	ypfscat_usage();
+
+    rootfd = open(argv[0], O_PATH | O_DIRECTORY);
+    if (rootfd < 0) {
+	perror(argv[0]);
+	return 2;
+    }
+    cat = ypfs_catalog_open_readonly(rootfd, catalog_path);
+    if (cat == NULL) {
+	perror(catalog_path);
+	return 2;
+    }
+
+    if (strcmp(argv[1], "list") == 0 && argc <= 4) {
+	if (argc > 2)
+	    from = ypfscat_date(argv[2], 0);
+	if (argc > 3)
+	    to = ypfscat_date(argv[3], 1);
+	else if (argc > 2)
+	    to = ypfscat_date(argv[2], 1);
+	ret = ypfs_catalog_range(cat, from, to, ypfscat_print, NULL);
+	if (ret < 0) {
+	    fprintf(stderr, "ypfscat: %s\n", strerror(-ret));
+	    ret = 2;
+	}
+    } else if (strcmp(argv[1], "check") == 0 && argc == 2) {
+	ret = ypfs_catalog_check(cat, rootfd, stdout);
+	if (ret < 0) {
+	    fprintf(stderr, "ypfscat: %s\n", strerror(-ret));
+	    ret = 2;
+	} else {
+	    fprintf(stderr, "%zu records, %d differences\n", ypfs_catalog_count(cat), ret);
+	    ret = ret > 0;
+	}
+    } else
+	ypfscat_usage();
+
+    ypfs_catalog_close(cat);
+    close(rootfd);
+
+    return ret;
+}
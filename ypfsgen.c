@@ -0,0 +1,346 @@
+/*
+  ypfsgen: make synthetic photos for benchmarking ypfs
+
+    ypfsgen [-n COUNT] [-s SIZE] [-t KIND] [-d YYYY-MM-DD] [-D DAYS] [-T] dir
+
+  writes COUNT files of SIZE bytes (K, M and G suffixes allowed) into
+  dir.  KIND is one of
+
+    jpeg   JPEG with an EXIF APP1: camera model, DateTimeOriginal and
+           a small embedded thumbnail, then filler image data
+    tiff   TIFF with the same tags
+    plain  no EXIF at all, dated only by its mtime
+    video  like plain, named .MP4; for the large-file cases
+
+  File i is dated on the (i % DAYS)th day after the start date, in
+  the afternoon, local time, a second after the file before it that
+  day; plain and video files get that as
+  their mtime.  With -T the files go where ypfs would have sorted
+  them, in dir/Dates/YYYY/MM/DD, to make a big archive to browse
+  without ingesting it first.  The filler is pseudo-random, so the
+  files don't compress or deduplicate, and is the same every run.
+
+  gcc -Wall -o ypfsgen ypfsgen.c
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define GEN_CHUNK (1024 * 1024)
+#define GEN_THUMB 2048
+
+enum gen_kind { GEN_JPEG, GEN_TIFF, GEN_PLAIN, GEN_VIDEO };
+
+static void ypfsgen_usage(void)
+{
+    fprintf(stderr, "usage:  ypfsgen [-n count] [-s size] [-t jpeg|tiff|plain|video]\n"
+	    "                [-d YYYY-MM-DD] [-D days] [-T] dir\n");
+    exit(2);
+}
+
+static uint64_t gen_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*, plenty for filler
+static uint64_t gen_random(void)
+{
+    gen_state ^= gen_state >> 12;
+    gen_state ^= gen_state << 25;
+    gen_state ^= gen_state >> 27;
+    return gen_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void gen_fill(unsigned char *buf, size_t len)
+{
+    uint64_t r;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+	r = gen_random();
+	memcpy(buf + i, &r, 8);
+    }
+    for (; i < len; i++)
+	buf[i] = gen_random();
+}
+
+static off_t gen_size(const char *arg)
+{
+    char *end;
+    double n = strtod(arg, &end);
+
+    if (end == arg || n < 0)
+	ypfsgen_usage();
+    switch (*end) {
+    case 'g': case 'G': n *= 1024;	// fall through
+    case 'm': case 'M': n *= 1024;	// fall through
+    case 'k': case 'K': n *= 1024;	// fall through
+    case '\0': break;
+    default: ypfsgen_usage();
+    }
+    return (off_t) n;
+}
+
+static void put16(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static unsigned char *gen_entry(unsigned char *p, unsigned tag, unsigned type, uint32_t count,
+				uint32_t value)
+{
+    put16(p, tag);
+    put16(p + 2, type);
+    put32(p + 4, count);
+    put32(p + 8, value);
+    return p + 12;
+}
+
+// A little-endian TIFF with IFD0 (Model, Exif IFD), the Exif IFD
+// (DateTimeOriginal) and IFD1 (thumbnail), into 'buf'.  Returns its
+// length.
+static size_t gen_tiff(unsigned char *buf, const struct tm *tm)
+{
+    const uint32_t ifd0 = 8, exif = ifd0 + 30, ifd1 = exif + 18;
+    const uint32_t model = ifd1 + 30, date = model + 16, thumb = date + 20;
+    unsigned char *p;
+
+    memcpy(buf, "II*\0", 4);
+    put32(buf + 4, ifd0);
+
+    p = buf + ifd0;
+    put16(p, 2);
+    p = gen_entry(p + 2, 0x0110, 2, 16, model);
+    p = gen_entry(p, 0x8769, 4, 1, exif);
+    put32(p, ifd1);
+
+    p = buf + exif;
+    put16(p, 1);
+    p = gen_entry(p + 2, 0x9003, 2, 20, date);
+    put32(p, 0);
+
+    p = buf + ifd1;
+    put16(p, 2);
+    p = gen_entry(p + 2, 0x0201, 4, 1, thumb);
+    p = gen_entry(p, 0x0202, 4, 1, GEN_THUMB);
+    put32(p, 0);
+
+    memset(buf + model, 0, 16);
+    memcpy(buf + model, "ypfsgen", 7);
+    strftime((char *) buf + date, 20, "%Y:%m:%d %H:%M:%S", tm);
+
+    p = buf + thumb;
+    gen_fill(p, GEN_THUMB);
+    p[0] = 0xFF;
+    p[1] = 0xD8;
+    p[GEN_THUMB - 2] = 0xFF;
+    p[GEN_THUMB - 1] = 0xD9;
+
+    return thumb + GEN_THUMB;
+}
+
+// The metadata a file of 'kind' starts with, into 'buf'.  Returns its
+// length.
+static size_t gen_header(unsigned char *buf, enum gen_kind kind, const struct tm *tm)
+{
+    size_t len;
+
+    switch (kind) {
+    case GEN_JPEG:
+	// SOI, APP1 "Exif\0\0" + TIFF, then SOS, after which nobody
+	// looks for metadata
+	buf[0] = 0xFF;
+	buf[1] = 0xD8;
+	buf[2] = 0xFF;
+	buf[3] = 0xE1;
+	memcpy(buf + 6, "Exif\0\0", 6);
+	len = gen_tiff(buf + 12, tm);
+	buf[4] = (len + 8) >> 8;
+	buf[5] = len + 8;
+	len += 12;
+	memcpy(buf + len, "\xFF\xDA\x00\x02", 4);
+	return len + 4;
+    case GEN_TIFF:
+	return gen_tiff(buf, tm);
+    default:
+	return 0;
+    }
+}
+
+static int gen_write(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t n;
+
+    for (; len > 0; buf += n, len -= n) {
+	n = write(fd, buf, len);
+	if (n < 0)
+	    return -errno;
+    }
+    return 0;
+}
+
+// One file of at least 'size' bytes: the header, filler, and for a
+// JPEG an end of image so viewers don't complain
+static int gen_file(const char *path, enum gen_kind kind, const struct tm *tm, off_t size,
+		    unsigned char *buf)
+{
+    struct tm copy = *tm;
+    struct timespec times[2];
+    off_t tail = kind == GEN_JPEG ? 2 : 0;
+    off_t done;
+    size_t len;
+    int ret;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+	return -errno;
+
+    done = gen_header(buf, kind, tm);
+    ret = gen_write(fd, buf, done);
+    while (ret == 0 && done + tail < size) {
+	len = size - tail - done < GEN_CHUNK ? size - tail - done : GEN_CHUNK;
+	gen_fill(buf, len);
+	ret = gen_write(fd, buf, len);
+	done += len;
+    }
+    if (ret == 0 && tail > 0)
+	ret = gen_write(fd, (const unsigned char *) "\xFF\xD9", 2);
+
+    if (ret == 0 && (kind == GEN_PLAIN || kind == GEN_VIDEO)) {
+	times[0].tv_sec = times[1].tv_sec = mktime(&copy);
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (futimens(fd, times) < 0)
+	    ret = -errno;
+    }
+
+    if (close(fd) < 0 && ret == 0)
+	ret = -errno;
+    return ret;
+}
+
+// mkdir -p, for the directories of -T
+static int gen_mkdirs(char *path)
+{
+    char *slash;
+
+    for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+	*slash = '\0';
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+	    *slash = '/';
+	    return -errno;
+	}
+	*slash = '/';
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *exts[] = { "JPG", "TIF", "BIN", "MP4" };
+    enum gen_kind kind = GEN_JPEG;
+    long count = 100;
+    off_t size = 0;
+    int days = 30;
+    int tree = 0;
+    struct tm start, tm;
+    char path[PATH_MAX];
+    unsigned char *buf;
+    long i;
+    int opt;
+    int ret;
+
+    memset(&start, 0, sizeof(start));
+    start.tm_year = 2010 - 1900;
+    start.tm_mday = 1;
+
+    while ((opt = getopt(argc, argv, "n:s:t:d:D:T")) != -1)
+	switch (opt) {
+	case 'n':
+	    count = atol(optarg);
+	    break;
+	case 's':
+	    size = gen_size(optarg);
+	    break;
+	case 't':
+	    if (strcmp(optarg, "jpeg") == 0)
+		kind = GEN_JPEG;
+	    else if (strcmp(optarg, "tiff") == 0)
+		kind = GEN_TIFF;
+	    else if (strcmp(optarg, "plain") == 0)
+		kind = GEN_PLAIN;
+	    else if (strcmp(optarg, "video") == 0)
+		kind = GEN_VIDEO;
+	    else
+		ypfsgen_usage();
+	    break;
+	case 'd':
+	    if (sscanf(optarg, "%d-%d-%d", &start.tm_year, &start.tm_mon, &start.tm_mday) != 3)
+		ypfsgen_usage();
+	    start.tm_year -= 1900;
+	    start.tm_mon--;
+	    break;
+	case 'D':
+	    days = atoi(optarg);
+	    break;
+	case 'T':
+	    tree = 1;
+	    break;
+	default:
+	    ypfsgen_usage();
+	}
+    if (optind != argc - 1 || count < 0 || days < 1)
+	ypfsgen_usage();
+
+    buf = malloc(GEN_CHUNK);
+    if (buf == NULL) {
+	perror("ypfsgen malloc");
+	return 1;
+    }
+    if (mkdir(argv[optind], 0755) < 0 && errno != EEXIST) {
+	perror(argv[optind]);
+	return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+	tm = start;
+	tm.tm_mday += i % days;
+	tm.tm_hour = 12;
+	tm.tm_sec = (i / days) % (12 * 3600);
+	tm.tm_isdst = -1;
+	mktime(&tm);
+
+	if (tree) {
+	    snprintf(path, sizeof(path), "%s/Dates/%04d/%02d/%02d/IMG_%07ld.%s", argv[optind],
+		     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, i, exts[kind]);
+	    ret = gen_mkdirs(path);
+	} else {
+	    snprintf(path, sizeof(path), "%s/IMG_%07ld.%s", argv[optind], i, exts[kind]);
+	    ret = 0;
+	}
+	if (ret == 0)
+	    ret = gen_file(path, kind, &tm, size, buf);
+	if (ret < 0) {
+	    fprintf(stderr, "ypfsgen: %s: %s\n", path, strerror(-ret));
+	    return 1;
+	}
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  ypfstrace: decode a trace written with ypfs -o trace=FILE
+
+    ypfstrace [-s] [-o op] FILE
+
+  prints one line per record: when the op began, the thread, the op,
+  its latency in microseconds, errno name or "-", then the inode (the
+  parent for ops on a name), file handle, offset, size and the hash of
+  the name or path, as trace.h describes them.  Records come in the
+  order they were collected, which is time order within each thread;
+  -s sorts them all by time.  -o keeps only op, say "release" or
+  "ingest.hash".  How many records the daemon had to drop, when a
+  thread got too far ahead of its flusher, goes to stderr at the end.
+
+  gcc -Wall -pthread -o ypfstrace ypfstrace.c trace.c
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void ypfstrace_usage(void)
+{
+    fprintf(stderr, "usage:  ypfstrace [-s] [-o op] file\n");
+    exit(2);
+}
+
+static int ypfstrace_cmp(const void *a, const void *b)
+{
+    const struct ypfs_trace_record *ra = a, *rb = b;
+
+    return ra->time < rb->time ? -1 : ra->time > rb->time;
+}
+
+static void ypfstrace_print(const struct ypfs_trace_header *header,
+			    const struct ypfs_trace_record *rec)
+{
+    const char *name = ypfs_trace_op_name(rec->op);
+    const char *err;
+    int64_t nsec = header->start_nsec + rec->time % 1000000000;
+    time_t sec = header->start_sec + rec->time / 1000000000 + nsec / 1000000000;
+    char when[32];
+    char op[16];
+    struct tm tm;
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    if (name == NULL) {
+	snprintf(op, sizeof(op), "op%u", rec->op);
+	name = op;
+    }
+
+    if (rec->op == YPFS_TRACE_DROPPED) {
+	printf("%s.%09" PRId64 " %7u %-16s %" PRIu64 " records\n", when, nsec % 1000000000,
+	       rec->tid, name, rec->size);
+	return;
+    }
+
+    err = rec->err == 0 ? "-" : strerrorname_np(rec->err);
+    printf("%s.%09" PRId64 " %7u %-16s %12.3f %-10s %16" PRIx64 " %16" PRIx64 " %12" PRId64
+	   " %10" PRIu64 " %016" PRIx64 "\n", when, nsec % 1000000000, rec->tid, name,
+	   rec->latency / 1e3, err != NULL ? err : "?", rec->ino, rec->fh, rec->offset, rec->size,
+	   rec->path);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ypfs_trace_header header;
+    struct ypfs_trace_record *recs = NULL;
+    size_t count = 0, alloc = 0;
+    uint64_t dropped = 0;
+    const char *only = NULL;
+    const char *name;
+    int sort = 0;
+    FILE *f;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "so:")) != -1)
+	if (opt == 's')
+	    sort = 1;
+	else if (opt == 'o')
+	    only = optarg;
+	else
+	    ypfstrace_usage();
+    if (optind != argc - 1)
+	ypfstrace_usage();
+
+    f = fopen(argv[optind], "r");
+    if (f == NULL) {
+	perror(argv[optind]);
+	return 2;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1
+	|| memcmp(header.magic, YPFS_TRACE_MAGIC, sizeof(header.magic)) != 0
+	|| header.record_size != sizeof(struct ypfs_trace_record)) {
+	fprintf(stderr, "ypfstrace: %s: not a trace from this version of ypfs\n", argv[optind]);
+	return 2;
+    }
+
+    for (;;) {
+	if (count == alloc) {
+	    alloc = alloc ? alloc * 2 : 65536;
+	    recs = realloc(recs, alloc * sizeof(*recs));
+	    if (recs == NULL) {
+		perror("ypfstrace realloc");
+		return 2;
+	    }
+	}
+	if (fread(&recs[count], sizeof(*recs), 1, f) != 1)
+	    break;
+
+	name = ypfs_trace_op_name(recs[count].op);
+	if (recs[count].op == YPFS_TRACE_DROPPED)
+	    dropped += recs[count].size;
+	else if (only != NULL && (name == NULL || strcmp(name, only) != 0))
+	    continue;
+	// unsorted, there's no need to keep them
+	if (sort)
+	    count++;
+	else
+	    ypfstrace_print(&header, &recs[count]);
+    }
+    if (ferror(f)) {
+	perror(argv[optind]);
+	return 2;
+    }
+    fclose(f);
+
+    if (sort) {
+	qsort(recs, count, sizeof(*recs), ypfstrace_cmp);
+	for (i = 0; i < count; i++)
+	    ypfstrace_print(&header, &recs[i]);
+    }
+    free(recs);
+
+    if (dropped > 0)
+	fprintf(stderr, "ypfstrace: %" PRIu64 " records were dropped\n", dropped);
+    return 0;
+}